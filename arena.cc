@@ -0,0 +1,80 @@
+#include <new>
+#include <cstdlib>
+#include "arena.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  static const size_t kBlockSize = 64 * 1024;
+  /* keeps the objects behind the header aligned for any type */
+  static const size_t kHeaderSize = 16;
+  static const size_t kAlignment = 16;
+
+  state_arena::state_arena() : m_block( 0 ), m_used( 0 ), m_live( 0 ) {
+  }
+
+  state_arena::~state_arena() {
+    for ( vector<pair<char*, size_t> >::iterator it = m_blocks.begin(); it != m_blocks.end(); ++it ) {
+      free( it->first );
+    }
+  }
+
+  void * state_arena::allocate( size_t size ) {
+    size = ( size + kAlignment - 1 ) & ~( kAlignment - 1 );
+    while ( ( m_block < m_blocks.size() ) && ( m_used + size > m_blocks[m_block].second ) ) {
+      ++m_block;
+      m_used = 0;
+    }
+    if ( m_block == m_blocks.size() ) {
+      size_t block_size = ( size > kBlockSize ) ? size : kBlockSize;
+      char * block = static_cast<char*>( malloc( block_size ) );
+      if ( block == NULL ) {
+	throw bad_alloc();
+      }
+      m_blocks.push_back( make_pair( block, block_size ) );
+      m_used = 0;
+      stats_add( "arena", "blocks" );
+    }
+    void * retval = m_blocks[m_block].first + m_used;
+    m_used += size;
+    ++m_live;
+    return retval;
+  }
+
+  void state_arena::release() {
+    if ( --m_live == 0 ) {
+      m_block = 0;
+      m_used = 0;
+    }
+  }
+
+  void * arena_object::operator new( size_t size ) {
+    char * header = static_cast<char*>( ::operator new( size + kHeaderSize ) );
+    *reinterpret_cast<state_arena**>( header ) = NULL;
+    return header + kHeaderSize;
+  }
+
+  void * arena_object::operator new( size_t size, state_arena & arena ) {
+    char * header = static_cast<char*>( arena.allocate( size + kHeaderSize ) );
+    *reinterpret_cast<state_arena**>( header ) = &arena;
+    return header + kHeaderSize;
+  }
+
+  void arena_object::operator delete( void * ptr ) {
+    if ( ptr == NULL ) {
+      return;
+    }
+    char * header = static_cast<char*>( ptr ) - kHeaderSize;
+    state_arena * arena = *reinterpret_cast<state_arena**>( header );
+    if ( arena != NULL ) {
+      arena->release();
+    } else {
+      ::operator delete( header );
+    }
+  }
+
+  void arena_object::operator delete( void * ptr, state_arena & arena ) {
+    arena.release();
+  }
+}
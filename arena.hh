@@ -0,0 +1,37 @@
+#include <cstddef>
+#include <vector>
+
+#pragma once
+namespace xml2epub {
+
+  /* bump allocator for the output states below a backend root. Freeing an
+     object only counts it; once the last one is gone (the chapter finished)
+     the whole arena is rewound and its blocks are reused for the next chapter. */
+  class state_arena {
+  private:
+    std::vector<std::pair<char*, size_t> > m_blocks;
+    size_t m_block;
+    size_t m_used;
+    size_t m_live;
+    state_arena( const state_arena & );
+    state_arena & operator=( const state_arena & );
+  public:
+    state_arena();
+    ~state_arena();
+    void * allocate( size_t size );
+    void release();
+  };
+
+  /* base of objects that may be placed in a state_arena with
+     new ( arena ) T( ... ). Every allocation carries a header naming its arena,
+     so a plain delete through a base pointer works for both kinds. */
+  class arena_object {
+  public:
+    static void * operator new( size_t size );
+    static void * operator new( size_t size, state_arena & arena );
+    static void operator delete( void * ptr );
+    /* only called if a constructor throws */
+    static void operator delete( void * ptr, state_arena & arena );
+  };
+
+}
@@ -0,0 +1,102 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <iostream>
+#include "batch.hh"
+#include "input.hh"
+#include "pool.hh"
+#include "profile.hh"
+#include "progress.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  class batch_job : public pool_job {
+  private:
+    unsigned int m_line;
+    string m_input, m_output;
+    conversion_options m_options;
+    bool m_failed;
+    string m_error;
+    double m_seconds;
+  public:
+    batch_job( unsigned int line, const string & input, const string & output, const conversion_options & options )
+      : m_line( line ), m_input( input ), m_output( output ), m_options( options ), m_failed( false ), m_seconds( 0. ) {
+    }
+
+    void run() {
+      double start = progress_clock();
+      try {
+	stage_scope stage( "document" );
+	stage.arg( "input", m_input );
+	input_document input( m_input, INPUT_COPIED );
+	parse_file( m_options, input, m_output );
+      } catch ( std::exception & e ) {
+	m_failed = true;
+	m_error = e.what();
+      } catch ( ... ) {
+	m_failed = true;
+	m_error = "unknown error";
+      }
+      m_seconds = progress_clock() - start;
+    }
+
+    /* prints one result line, returns true if the document failed */
+    bool report( ostream & out ) const {
+      if ( m_failed ) {
+	out << "FAILED " << m_input << " (manifest line " << m_line << "): " << m_error << '\n';
+      } else {
+	out << "ok " << m_input << " -> " << m_output << " (" << m_seconds << "s)" << '\n';
+      }
+      return m_failed;
+    }
+  };
+
+  unsigned int run_batch( const std::string & manifest_path, unsigned int jobs,
+			  const conversion_options & defaults ) {
+    ifstream manifest( manifest_path.c_str() );
+    if ( !manifest ) {
+      throw runtime_error( "Unable to open batch manifest \"" + manifest_path + "\"" );
+    }
+    /* several documents report at the same time, so only print the results */
+    conversion_options options( defaults );
+    options.progress_mode = "none";
+    options.cost_model_path = "";
+
+    vector<batch_job*> batch;
+    string line;
+    for ( unsigned int line_number = 1; getline( manifest, line ); ++line_number ) {
+      stringstream ss( line );
+      string input, output, backend;
+      if ( !( ss >> input ) || ( input[0] == '#' ) ) {
+	continue;
+      }
+      if ( !( ss >> output >> backend ) || ( ( backend != "html" ) && ( backend != "latex" ) ) ) {
+	stringstream err;
+	err << "Invalid manifest line " << line_number << ", expected: <input> <output> <html|latex>";
+	throw runtime_error( err.str().c_str() );
+      }
+      options.html = ( backend == "html" );
+      batch.push_back( new batch_job( line_number, input, output, options ) );
+    }
+
+    {
+      worker_pool pool( jobs );
+      for ( vector<batch_job*>::iterator it = batch.begin(); it != batch.end(); ++it ) {
+	pool.submit( *it );
+      }
+      pool.wait();
+    }
+
+    unsigned int failed = 0;
+    for ( vector<batch_job*>::iterator it = batch.begin(); it != batch.end(); ++it ) {
+      if ( (*it)->report( cerr ) ) {
+	failed++;
+      }
+      delete *it;
+    }
+    cerr << ( batch.size() - failed ) << " of " << batch.size() << " documents converted" << '\n';
+    return failed;
+  }
+}
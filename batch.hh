@@ -0,0 +1,15 @@
+#include <string>
+#include "parse.hh"
+
+#pragma once
+namespace xml2epub {
+
+  /* converts every document listed in the manifest with up to jobs documents
+     in parallel. Each manifest line holds an input file, an output path and a
+     backend (html or latex) separated by white space; empty lines and lines
+     starting with # are ignored. A failing document is reported and does not
+     abort the batch. Returns the number of failed documents. */
+  unsigned int run_batch( const std::string & manifest_path, unsigned int jobs,
+			  const conversion_options & defaults );
+
+}
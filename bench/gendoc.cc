@@ -0,0 +1,158 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <boost/program_options.hpp>
+
+namespace po = boost::program_options;
+using namespace std;
+
+/* generates synthetic xml2epub documents of configurable size and feature mix
+   for the benchmark harness */
+
+struct doc_params {
+  unsigned int chapters;
+  unsigned int paragraphs;
+  unsigned int unicode_math;
+  unsigned int tex_math;
+  unsigned int equations;
+  unsigned int plots;
+  unsigned int figures;
+  bool distinct;
+  string figure_path;
+};
+
+static const char * kUnicodeMath[] = {
+  "\\alpha+\\beta", "\\nabla\\times H_0=0", "\\mathbf{r}_{i}", "x^2\\pm\\infty", "\\partial_t E", NULL
+};
+
+static const char * kTexMath[] = {
+  "\\frac{a}{b}", "\\sqrt{x^2+y^2}", "\\int_0^1 f(x)\\,dx", "\\hat{n}\\cdot\\vec{k}", "\\binom{n}{k}", NULL
+};
+
+static const char * kLorem = 
+  "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor "
+  "incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud "
+  "exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.";
+
+static const char * pick( const char ** list, unsigned int i ) {
+  unsigned int n = 0;
+  while ( list[n] != NULL ) {
+    n++;
+  }
+  return list[i % n];
+}
+
+/* returns true if the i-th of count items falls into paragraph p of total */
+static bool spread( unsigned int count, unsigned int p, unsigned int total, unsigned int & index ) {
+  if ( ( count == 0 ) || ( total == 0 ) ) {
+    return false;
+  }
+  unsigned int first = ( p * count ) / total;
+  unsigned int last = ( ( p + 1 ) * count ) / total;
+  index = first;
+  return last > first;
+}
+
+static void write_figure( const string & path ) {
+  ofstream svg( path.c_str() );
+  if ( !svg ) {
+    throw runtime_error( "Unable to create figure file" );
+  }
+  svg << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  svg << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"200\" height=\"100\">\n";
+  svg << "<rect x=\"10\" y=\"10\" width=\"180\" height=\"80\" fill=\"none\" stroke=\"black\"/>\n";
+  svg << "<circle cx=\"100\" cy=\"50\" r=\"30\" fill=\"gray\"/>\n";
+  svg << "</svg>\n";
+}
+
+static void write_document( const doc_params & p, ostream & out ) {
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n";
+  out << "<document>\n";
+  unsigned int counter = 0;
+  for ( unsigned int c=0; c<p.chapters; ++c ) {
+    out << "  <chapter name=\"Chapter " << ( c + 1 ) << "\">\n";
+    for ( unsigned int i=0; i<p.paragraphs; ++i ) {
+      unsigned int k;
+      unsigned int variant = p.distinct ? counter++ : 0;
+      if ( ( i % 20 ) == 0 ) {
+	out << "    <section name=\"Section " << ( c + 1 ) << "." << ( i / 20 + 1 ) << "\">\n";
+      }
+      out << "      " << kLorem << " <b>Bold text " << i << "</b>.\n";
+      if ( spread( p.unicode_math, i, p.paragraphs, k ) ) {
+	out << "      We find <math>" << pick( kUnicodeMath, k + variant ) << "</math> here.\n";
+      }
+      if ( spread( p.tex_math, i, p.paragraphs, k ) ) {
+	out << "      And <math>" << pick( kTexMath, k + variant ) << ( p.distinct ? "+" : "" );
+	if ( p.distinct ) {
+	  out << variant;
+	}
+	out << "</math> there.\n";
+      }
+      if ( spread( p.equations, i, p.paragraphs, k ) ) {
+	out << "      <equation label=\"eqn:" << c << "_" << i << "\">\n";
+	out << "\t\\frac{\\partial H}{\\partial t}=-\\nabla\\times E";
+	if ( p.distinct ) {
+	  out << "+" << variant;
+	}
+	out << "\n      </equation>\n";
+      }
+      if ( spread( p.plots, i, p.paragraphs, k ) ) {
+	out << "      <plot label=\"plot:" << c << "_" << i << "\">\n";
+	out << "\tplot sin(" << ( p.distinct ? variant + 1 : 1 ) << "*x) t \"Sine Wave\"\n";
+	out << "      </plot>\n";
+      }
+      if ( spread( p.figures, i, p.paragraphs, k ) ) {
+	out << "      <figure label=\"fig:" << c << "_" << i << "\">\n";
+	out << "\t<image src=\"" << p.figure_path << "\"/>\n";
+	out << "\t<caption>Generated figure " << k << ".</caption>\n";
+	out << "      </figure>\n";
+      }
+      out << "      <np/>\n";
+      if ( ( ( i % 20 ) == 19 ) || ( i + 1 == p.paragraphs ) ) {
+	out << "    </section>\n";
+      }
+    }
+    out << "  </chapter>\n";
+  }
+  out << "</document>\n";
+}
+
+int main( int argc, char * argv[] ) {
+  doc_params p;
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ( "help,h", "produce help message" )
+    ( "chapters,c", po::value<unsigned int>(&p.chapters)->default_value(4), "number of chapters" )
+    ( "paragraphs,p", po::value<unsigned int>(&p.paragraphs)->default_value(40), "paragraphs per chapter" )
+    ( "unicode-math", po::value<unsigned int>(&p.unicode_math)->default_value(10), "inline math per chapter that maps to unicode" )
+    ( "tex-math", po::value<unsigned int>(&p.tex_math)->default_value(2), "inline math per chapter that needs TeX" )
+    ( "equations", po::value<unsigned int>(&p.equations)->default_value(2), "display equations per chapter" )
+    ( "plots", po::value<unsigned int>(&p.plots)->default_value(1), "plots per chapter" )
+    ( "figures", po::value<unsigned int>(&p.figures)->default_value(1), "figures per chapter" )
+    ( "distinct", po::value<bool>(&p.distinct)->default_value(true), "make every formula and plot unique" )
+    ( "figure-file", po::value<string>(&p.figure_path)->default_value("bench_figure.svg"), "svg file written and referenced by figures" )
+    ( "output-file,o", po::value<string>(), "output xml file (default is standard output)" );
+  po::variables_map vm;
+  po::store( po::parse_command_line( argc, argv, desc ), vm );
+  po::notify( vm );
+
+  if ( vm.count("help") ) {
+    cout << desc << endl;
+    return 0;
+  }
+  if ( p.figures != 0 ) {
+    write_figure( p.figure_path );
+  }
+  if ( vm.count("output-file") ) {
+    ofstream out( vm["output-file"].as<string>().c_str() );
+    if ( !out ) {
+      cerr << "Unable to open output file" << endl;
+      return -1;
+    }
+    write_document( p, out );
+  } else {
+    write_document( p, cout );
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+#!/bin/bash
+#
+# Benchmark harness for xml2epub.
+#
+# Generates synthetic documents of increasing size (plus every *.xml found in
+# an optional corpus directory), converts each with the html and the latex
+# backend and collects the per-stage report written by "xml2epub --profile".
+# Results are compared against a stored baseline; stages that got slower than
+# the threshold are reported as regressions and make the script fail.
+#
+# usage: run_bench.sh [options] <xml2epub binary> <gendoc binary>
+#   --corpus DIR        also convert every DIR/*.xml (end-to-end corpus mode)
+#   --baseline FILE     baseline to compare against (default bench/baseline.txt)
+#   --update-baseline   store the results of this run as the new baseline
+#   --threshold PCT     allowed slowdown in percent (default 20)
+#   --quick             only run the smallest generated document
+
+set -e
+
+SCRIPTDIR=`dirname "$0"`
+BASELINE="${SCRIPTDIR}/baseline.txt"
+CORPUS=""
+UPDATE=0
+THRESHOLD=20
+QUICK=0
+
+while [[ $# -gt 2 ]]; do
+    case "$1" in
+	--corpus) CORPUS="$2"; shift 2 ;;
+	--baseline) BASELINE="$2"; shift 2 ;;
+	--update-baseline) UPDATE=1; shift ;;
+	--threshold) THRESHOLD="$2"; shift 2 ;;
+	--quick) QUICK=1; shift ;;
+	*) echo "Unknown option $1"; exit 1 ;;
+    esac
+done
+
+if [[ $# -ne 2 ]]; then
+    echo "usage: $0 [options] <xml2epub binary> <gendoc binary>"
+    exit 1
+fi
+
+XML2EPUB=`readlink -f "$1"`
+GENDOC=`readlink -f "$2"`
+WORKDIR=`mktemp -d /tmp/xml2epub_bench.XXXXXX`
+RESULTS="${WORKDIR}/results.txt"
+trap 'rm -rf "${WORKDIR}"' EXIT
+
+cd "${WORKDIR}"
+
+# name chapters paragraphs unicode-math tex-math equations plots figures
+SIZES="small 2 20 10 2 2 1 1
+medium 8 100 40 8 4 2 2
+large 32 400 160 16 8 2 2"
+if [[ ${QUICK} -eq 1 ]]; then
+    SIZES=`echo "${SIZES}" | head -n 1`
+fi
+
+DOCS=""
+while read name chapters paragraphs umath tmath eqns plots figs; do
+    "${GENDOC}" -c ${chapters} -p ${paragraphs} --unicode-math ${umath} --tex-math ${tmath} \
+	--equations ${eqns} --plots ${plots} --figures ${figs} \
+	--figure-file "${WORKDIR}/figure.svg" -o "${WORKDIR}/${name}.xml"
+    DOCS="${DOCS} ${WORKDIR}/${name}.xml"
+done <<< "${SIZES}"
+
+if [[ -n "${CORPUS}" ]]; then
+    for f in "${CORPUS}"/*.xml; do
+	[[ -e "$f" ]] && DOCS="${DOCS} `readlink -f "$f"`"
+    done
+fi
+
+: > "${RESULTS}"
+for doc in ${DOCS}; do
+    name=`basename "${doc}" .xml`
+    for backend in html latex; do
+	if [[ ${backend} = html ]]; then
+	    flags="-l false -o ${WORKDIR}/out_${name}_html"
+	else
+	    flags="-l true -o ${WORKDIR}/out_${name}.tex"
+	fi
+	start=`date +%s.%N`
+	( cd `dirname "${doc}"` && "${XML2EPUB}" ${flags} -i "${doc}" --profile "${WORKDIR}/profile.txt" 2> /dev/null )
+	end=`date +%s.%N`
+	echo "${name} ${backend} total `echo "${end} - ${start}" | bc`" >> "${RESULTS}"
+	awk -v doc="${name}" -v be="${backend}" '
+	    $1 == "stage" { print doc, be, "stage:" $2, $4, $5, $6 }
+	    $1 == "process" { print doc, be, "processes:" $2 ":" $3, $4 }
+	    $1 == "peak_rss_kb" || $1 == "peak_child_rss_kb" { print doc, be, $1, $2 }
+	' "${WORKDIR}/profile.txt" >> "${RESULTS}"
+    done
+done
+
+echo "# <document> <backend> <metric> <wall s|count|kb> [<cpu s> <child cpu s>]"
+cat "${RESULTS}"
+
+if [[ ${UPDATE} -eq 1 ]]; then
+    cp "${RESULTS}" "${BASELINE}"
+    echo "Baseline written to ${BASELINE}"
+    exit 0
+fi
+
+if [[ ! -e "${BASELINE}" ]]; then
+    echo "No baseline found at ${BASELINE}, run with --update-baseline to create one"
+    exit 0
+fi
+
+# wall times below 50ms are too noisy to compare
+awk -v threshold="${THRESHOLD}" '
+    NR == FNR { base[$1 " " $2 " " $3] = $4; next }
+    {
+	key = $1 " " $2 " " $3
+	if ( !( key in base ) ) next
+	if ( $3 == "total" || $3 ~ /^stage:/ ) {
+	    if ( base[key] >= 0.05 && $4 > base[key] * ( 1 + threshold / 100 ) ) {
+		printf "REGRESSION %s: %.3fs -> %.3fs\n", key, base[key], $4
+		failed = 1
+	    }
+	} else if ( $4 > base[key] * ( 1 + threshold / 100 ) ) {
+	    printf "REGRESSION %s: %d -> %d\n", key, base[key], $4
+	    failed = 1
+	}
+    }
+    END { exit failed }
+' "${BASELINE}" "${RESULTS}"
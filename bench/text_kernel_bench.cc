@@ -0,0 +1,107 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <sys/time.h>
+#include "text_kernel.hh"
+
+using namespace std;
+using namespace xml2epub;
+
+/* compares the simd text kernel against the scalar path on generated prose */
+
+static double now() {
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static string make_text( size_t size, unsigned int special_every ) {
+  static const char * kWords[] = { "the", "field", "propagates", "through", "a", "dielectric", "medium",
+				   "where", "boundary", "conditions", "apply", NULL };
+  string retval;
+  unsigned int n = 0;
+  srandom( 42 );
+  while ( retval.size() < size ) {
+    unsigned int count = 0;
+    while ( kWords[count] != NULL ) {
+      ++count;
+    }
+    retval += kWords[random() % count];
+    if ( ( special_every != 0 ) && ( ++n % special_every == 0 ) ) {
+      /* every latex special now and then */
+      static const char * kSpecials[] = { "_%", "&#", "${}", "\\", "^", "~" };
+      retval += kSpecials[( n / special_every ) % ( sizeof(kSpecials) / sizeof(kSpecials[0]) )];
+    }
+    /* mostly single spaces, sometimes the indentation of a new source line */
+    retval += ( random() % 12 == 0 ) ? "\n      " : " ";
+  }
+  return retval;
+}
+
+typedef void (*normalize_function)( const char *, size_t, text_escape, string & );
+
+static double run( normalize_function f, const string & text, text_escape escape, unsigned int rounds, string & out ) {
+  double start = now();
+  for ( unsigned int i=0; i<rounds; ++i ) {
+    out.clear();
+    f( text.data(), text.size(), escape, out );
+  }
+  return now() - start;
+}
+
+int main( int argc, char * argv[] ) {
+  size_t size = ( argc > 1 ) ? atol( argv[1] ) : 16 * 1024 * 1024;
+  unsigned int rounds = ( argc > 2 ) ? atoi( argv[2] ) : 10;
+  cout << "kernel: " << text_kernel_name() << endl;
+  {
+    /* the escapes themselves, on a text long enough for the simd loops */
+    string text = "a\\b^c~d&e%f$g#h_i{j}k  l\n";
+    text += text + text;
+    string expected = "a\\textbackslash{}b\\textasciicircum{}c\\textasciitilde{}d\\&e\\%f\\$g\\#h\\_i\\{j\\}k l ";
+    expected += expected + expected;
+    string simd_out, scalar_out;
+    normalize_text( text.data(), text.size(), ESCAPE_LATEX, simd_out );
+    normalize_text_scalar( text.data(), text.size(), ESCAPE_LATEX, scalar_out );
+    if ( ( simd_out != expected ) || ( scalar_out != expected ) ) {
+      cerr << "latex escape mismatch" << endl;
+      return 1;
+    }
+  }
+  unsigned int specials[] = { 0, 50, 5 };
+  for ( unsigned int s=0; s<3; ++s ) {
+    string text = make_text( size, specials[s] );
+    for ( int e=0; e<2; ++e ) {
+      text_escape escape = ( e == 0 ) ? ESCAPE_NONE : ESCAPE_LATEX;
+      string simd_out, scalar_out;
+      double simd = run( normalize_text, text, escape, rounds, simd_out );
+      double scalar = run( normalize_text_scalar, text, escape, rounds, scalar_out );
+      if ( simd_out != scalar_out ) {
+	cerr << "output mismatch" << endl;
+	return 1;
+      }
+      double mb = double( text.size() ) * rounds / ( 1024. * 1024. );
+      printf( "%-6s special every %2u words: simd %8.1f MB/s  scalar %8.1f MB/s  speedup %.2f\n",
+	      ( e == 0 ) ? "html" : "latex", specials[s], mb / simd, mb / scalar, scalar / simd );
+    }
+  }
+  {
+    string blank( size, ' ' );
+    blank += "x";
+    double start = now();
+    size_t sum = 0;
+    for ( unsigned int i=0; i<rounds; ++i ) {
+      sum += skip_white_space( blank.data(), blank.size() );
+    }
+    double simd = now() - start;
+    start = now();
+    for ( unsigned int i=0; i<rounds; ++i ) {
+      sum -= skip_white_space_scalar( blank.data(), blank.size() );
+    }
+    double scalar = now() - start;
+    double mb = double( blank.size() ) * rounds / ( 1024. * 1024. );
+    printf( "white space skip: simd %8.1f MB/s  scalar %8.1f MB/s  speedup %.2f%s\n",
+	    mb / simd, mb / scalar, scalar / simd, ( sum == 0 ) ? "" : " (MISMATCH)" );
+  }
+  return 0;
+}
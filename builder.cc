@@ -1,10 +1,15 @@
 #include <stdexcept>
 #include "builder.hh"
+#include "text_kernel.hh"
 
 using namespace std;
 
 namespace xml2epub {
-  void output_state::put_text( const std::string & str ) {
+  bool text_view::is_white_space() const {
+    return skip_white_space( m_data, m_size ) == m_size;
+  }
+
+  void output_state::put_text( const text_view & text ) {
     throw runtime_error( "text not supported in this environment" );
   }
 
@@ -44,11 +49,15 @@ namespace xml2epub {
     throw runtime_error( "chapter statement unsupported in this state" );
   }
 
+  void output_state::skip_chapter( const std::string & chapter_name, const std::string & label ) {
+    throw runtime_error( "skipping chapters unsupported in this state" );
+  }
+
   output_state * output_state::plot( const std::string & label ) {
     throw runtime_error( "plot statement unsupported in this state" );
   }
 
-  output_state * output_state::table() {
+  output_state * output_state::table( const std::string & src ) {
     throw runtime_error( "table statement unsupported in this state" );
   }
 
@@ -1,18 +1,41 @@
 #include <string>
+#include <cstddef>
 #pragma once
 
 namespace xml2epub {
+  /* text handed to an output_state without copying it. The view does not own
+     the characters, they are only valid for the duration of the call that
+     received it; a state that needs the text later (formula sources, plot
+     data) has to copy it. */
+  class text_view {
+  private:
+    const char * m_data;
+    size_t m_size;
+  public:
+    text_view() : m_data( "" ), m_size( 0 ) {}
+    text_view( const char * data, size_t size ) : m_data( data ), m_size( size ) {}
+    text_view( const std::string & str ) : m_data( str.data() ), m_size( str.size() ) {}
+    const char * data() const { return m_data; }
+    size_t size() const { return m_size; }
+    const char * begin() const { return m_data; }
+    const char * end() const { return m_data + m_size; }
+    std::string str() const { return std::string( m_data, m_size ); }
+    void append_to( std::string & buffer ) const { buffer.append( m_data, m_size ); }
+    /* only ' ', '\t', '\r' and '\n' */
+    bool is_white_space() const;
+  };
+
   class output_state {
   public:
     virtual ~output_state() {}
-    virtual void put_text( const std::string & str );
+    virtual void put_text( const text_view & text );
     virtual void newline();
     virtual void new_paragraph();
     virtual output_state * bold();
     virtual output_state * math();
     virtual output_state * equation( const std::string & label );
 
-    virtual output_state * table();
+    virtual output_state * table( const std::string & src );
     virtual output_state * table_row();
     virtual output_state * table_cell();
     virtual void reference( const std::string & label );
@@ -20,6 +43,8 @@ namespace xml2epub {
 
     virtual output_state * section( const std::string & section_name, unsigned int level, const std::string & label );  
     virtual output_state * chapter( const std::string & chapter_name, const std::string & label );
+    /* the chapter is unchanged since the last conversion into the same output */
+    virtual void skip_chapter( const std::string & chapter_name, const std::string & label );
     virtual output_state * plot( const std::string & label );
     virtual output_state * figure( const std::string & label );
     virtual output_state * caption( );
@@ -0,0 +1,11 @@
+#pragma once
+namespace xml2epub {
+
+  /* offline resolution of the XHTML 1.0 DTDs and entity sets our inputs
+     declare. The entity declarations are compiled in and installed as the
+     libxml external entity loader once per process, so batch and daemon
+     conversions share them. Remote entities that are not in the catalog
+     are refused rather than fetched. */
+  void install_entity_catalog();
+
+}
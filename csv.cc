@@ -0,0 +1,70 @@
+#include <stdexcept>
+#include <sstream>
+#include <cstdio>
+#include "csv.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  csv_reader::csv_reader( istream & in, char separator )
+    : m_in( in ), m_separator( separator ), m_line( 0 ) {
+  }
+
+  bool csv_reader::next_row( vector<string> & cells ) {
+    size_t num_cells = 0;
+    bool in_quotes = false;
+    bool have_data = false;
+    bool quoted = false;
+    string * cell = NULL;
+    for ( int c = m_in.get(); ; c = m_in.get() ) {
+      if ( cell == NULL ) {
+	if ( num_cells == cells.size() ) {
+	  cells.push_back( string() );
+	}
+	cell = &cells[num_cells++];
+	cell->clear();
+      }
+      if ( c == EOF ) {
+	if ( in_quotes ) {
+	  stringstream ss;
+	  ss << "Unterminated quoted csv field in line " << ( m_line + 1 );
+	  throw runtime_error( ss.str().c_str() );
+	}
+	break;
+      }
+      have_data = true;
+      if ( in_quotes ) {
+	if ( c == '"' ) {
+	  if ( m_in.peek() == '"' ) {
+	    m_in.get();
+	    *cell += '"';
+	  } else {
+	    in_quotes = false;
+	  }
+	} else {
+	  if ( c == '\n' ) {
+	    m_line++;
+	  }
+	  *cell += static_cast<char>(c);
+	}
+      } else if ( c == '"' ) {
+	in_quotes = true;
+	quoted = true;
+      } else if ( c == m_separator ) {
+	cell = NULL;
+      } else if ( c == '\n' ) {
+	m_line++;
+	if ( ( num_cells == 1 ) && cell->empty() && ( quoted == false ) ) {
+	  /* skip blank lines */
+	  have_data = false;
+	  continue;
+	}
+	break;
+      } else if ( c != '\r' ) {
+	*cell += static_cast<char>(c);
+      }
+    }
+    cells.resize( num_cells );
+    return have_data;
+  }
+}
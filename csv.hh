@@ -0,0 +1,22 @@
+#include <string>
+#include <vector>
+#include <iostream>
+
+#pragma once
+namespace xml2epub {
+
+  /* reads comma separated values one row at a time so that arbitrarily large
+     tables can be streamed into the output without holding them in memory */
+  class csv_reader {
+  private:
+    std::istream & m_in;
+    char m_separator;
+    unsigned long m_line;
+  public:
+    csv_reader( std::istream & in, char separator = ',' );
+    /* returns false at end of input; cells is re-used between calls */
+    bool next_row( std::vector<std::string> & cells );
+    unsigned long line() const { return m_line; }
+  };
+
+}
@@ -0,0 +1,169 @@
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <unistd.h>
+#include "fallback.hh"
+#include "latex2util.hh"
+#include "render_cache.hh"
+#include "import.hh"
+#include "pool.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  static std::vector<unsigned int> gFallbackDpis;
+  static unsigned int gFallbackThreads = 0;
+
+  void set_png_fallback_dpis( const std::vector<unsigned int> & dpis ) {
+    gFallbackDpis = dpis;
+    sort( gFallbackDpis.begin(), gFallbackDpis.end() );
+    gFallbackDpis.erase( unique( gFallbackDpis.begin(), gFallbackDpis.end() ), gFallbackDpis.end() );
+  }
+
+  const std::vector<unsigned int> & png_fallback_dpis() {
+    return gFallbackDpis;
+  }
+
+  void set_png_fallback_threads( unsigned int threads ) {
+    gFallbackThreads = threads;
+  }
+
+  /* shared by all documents, so that parallel conversions don't each start
+     their own threads. Created on first use, with the size set then. */
+  static worker_pool & fallback_pool() {
+    static worker_pool pool( ( gFallbackThreads != 0 ) ? gFallbackThreads : hardware_threads() );
+    return pool;
+  }
+
+  static string rendition_key( const std::string & key, unsigned int dpi ) {
+    stringstream ss;
+    ss << "png@" << dpi << ":" << key;
+    return ss.str();
+  }
+
+  /* renders the missing resolutions of one image */
+  class png_fallback_job : public pool_job {
+  private:
+    png_fallbacks & m_owner;
+    std::string m_pdf;
+    double m_scale_factor;
+    std::vector<unsigned int> m_dpis;
+    std::vector<std::string> m_keys;
+    std::vector<std::string> m_paths;
+  public:
+    png_fallback_job( png_fallbacks & owner, const std::string & pdf, double scale_factor )
+      : m_owner( owner ), m_pdf( pdf ), m_scale_factor( scale_factor ) {}
+    void add( unsigned int dpi, const std::string & key, const std::string & path ) {
+      m_dpis.push_back( dpi );
+      m_keys.push_back( key );
+      m_paths.push_back( path );
+    }
+    void run() {
+      string error;
+      try {
+	vector<string> pngs;
+	vector<double> seconds;
+	pdf_data2png( m_pdf, m_dpis, pngs, m_scale_factor, &seconds );
+	for ( size_t i=0; i<m_dpis.size(); ++i ) {
+	  global_render_cache().store( m_keys[i], pngs[i] );
+	  write_file_atomically( m_paths[i], pngs[i] );
+	  stringstream name;
+	  name << m_dpis[i] << "dpi_";
+	  stats_add( "png_fallback", name.str() + "images" );
+	  stats_add( "png_fallback", name.str() + "bytes", pngs[i].size() );
+	  stats_add( "png_fallback", name.str() + "usec", static_cast<unsigned long>( seconds[i] * 1e6 ) );
+	}
+      } catch ( std::exception & e ) {
+	error = e.what();
+	if ( error.size() == 0 ) {
+	  error = "png rendering failed";
+	}
+      }
+      m_owner.job_done( error );
+    }
+  };
+
+  png_fallbacks::png_fallbacks() : m_pending( 0 ) {
+    pthread_mutex_init( &m_mutex, NULL );
+    pthread_cond_init( &m_done_cond, NULL );
+  }
+
+  png_fallbacks::~png_fallbacks() {
+    /* the jobs refer to this */
+    wait_for_jobs();
+    pthread_cond_destroy( &m_done_cond );
+    pthread_mutex_destroy( &m_mutex );
+  }
+
+  void png_fallbacks::job_done( const std::string & error ) {
+    pthread_mutex_lock( &m_mutex );
+    if ( ( error.size() != 0 ) && ( m_error.size() == 0 ) ) {
+      m_error = error;
+    }
+    --m_pending;
+    pthread_cond_broadcast( &m_done_cond );
+    pthread_mutex_unlock( &m_mutex );
+  }
+
+  void png_fallbacks::wait_for_jobs() {
+    pthread_mutex_lock( &m_mutex );
+    while ( m_pending != 0 ) {
+      pthread_cond_wait( &m_done_cond, &m_mutex );
+    }
+    pthread_mutex_unlock( &m_mutex );
+    for ( size_t i=0; i<m_jobs.size(); ++i ) {
+      delete m_jobs[i];
+    }
+    m_jobs.clear();
+  }
+
+  void png_fallbacks::wait() {
+    wait_for_jobs();
+    string error;
+    pthread_mutex_lock( &m_mutex );
+    error.swap( m_error );
+    pthread_mutex_unlock( &m_mutex );
+    if ( error.size() != 0 ) {
+      throw runtime_error( "png fallback: " + error );
+    }
+  }
+
+  std::vector<std::string> png_fallbacks::request( const std::string & key, image_renderer & pdf_source, double scale_factor,
+						   const std::string & directory ) {
+    vector<string> file_names;
+    png_fallback_job * job = NULL;
+    for ( size_t i=0; i<gFallbackDpis.size(); ++i ) {
+      string dpi_key = rendition_key( key, gFallbackDpis[i] );
+      string file_name = content_hash( dpi_key ) + ".png";
+      string path = directory + "/" + file_name;
+      file_names.push_back( file_name );
+      string png;
+      if ( ( m_queued.count( path ) != 0 ) || ( access( path.c_str(), F_OK ) == 0 ) ) {
+	/* same image already used in this output */
+	stats_add( "render_cache", "file_hit" );
+      } else if ( global_render_cache().lookup( dpi_key, png ) ) {
+	make_directories( directory );
+	write_file_atomically( path, png );
+      } else {
+	if ( job == NULL ) {
+	  stringstream pdf;
+	  pdf_source.render( pdf );
+	  job = new png_fallback_job( *this, pdf.str(), scale_factor );
+	}
+	job->add( gFallbackDpis[i], dpi_key, path );
+	m_queued.insert( path );
+      }
+    }
+    if ( job != NULL ) {
+      make_directories( directory );
+      m_jobs.push_back( job );
+      pthread_mutex_lock( &m_mutex );
+      ++m_pending;
+      pthread_mutex_unlock( &m_mutex );
+      fallback_pool().submit( job );
+    }
+    return file_names;
+  }
+
+}
@@ -0,0 +1,48 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <pthread.h>
+
+#pragma once
+namespace xml2epub {
+
+  class image_renderer;
+  class png_fallback_job;
+
+  /* resolutions (dots per inch) of the png copies of formulas and plots for
+     readers without svg support, none by default */
+  void set_png_fallback_dpis( const std::vector<unsigned int> & dpis );
+  const std::vector<unsigned int> & png_fallback_dpis();
+  /* threads rendering the png copies, the number of cpus by default. Only
+     takes effect before the first image is requested. */
+  void set_png_fallback_threads( unsigned int threads );
+
+  /* the png renditions of the images of one html document. Missing ones
+     are rendered on a pool shared by all documents while the conversion
+     goes on. */
+  class png_fallbacks {
+  private:
+    friend class png_fallback_job;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_done_cond;
+    unsigned int m_pending;
+    std::string m_error;
+    std::vector<png_fallback_job*> m_jobs;
+    /* files of the queued jobs, they may not exist yet */
+    std::set<std::string> m_queued;
+    void job_done( const std::string & error );
+    void wait_for_jobs();
+  public:
+    png_fallbacks();
+    ~png_fallbacks();
+    /* file names of the renditions of the image key in directory, one per
+       dpi. pdf_source writes the pdf they are rendered from, it is only
+       asked for if a rendition is neither in the directory nor in the
+       render cache. */
+    std::vector<std::string> request( const std::string & key, image_renderer & pdf_source, double scale_factor,
+				      const std::string & directory );
+    /* blocks until every requested file is written, throws the first error */
+    void wait();
+  };
+
+}
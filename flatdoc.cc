@@ -0,0 +1,321 @@
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "flatdoc.hh"
+#include "output_sink.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  static const char * const kTagNames[TAG_COUNT] = {
+    "#text", "document", "chapter", "section", "subsection", "subsubsection", "b", "math",
+    "equation", "figure", "image", "caption", "plot", "br", "np", "table", "tr", "td", "ref", "cite"
+  };
+
+  static const char * const kAttributeNames[ATTR_COUNT] = {
+    "label", "name", "src", "id"
+  };
+
+  /* bump the version whenever flat_node or flat_attribute change */
+  static const char kMagic[8] = { 'X', '2', 'E', 'F', 'L', 'A', 'T', '1' };
+
+  struct file_header {
+    char magic[8];
+    uint32_t node_count;
+    uint32_t attribute_count;
+    uint32_t text_size;
+    uint32_t reserved;
+  };
+
+  const char * tag_name( unsigned int tag ) {
+    return ( tag < TAG_COUNT ) ? kTagNames[tag] : "";
+  }
+
+  /* TAG_COUNT for unknown elements */
+  static uint32_t intern_tag( const char * name ) {
+    for ( unsigned int i=1; i<TAG_COUNT; ++i ) {
+      if ( strcmp( name, kTagNames[i] ) == 0 ) {
+	return i;
+      }
+    }
+    return TAG_COUNT;
+  }
+
+  flat_document::flat_document()
+    : m_nodes( NULL ), m_node_count( 0 ), m_attributes( NULL ), m_attribute_count( 0 ),
+      m_text( NULL ), m_text_size( 0 ), m_map( NULL ), m_map_size( 0 ) {
+  }
+
+  flat_document::~flat_document() {
+    unmap();
+  }
+
+  void flat_document::unmap() {
+    if ( m_map != NULL ) {
+      munmap( m_map, m_map_size );
+      m_map = NULL;
+      m_map_size = 0;
+    }
+  }
+
+  void flat_document::attach_storage() {
+    m_nodes = m_node_storage.empty() ? NULL : &m_node_storage[0];
+    m_node_count = m_node_storage.size();
+    m_attributes = m_attribute_storage.empty() ? NULL : &m_attribute_storage[0];
+    m_attribute_count = m_attribute_storage.size();
+    m_text = m_text_storage.data();
+    m_text_size = m_text_storage.size();
+  }
+
+  void flat_document::build( const xmlNode * root ) {
+    unmap();
+    m_node_storage.clear();
+    m_attribute_storage.clear();
+    m_text_storage.clear();
+    /* last child of every node added so far, to append siblings in O(1) */
+    vector<uint32_t> last_child;
+    vector<uint32_t> open;
+    /* unknown elements are collected, so that all of them are reported at once */
+    stringstream unknown;
+    unsigned int unknown_count = 0;
+    const xmlNode * cur = root;
+    while ( cur != NULL ) {
+      flat_node node;
+      node.parent = open.empty() ? kNoNode : open.back();
+      node.first_child = kNoNode;
+      node.next_sibling = kNoNode;
+      node.line = xmlGetLineNo( const_cast<xmlNode*>( cur ) );
+      node.first = 0;
+      node.count = 0;
+      bool keep = true;
+      if ( cur->type == XML_ELEMENT_NODE ) {
+	node.tag = intern_tag( reinterpret_cast<const char*>( cur->name ) );
+	if ( node.tag == TAG_COUNT ) {
+	  unknown << "Unknown element with name \"" << cur->name << "\" found in line " << node.line << "!" << endl;
+	  ++unknown_count;
+	}
+	node.first = m_attribute_storage.size();
+	for ( const xmlAttr * attr = cur->properties; attr != NULL; attr = attr->next ) {
+	  for ( unsigned int i=0; i<ATTR_COUNT; ++i ) {
+	    if ( strcmp( reinterpret_cast<const char*>( attr->name ), kAttributeNames[i] ) == 0 ) {
+	      xmlChar * value = xmlNodeGetContent( reinterpret_cast<const xmlNode*>( attr ) );
+	      flat_attribute a;
+	      a.id = i;
+	      a.offset = m_text_storage.size();
+	      a.length = ( value != NULL ) ? strlen( reinterpret_cast<const char*>( value ) ) : 0;
+	      if ( value != NULL ) {
+		m_text_storage.append( reinterpret_cast<const char*>( value ), a.length );
+		xmlFree( value );
+	      }
+	      m_attribute_storage.push_back( a );
+	      break;
+	    }
+	  }
+	}
+	node.count = m_attribute_storage.size() - node.first;
+      } else if ( ( cur->type == XML_TEXT_NODE ) || ( cur->type == XML_CDATA_SECTION_NODE ) ) {
+	node.tag = TAG_TEXT;
+	node.first = m_text_storage.size();
+	if ( cur->content != NULL ) {
+	  node.count = strlen( reinterpret_cast<const char*>( cur->content ) );
+	  m_text_storage.append( reinterpret_cast<const char*>( cur->content ), node.count );
+	}
+      } else {
+	keep = false;
+      }
+
+      bool descend = false;
+      if ( keep ) {
+	uint32_t index = m_node_storage.size();
+	m_node_storage.push_back( node );
+	last_child.push_back( kNoNode );
+	if ( node.parent != kNoNode ) {
+	  uint32_t & previous = last_child[node.parent];
+	  if ( previous == kNoNode ) {
+	    m_node_storage[node.parent].first_child = index;
+	  } else {
+	    m_node_storage[previous].next_sibling = index;
+	  }
+	  previous = index;
+	}
+	if ( ( cur->type == XML_ELEMENT_NODE ) && ( cur->children != NULL ) ) {
+	  open.push_back( index );
+	  descend = true;
+	}
+      }
+
+      if ( descend ) {
+	cur = cur->children;
+	continue;
+      }
+      /* next node in document order below root */
+      while ( ( cur != root ) && ( cur->next == NULL ) ) {
+	cur = cur->parent;
+	open.pop_back();
+      }
+      cur = ( cur == root ) ? NULL : cur->next;
+    }
+    if ( unknown_count != 0 ) {
+      m_node_storage.clear();
+      m_attribute_storage.clear();
+      m_text_storage.clear();
+      attach_storage();
+      throw runtime_error( unknown.str() );
+    }
+    attach_storage();
+  }
+
+  /* every index and offset of a mapped file is checked once, so that the
+     accessors and walk() can trust them. Children and siblings come after
+     their node in document order, which also rules out cycles. */
+  static bool valid_structure( const flat_node * nodes, uint32_t node_count, const flat_attribute * attributes,
+			       uint32_t attribute_count, uint32_t text_size ) {
+    for ( uint32_t i=0; i<node_count; ++i ) {
+      const flat_node & n = nodes[i];
+      if ( ( n.tag >= TAG_COUNT ) || ( ( i == 0 ) != ( n.parent == kNoNode ) ) || ( ( i != 0 ) && ( n.parent >= i ) ) ) {
+	return false;
+      }
+      if ( ( n.first_child != kNoNode ) &&
+	   ( ( n.tag == TAG_TEXT ) || ( n.first_child <= i ) || ( n.first_child >= node_count ) ||
+	     ( nodes[n.first_child].parent != i ) ) ) {
+	return false;
+      }
+      if ( ( n.next_sibling != kNoNode ) &&
+	   ( ( i == 0 ) || ( n.next_sibling <= i ) || ( n.next_sibling >= node_count ) ||
+	     ( nodes[n.next_sibling].parent != n.parent ) ) ) {
+	return false;
+      }
+      uint32_t limit = ( n.tag == TAG_TEXT ) ? text_size : attribute_count;
+      if ( ( n.first > limit ) || ( n.count > limit - n.first ) ) {
+	return false;
+      }
+    }
+    for ( uint32_t i=0; i<attribute_count; ++i ) {
+      const flat_attribute & a = attributes[i];
+      if ( ( a.id >= ATTR_COUNT ) || ( a.offset > text_size ) || ( a.length > text_size - a.offset ) ) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  bool flat_document::map_file( const std::string & path ) {
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) {
+      return false;
+    }
+    struct stat st;
+    if ( ( fstat( fd, &st ) != 0 ) || ( static_cast<size_t>( st.st_size ) < sizeof(file_header) ) ) {
+      close( fd );
+      return false;
+    }
+    void * map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( map == MAP_FAILED ) {
+      return false;
+    }
+    const file_header * header = static_cast<const file_header*>( map );
+    /* 64 bit, the counts of a corrupt header must not wrap around */
+    unsigned long long expected = sizeof(file_header) +
+      static_cast<unsigned long long>( header->node_count ) * sizeof(flat_node) +
+      static_cast<unsigned long long>( header->attribute_count ) * sizeof(flat_attribute) + header->text_size;
+    const char * ptr = static_cast<const char*>( map ) + sizeof(file_header);
+    if ( ( memcmp( header->magic, kMagic, sizeof(kMagic) ) != 0 ) ||
+	 ( expected != static_cast<unsigned long long>( st.st_size ) ) ||
+	 !valid_structure( reinterpret_cast<const flat_node*>( ptr ), header->node_count,
+			   reinterpret_cast<const flat_attribute*>( ptr + header->node_count * sizeof(flat_node) ),
+			   header->attribute_count, header->text_size ) ) {
+      munmap( map, st.st_size );
+      return false;
+    }
+    unmap();
+    m_node_storage.clear();
+    m_attribute_storage.clear();
+    m_text_storage.clear();
+    m_map = map;
+    m_map_size = st.st_size;
+    m_nodes = reinterpret_cast<const flat_node*>( ptr );
+    m_node_count = header->node_count;
+    ptr += header->node_count * sizeof(flat_node);
+    m_attributes = reinterpret_cast<const flat_attribute*>( ptr );
+    m_attribute_count = header->attribute_count;
+    ptr += header->attribute_count * sizeof(flat_attribute);
+    m_text = ptr;
+    m_text_size = header->text_size;
+    return true;
+  }
+
+  bool flat_document::save( const std::string & path ) const {
+    file_header header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, kMagic, sizeof(kMagic) );
+    header.node_count = m_node_count;
+    header.attribute_count = m_attribute_count;
+    header.text_size = m_text_size;
+
+    /* readers never see a partially written file */
+    stringstream tmp_path;
+    tmp_path << path << ".tmp" << getpid() << "_" << pthread_self();
+    bool written;
+    {
+      output_file out( tmp_path.str() );
+      out.write( reinterpret_cast<const char*>( &header ), sizeof(header) );
+      out.write( reinterpret_cast<const char*>( m_nodes ), m_node_count * sizeof(flat_node) );
+      out.write( reinterpret_cast<const char*>( m_attributes ), m_attribute_count * sizeof(flat_attribute) );
+      out.write( m_text, m_text_size );
+      out.close();
+      written = !out.fail();
+    }
+    if ( !written || ( rename( tmp_path.str().c_str(), path.c_str() ) != 0 ) ) {
+      unlink( tmp_path.str().c_str() );
+      return false;
+    }
+    return true;
+  }
+
+  std::string flat_document::text( uint32_t index ) const {
+    const flat_node & n = m_nodes[index];
+    return ( n.tag == TAG_TEXT ) ? string( m_text + n.first, n.count ) : string();
+  }
+
+  std::string flat_document::attribute( uint32_t index, attribute_id id ) const {
+    const flat_node & n = m_nodes[index];
+    if ( n.tag != TAG_TEXT ) {
+      for ( uint32_t i=n.first; i<n.first+n.count; ++i ) {
+	if ( m_attributes[i].id == static_cast<uint32_t>( id ) ) {
+	  return string( m_text + m_attributes[i].offset, m_attributes[i].length );
+	}
+      }
+    }
+    return string();
+  }
+
+  void flat_document::walk( uint32_t start, flat_visitor & visitor ) const {
+    uint32_t cur = start;
+    while ( cur != kNoNode ) {
+      if ( visitor.enter( *this, cur ) && ( m_nodes[cur].first_child != kNoNode ) ) {
+	cur = m_nodes[cur].first_child;
+	continue;
+      }
+      /* leave the node and every ancestor whose last child it was */
+      for ( ;; ) {
+	visitor.leave( *this, cur );
+	if ( cur == start ) {
+	  return;
+	}
+	if ( m_nodes[cur].next_sibling != kNoNode ) {
+	  cur = m_nodes[cur].next_sibling;
+	  break;
+	}
+	cur = m_nodes[cur].parent;
+      }
+    }
+  }
+}
@@ -0,0 +1,118 @@
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <libxml/tree.h>
+
+#pragma once
+namespace xml2epub {
+
+  /* element tags are interned once while the document is flattened */
+  enum tag_id {
+    TAG_TEXT = 0,
+    TAG_DOCUMENT,
+    TAG_CHAPTER,
+    TAG_SECTION,
+    TAG_SUBSECTION,
+    TAG_SUBSUBSECTION,
+    TAG_B,
+    TAG_MATH,
+    TAG_EQUATION,
+    TAG_FIGURE,
+    TAG_IMAGE,
+    TAG_CAPTION,
+    TAG_PLOT,
+    TAG_BR,
+    TAG_NP,
+    TAG_TABLE,
+    TAG_TR,
+    TAG_TD,
+    TAG_REF,
+    TAG_CITE,
+    TAG_COUNT
+  };
+
+  /* the only attributes any element understands */
+  enum attribute_id {
+    ATTR_LABEL = 0,
+    ATTR_NAME,
+    ATTR_SRC,
+    ATTR_ID,
+    ATTR_COUNT
+  };
+
+  /* "#text" for text nodes */
+  const char * tag_name( unsigned int tag );
+
+  static const uint32_t kNoNode = 0xffffffffu;
+
+  struct flat_node {
+    uint32_t tag;
+    uint32_t line;
+    uint32_t parent, first_child, next_sibling;
+    /* text nodes: offset and length of the content in the string arena,
+       elements: index and number of their attributes */
+    uint32_t first, count;
+  };
+
+  struct flat_attribute {
+    uint32_t id;
+    uint32_t offset, length;
+  };
+
+  class flat_visitor;
+
+  /* the input document as one contiguous array of nodes in document order,
+     linked by indices, with all text in a single string arena. Built once from
+     the libxml tree, it can be written to disk and mapped back in later runs. */
+  class flat_document {
+  private:
+    std::vector<flat_node> m_node_storage;
+    std::vector<flat_attribute> m_attribute_storage;
+    std::string m_text_storage;
+    const flat_node * m_nodes;
+    size_t m_node_count;
+    const flat_attribute * m_attributes;
+    size_t m_attribute_count;
+    const char * m_text;
+    size_t m_text_size;
+    void * m_map;
+    size_t m_map_size;
+    void unmap();
+    void attach_storage();
+    flat_document( const flat_document & );
+    flat_document & operator=( const flat_document & );
+  public:
+    flat_document();
+    ~flat_document();
+    /* throws on elements with an unknown name, comments and processing
+       instructions are dropped */
+    void build( const xmlNode * root );
+    /* false if path does not exist, was written by another version or is
+       not consistent */
+    bool map_file( const std::string & path );
+    /* false if the file could not be written */
+    bool save( const std::string & path ) const;
+
+    size_t size() const { return m_node_count; }
+    uint32_t root() const { return ( m_node_count != 0 ) ? 0 : kNoNode; }
+    const flat_node & node( uint32_t index ) const { return m_nodes[index]; }
+    std::string text( uint32_t index ) const;
+    /* content of a text node in the string arena, node( index ).count bytes long */
+    const char * text_data( uint32_t index ) const { return m_text + m_nodes[index].first; }
+    /* empty if the element has no such attribute */
+    std::string attribute( uint32_t index, attribute_id id ) const;
+
+    /* calls enter()/leave() for node and all its descendants in document
+       order without recursion, so the nesting depth is not limited by the stack */
+    void walk( uint32_t node, flat_visitor & visitor ) const;
+  };
+
+  class flat_visitor {
+  public:
+    virtual ~flat_visitor() {}
+    /* return false to skip the children of node, leave() is called anyway */
+    virtual bool enter( const flat_document & doc, uint32_t node ) = 0;
+    virtual void leave( const flat_document & doc, uint32_t node ) = 0;
+  };
+
+}
@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <fstream>
 #include <libxml++/libxml++.h>
+#include <libxml/tree.h>
 #include <tidy.h>
 #include <buffio.h>
 #include <unistd.h>
@@ -12,30 +13,59 @@
 #include "html.hh"
 #include "latex.hh"
 #include "plot.hh"
+#include "csv.hh"
 #include "latex2util.hh"
 #include "symmap.hh"
+#include "process.hh"
+#include "profile.hh"
+#include "stats.hh"
+#include "render_cache.hh"
+#include "arena.hh"
+#include "text_kernel.hh"
+#include "output_sink.hh"
+#include "import.hh"
+#include "raster.hh"
+#include "fallback.hh"
+#include "svgopt.hh"
+#include "validate.hh"
 
 using namespace xmlpp;
 using namespace std;
 
 namespace xml2epub {
 
-  class html_state : public output_state {
+  class html_state : public output_state, public arena_object {
   protected:
     friend class html_builder;
     html_state & m_parent;
-    std::vector<html_state*> m_children;
+    /* intrusive list of the children that are still open */
+    html_state * m_first_child;
+    html_state * m_prev_sibling;
+    html_state * m_next_sibling;
+    state_arena & m_arena;
+    /* png copies of the rendered images, shared by the whole document */
+    png_fallbacks & m_fallbacks;
+    /* glyphs of the svg images of the chapter, NULL unless they are shared */
+    glyph_sprite * m_sprite;
     xmlpp::Element & m_xml_node;
     const std::string & m_current_dir;
     xmlpp::Element * m_paragraph_node;
+    /* text of the current paragraph since the last element, added to the
+       DOM as a single text node */
+    std::string m_pending_text;
+    void adopt( html_state * child );
+    void flush_text();
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     html_state( html_state & parent, xmlpp::Element & xml_node, xmlpp::Element * paragraph_node, const std::string & current_dir );
-    html_state( xmlpp::Element & xml_node, const std::string & current_dir );
+    html_state( xmlpp::Element & xml_node, const std::string & current_dir, state_arena & arena, png_fallbacks & fallbacks,
+		glyph_sprite * sprite );
     void end_paragraph();
     void check_paragraph();
     virtual ~html_state();
   public:
-    void put_text( const std::string & str );
+    void put_text( const text_view & text );
     void newline();
     void new_paragraph();
     void reference( const std::string & label );
@@ -49,13 +79,78 @@ namespace xml2epub {
     output_state * section( const std::string & section_name, unsigned int level, const std::string & label );
     output_state * chapter( const std::string & chapter_name, const std::string & label );
     output_state * plot(const std::string & label);
+    output_state * table( const std::string & src );
     void finish();
+  protected:
+    std::string write_cached_image( const std::string & key, const char * extension, image_renderer & renderer );
+    /* adds the svg of the pdf that pdf_source writes to parent, with png
+       fallbacks if they are enabled */
+    void add_rendered_image( xmlpp::Element & parent, const std::string & key, image_renderer & pdf_source,
+			     double scale_factor = 1.0 );
+  };
+
+  const char html_state::kChildren[TAG_COUNT + 1] = "t--TTTTMEF--P..B--..";
+
+  /* the pdf of a formula typeset by latex2pdf */
+  class math_pdf_renderer : public image_renderer {
+  private:
+    const std::string & m_latex;
+  public:
+    math_pdf_renderer( const std::string & latex ) : m_latex( latex ) {}
+    void render( std::ostream & out ) {
+      stringstream iss( m_latex );
+      string pdf_path;
+      latex2pdf( iss, pdf_path );
+      {
+	ifstream pdf( pdf_path.c_str() );
+	out << pdf.rdbuf();
+      }
+      unlink( pdf_path.c_str() );
+    }
+  };
+
+  class plot_pdf_source : public image_renderer {
+  private:
+    const std::string & m_data;
+  public:
+    plot_pdf_source( const std::string & data ) : m_data( data ) {}
+    void render( std::ostream & out ) {
+      /* the pdf is shared with the latex backend */
+      out << plot_pdf( m_data );
+    }
+  };
+
+  /* the pdf of renderer, typeset once for the svg and the png fallbacks */
+  class cached_pdf_source : public image_renderer {
+  private:
+    std::string m_key;
+    image_renderer & m_renderer;
+  public:
+    cached_pdf_source( const std::string & key, image_renderer & renderer ) : m_key( key ), m_renderer( renderer ) {}
+    void render( std::ostream & out ) {
+      out << cached_render( m_key, m_renderer );
+    }
+  };
+
+  class pdf_svg_renderer : public image_renderer {
+  private:
+    image_renderer & m_pdf_source;
+    double m_scale_factor;
+  public:
+    pdf_svg_renderer( image_renderer & pdf_source, double scale_factor ) : m_pdf_source( pdf_source ), m_scale_factor( scale_factor ) {}
+    void render( std::ostream & out ) {
+      stringstream pdf;
+      m_pdf_source.render( pdf );
+      stringstream svg;
+      pdf_data2svg( pdf.str(), svg, m_scale_factor );
+      out << optimize_svg( svg.str() );
+    }
   };
 
   
   class html_math_state : public html_state {
   private:
-    stringstream m_ss;
+    string m_formula;
   private:
     void add_text_chunk( xmlpp::Element & xml_node, string & chunk, bool is_italic ) {
       if ( chunk.size() > 0 ) {
@@ -85,6 +180,8 @@ namespace xml2epub {
       }
     }
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     html_math_state( html_state & parent, xmlpp::Element & xml_node, const std::string & current_dir ) 
       : html_state( parent, xml_node, &xml_node, current_dir ){
     }
@@ -112,14 +209,16 @@ namespace xml2epub {
       throw runtime_error( "can't use plot xml tag in latex math" );
     }
 
-    void put_text( const string & str ) {
-      m_ss << str;
+    void put_text( const text_view & text ) {
+      text.append_to( m_formula );
     }
 
     void finish() {
+      stage_scope stage( "math" );
       /* check if the latex string can just be converted to pure unicode text */
       {
-	string math(m_ss.str());
+	string math( m_formula );
+	stage.arg( "formula_length", static_cast<long>( math.size() ) );
 	math += " ";
 	string result;
 	string tag;
@@ -210,56 +309,35 @@ namespace xml2epub {
 	  }
 	  /* string successfully replaced by unicode */
 	  add_child_with_italic( m_xml_node, result );
+	  stage.arg( "path", "unicode" );
+	  stats_add( "math", "unicode" );
 	  return;
 	}
       }
-      {
-	stringstream ss;
-	ss << "mkdir -p " << m_current_dir << "/images";
-	system(ss.str().c_str());
-      }
       string latex_string;
       {
 	stringstream ss;
-	ss << "$" << m_ss.str() << "$";
+	ss << "$" << m_formula << "$";
 	latex_string = ss.str();
       }
-      string file_name;
-      {
-	stringstream ss;	
-	ss << getpid() << "_" << random();
-	file_name = ss.str();
-      }
-      Element * new_node = m_xml_node.add_child( "img" );
-      string img_path;
-      {
-	stringstream ss;
-	ss << m_current_dir << "/images/" << file_name << ".svg";
-	img_path = ss.str();
-      }
-      {
-	ofstream svg_file( img_path.c_str() );
-	{
-	  stringstream iss( latex_string );
-	  latex2svg( iss, svg_file );
-	}
-      }
-      string img_url;
-      {
-	stringstream ss;
-	ss << "images/" << file_name << ".svg";
-	img_url = ss.str();
-      }
-      new_node->set_attribute( string("src"), img_url );
+      stage.arg( "path", "tex" );
+      stats_add( "math", "tex" );
+      math_pdf_renderer renderer( latex_string );
+      cached_pdf_source pdf_source( "math-pdf:" + latex_string, renderer );
+      add_rendered_image( m_xml_node, "math:" + latex_string, pdf_source );
     }
 
   };
 
+  const char html_math_state::kChildren[TAG_COUNT + 1] = "t-------EF----.B--..";
+
   class html_plot_state : public html_state {
   private:
-    stringstream m_data;
+    string m_data;
     string m_label;
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     html_plot_state( html_state & parent, xmlpp::Element & xml_node, const std::string & label, const std::string & current_dir ) 
       : html_state( parent, xml_node, &xml_node, current_dir ), m_label(label) {
     }
@@ -287,128 +365,33 @@ namespace xml2epub {
       throw runtime_error( "can't use plot xml tag in plot" );
     }    
 
-    void put_text( const string & str ) {
-      m_data << str;
+    void put_text( const text_view & text ) {
+      text.append_to( m_data );
     }
 
     void finish() {
-      string file_name;
-      {
-	stringstream ss;
-	ss << getpid() << "_" << random() << ".svg";
-	file_name = ss.str();
-      }
-      string image_file_path;
-      {
-	stringstream ss;
-	ss << m_current_dir << "/images/" << file_name;
-	image_file_path = ss.str();
-      }
-      {
-	stringstream ss;
-	ss << "mkdir -p " << m_current_dir << "/images";
-	system(ss.str().c_str());
-      }
-      {
-	ofstream svg_file( image_file_path.c_str() );
-	if ( !svg_file ) {
-	  throw runtime_error( "Unable to create image file" );
-	}
-	parse_plot( m_data.str(), svg_file, true );
-      }
-      string image_url;
-      {
-	stringstream ss;
-	ss << "images/" << file_name;
-	image_url = ss.str();
-      }
+      stage_scope stage( "plot" );
+      stage.arg( "label", m_label );
+      const string & data = m_data;
+      plot_pdf_source pdf_source( data );
       Element * paragraph = m_xml_node.add_child( "p" );
       if ( m_label.size() != 0 ) {
 	paragraph->set_attribute(string("id"), m_label);
       }
-      Element * new_node = paragraph->add_child( "img" );
-      new_node->set_attribute( string("src"), image_url );
+      add_rendered_image( *paragraph, "plot-svg:" + data, pdf_source );
     }
 
   };
 
-  class html_equation_state : public html_state {
+  const char html_plot_state::kChildren[TAG_COUNT + 1] = "t-------EF----.B--..";
+
+  class equation_pdf_renderer : public image_renderer {
   private:
-    stringstream m_data;
-    string m_label;
+    const std::string & m_equation;
   public:
-    html_equation_state( html_state & parent, xmlpp::Element & xml_node, const std::string & label, const std::string & current_dir ) 
-      : html_state( parent, xml_node, &xml_node, current_dir ), m_label(label) {
-    }
-    
-    virtual ~html_equation_state() {
-    }
-
-    output_state * bold() {
-      throw runtime_error( "can't use bold xml tag in equation" );
-    }
-
-    void newline() {
-      throw runtime_error( "can't use newline in equation" );
-    }
-
-    output_state * math() {
-      throw runtime_error( "can't use math xml tag in equation" );
-    }
-
-    output_state * section( const std::string & section_name, unsigned int level ) {
-      throw runtime_error( "can't use section xml tag in equation" );
-    }
-
-    output_state * equation() {
-      throw runtime_error( "can't use equation xml tag in equation" );
-    }    
-
-    void put_text( const string & str ) {
-      m_data << str;
-    }
-
-    void finish() {
-      string file_name;
-      {
-	stringstream ss;
-	ss << getpid() << "_" << random() << ".svg";
-	file_name = ss.str();
-      }
-      string image_file_path;
-      {
-	stringstream ss;
-	ss << m_current_dir << "/images/" << file_name;
-	image_file_path = ss.str();
-      }
-      {
-	stringstream ss;
-	ss << "mkdir -p " << m_current_dir << "/images";
-	system(ss.str().c_str());
-      }
-      {
-	ofstream svg_file( image_file_path.c_str() );
-	if ( !svg_file ) {
-	  throw runtime_error( "Unable to create image file" );
-	}
-	parse_equation( m_data.str(), svg_file );
-      }
-      string image_url;
-      {
-	stringstream ss;
-	ss << "images/" << file_name;
-	image_url = ss.str();
-      }
-      Element * paragraph = m_xml_node.add_child( "p" );
-      if ( m_label.size() != 0 ) {
-	paragraph->set_attribute(string("id"), m_label);
-      }
-      Element * new_node = paragraph->add_child( "img" );
-      new_node->set_attribute( string("src"), image_url );
-    }
-
-    void parse_equation( const std::string & eqn, std::ostream & svg_output ) {
-      std::string equation(eqn);
+    equation_pdf_renderer( const std::string & equation ) : m_equation( equation ) {}
+    void render( std::ostream & pdf_output ) {
+      std::string equation(m_equation);
       for ( size_t pos = equation.find("\n",0); pos != std::string::npos; pos = equation.find("\n",pos+1) ) {
 	equation[pos] = ' ';
       }
@@ -425,7 +408,7 @@ namespace xml2epub {
 	tex_path = ss.str();
       }
       {
-	ofstream tex_file( tex_path.c_str() );
+	output_file tex_file( tex_path );
 	if ( !tex_file ) {
 	  throw runtime_error( "Cannot creat tmp file" );
 	}
@@ -444,7 +427,7 @@ namespace xml2epub {
 	ss << "( ( cd /tmp; xelatex " << file_name << ".tex; cd -; ) 2>&1 ) > /dev/null";
 	shell_command = ss.str();
       }
-      system( shell_command.c_str() );
+      run_command( "xelatex", shell_command );
       {
 	string pdf_file;
 	{
@@ -452,17 +435,79 @@ namespace xml2epub {
 	  ss << "/tmp/" << file_name << ".pdf";
 	  pdf_file = ss.str();
 	}
-	pdf2svg( pdf_file, svg_output, 1.5 );
+	ifstream pdf( pdf_file.c_str() );
+	pdf_output << pdf.rdbuf();
       }
       {
 	stringstream ss;
 	ss << "rm -f /tmp/" << file_name << ".*";
 	shell_command = ss.str();
       }
-      system( shell_command.c_str() ); 
+      run_command( "rm", shell_command );
     }
   };
 
+  class html_equation_state : public html_state {
+  private:
+    string m_data;
+    string m_label;
+  public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
+    html_equation_state( html_state & parent, xmlpp::Element & xml_node, const std::string & label, const std::string & current_dir ) 
+      : html_state( parent, xml_node, &xml_node, current_dir ), m_label(label) {
+    }
+    
+    virtual ~html_equation_state() {
+    }
+
+    output_state * bold() {
+      throw runtime_error( "can't use bold xml tag in equation" );
+    }
+
+    void newline() {
+      throw runtime_error( "can't use newline in equation" );
+    }
+
+    output_state * math() {
+      throw runtime_error( "can't use math xml tag in equation" );
+    }
+
+    output_state * section( const std::string & section_name, unsigned int level, const std::string & label ) {
+      throw runtime_error( "can't use section xml tag in equation" );
+    }
+
+    output_state * equation( const std::string & label ) {
+      throw runtime_error( "can't use equation xml tag in equation" );
+    }
+
+    output_state * plot( const std::string & label ) {
+      throw runtime_error( "can't use plot xml tag in equation" );
+    }
+
+    void put_text( const text_view & text ) {
+      text.append_to( m_data );
+    }
+
+    void finish() {
+      stage_scope stage( "equation" );
+      stage.arg( "label", m_label );
+      stage.arg( "formula_length", static_cast<long>( m_data.size() ) );
+      const string & data = m_data;
+      equation_pdf_renderer renderer( data );
+      cached_pdf_source pdf_source( "equation-pdf:" + data, renderer );
+      Element * paragraph = m_xml_node.add_child( "p" );
+      if ( m_label.size() != 0 ) {
+	paragraph->set_attribute(string("id"), m_label);
+      }
+      /* equations are set a bit larger than the text */
+      add_rendered_image( *paragraph, "equation:" + data, pdf_source, 1.5 );
+    }
+
+  };
+
+  const char html_equation_state::kChildren[TAG_COUNT + 1] = "t--------F----.B--..";
+
   class html_figure_state : public html_state {
   private:
     string m_label;
@@ -471,6 +516,8 @@ namespace xml2epub {
     xmlpp::Element * m_image_row;
     xmlpp::Element * m_caption_span;
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     html_figure_state( html_state & parent, xmlpp::Element & xml_node, const std::string & label, const std::string & current_dir ) 
       : html_state( parent, xml_node, &xml_node, current_dir ), m_label(label) {
 
@@ -487,51 +534,25 @@ namespace xml2epub {
     }
 
     output_state * caption( ) {
-      html_state * retval = new html_state( * this, * m_caption_span, m_caption_span,  m_current_dir );
-      m_children.push_back( retval );
+      html_state * retval = new ( m_arena ) html_state( * this, * m_caption_span, m_caption_span,  m_current_dir );
+      adopt( retval );
       return retval;
     }
 
     void image( const std::string & in_filename ) {
-      string file_name;
-      {
-	stringstream ss;
-	ss << getpid() << "_" << random() << ".svg";
-	file_name = ss.str();
-      }
-      string image_file_path;
-      {
-	stringstream ss;
-	ss << m_current_dir << "/images/" << file_name;
-	image_file_path = ss.str();
-      }
-      {
-	stringstream ss;
-	ss << "mkdir -p " << m_current_dir << "/images";
-	system(ss.str().c_str());
-      }
-      {
-	ofstream svg_file( image_file_path.c_str() );
-	if ( !svg_file ) {
-	  throw runtime_error( "Unable to create image file" );
-	}
-	/* copy file */
-	{
-	  std::ifstream in_file(in_filename.c_str());
-	  std::copy(std::istreambuf_iterator<char>(in_file),std::istreambuf_iterator<char>(),
-		    std::ostreambuf_iterator<char>(svg_file));
-	}
+      stage_scope stage( "figure" );
+      stage.arg( "src", in_filename );
+      if ( is_raster_image( in_filename ) ) {
+	/* photos and scans, fitted to the screen of the reader */
+	m_image_urls.push_back( "images/" + import_raster( in_filename, m_current_dir + "/images" ) );
+	return;
       }
-      string image_url;
-      {
-	stringstream ss;
-	ss << "images/" << file_name;
-	image_url = ss.str();
-      }
-      m_image_urls.push_back(image_url);
+      /* a diagram used many times is imported once */
+      m_image_urls.push_back( "images/" + import_file( in_filename, m_current_dir + "/images", ".svg" ) );
     }
 
     void finish() {
+      end_paragraph();
       if ( m_label.size() != 0 ) {
 	m_paragraph->set_attribute(string("id"), m_label);
       }
@@ -545,36 +566,275 @@ namespace xml2epub {
       }      
     }
   };
+
+  const char html_figure_state::kChildren[TAG_COUNT + 1] = "t--TTTTMEF.TP..B--..";
+  
+  /* tidies a complete DOM into an xhtml file */
+  static void write_xhtml( xmlpp::Document & doc, std::ostream & out ) {
+    stage_scope stage( "serialize" );
+    string data;
+    data = doc.write_to_string();
+    /* skip the first line so that tidy will add it's own xml tag */
+    const char * document = data.c_str() + data.find('\n') + 1;
+    stage_scope tidy_stage( "tidy" );
+    tidy_stage.arg( "bytes", static_cast<long>( data.c_str() + data.size() - document ) );
+
+    TidyDoc tdoc = tidyCreate();
+    if ( tidyOptSetBool( tdoc, TidyXhtmlOut, yes ) == false ) {
+      throw runtime_error( "tidyOptSetBool failed" );
+    }
+    if ( tidyOptSetBool( tdoc, TidyXmlDecl, yes ) == false ) {
+      throw runtime_error( "tidyOptSetBool failed" );
+    }
+    tidySetInCharEncoding( tdoc, "utf8" );
+    tidySetOutCharEncoding( tdoc, "latin1" );
+    int rc=-1;
+    TidyBuffer errbuf;
+    tidyBufInit( &errbuf );
+
+    rc = tidySetErrorBuffer( tdoc, &errbuf );
+    if ( rc < 0 ) {
+      throw runtime_error( "tidySetErrorBuffer failed" );
+    }
+    rc = tidyParseString( tdoc, document );
+    if ( rc < 0 ) {
+      throw runtime_error( "tidyParseString failed" );
+    }
+    rc = tidyCleanAndRepair( tdoc );
+    if ( rc < 0 ) {
+      throw runtime_error( "tidyCleanAndRepair failed" );
+    }
+    TidyBuffer output_buffer;
+    tidyBufInit( &output_buffer );
+    rc = tidySaveBuffer( tdoc, &output_buffer );
+    if ( rc < 0 ) {
+      throw runtime_error( "tidySaveBuffer failed" );
+    }
+    /* straight from tidy's buffer into the file */
+    out.write( reinterpret_cast<const char *>( output_buffer.bp ), output_buffer.size );
+    stats_add( "bytes_written", "html", output_buffer.size );
+    tidyBufFree( &output_buffer );
+    tidyBufFree( &errbuf );
+    tidyRelease( tdoc );
+  }
+
+  class html_table_state;
+
+  class html_table_row_state : public html_state {
+  public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
+    html_table_row_state( html_state & parent, xmlpp::Element & xml_node, const std::string & current_dir ) 
+      : html_state( parent, xml_node, NULL, current_dir ) {
+    }
+
+    virtual ~html_table_row_state() {
+    }
+
+    void put_text( const text_view & text ) {
+      if ( text.is_white_space() == false ) {
+	throw runtime_error( "text in a table row must be inside a cell" );
+      }
+    }
+
+    output_state * table_cell() {
+      Element * cell_node = m_xml_node.add_child( "td" );
+      html_state * retval = new ( m_arena ) html_state( * this, * cell_node, cell_node, m_current_dir );
+      adopt( retval );
+      return retval;
+    }
+
+    void finish() {
+    }
+  };
+
+  const char html_table_row_state::kChildren[TAG_COUNT + 1] = "w--TTTTMEF--P..B-T..";
+
+  /* very long tables are split into several consecutive tables ("pages") so
+     that e-readers do not have to lay out 10^5 rows in one go. The pages of
+     an inline table stay in the chapter, its rows are part of the source
+     document anyway. Of a table read from a csv file only the first page is
+     put into the chapter, every further page is written to a file of its own
+     as soon as it is complete and linked from the chapter. */
+  class html_table_state : public html_state {
+  private:
+    static const unsigned int kRowsPerPage = 500;
+    std::string m_src;
+    xmlpp::Element * m_table_node;
+    unsigned int m_rows_in_page;
+
+    xmlpp::Element & next_row_node() {
+      if ( ( m_table_node == NULL ) || ( m_rows_in_page >= kRowsPerPage ) ) {
+	Element * page = m_xml_node.add_child( "div" );
+	page->set_attribute( string("class"), string("table-page") );
+	m_table_node = page->add_child( "table" );
+	m_rows_in_page = 0;
+      }
+      m_rows_in_page++;
+      return * m_table_node->add_child( "tr" );
+    }
+
+    /* "table-<hash of the source>-<page>.html" */
+    std::string page_file_name( unsigned int page ) const {
+      stringstream ss;
+      ss << "table-" << content_hash( m_src ) << "-" << page << ".html";
+      return ss.str();
+    }
+
+    void write_page( xmlpp::Document & doc, unsigned int page ) {
+      string path = m_current_dir + "/" + page_file_name( page );
+      output_file out( path );
+      if ( !out ) {
+	throw runtime_error( "Unable to create table page \"" + path + "\"" );
+      }
+      write_xhtml( doc, out );
+      out.close();
+      if ( out.fail() ) {
+	throw runtime_error( "Unable to write table page \"" + path + "\"" );
+      }
+      stats_add( "tables", "page files" );
+    }
+
+    /* starts the document of a page file, returns its table */
+    xmlpp::Element * start_page( xmlpp::Document & doc, unsigned long first_row ) {
+      Element * root = doc.create_root_node( "html" );
+      stringstream title;
+      title << m_src << ", rows from " << first_row;
+      root->add_child( "head" )->add_child( "title" )->add_child_text( title.str() );
+      root->add_child( "h1" )->add_child_text( title.str() );
+      return root->add_child( "table" );
+    }
+  public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
+    html_table_state( html_state & parent, xmlpp::Element & xml_node, const std::string & src, const std::string & current_dir ) 
+      : html_state( parent, xml_node, NULL, current_dir ), m_src( src ), m_table_node( NULL ), m_rows_in_page( 0 ) {
+    }
+
+    virtual ~html_table_state() {
+    }
+
+    void put_text( const text_view & text ) {
+      if ( text.is_white_space() == false ) {
+	throw runtime_error( "text in a table must be inside a cell" );
+      }
+    }
+
+    output_state * table_row() {
+      if ( m_src.size() != 0 ) {
+	throw runtime_error( "a table with a src attribute can't have rows" );
+      }
+      html_state * retval = new ( m_arena ) html_table_row_state( * this, next_row_node(), m_current_dir );
+      adopt( retval );
+      return retval;
+    }
+
+    void finish() {
+      if ( m_src.size() == 0 ) {
+	return;
+      }
+      std::ifstream in_file( m_src.c_str() );
+      if ( !in_file ) {
+	throw runtime_error( "Unable to open table source file \"" + m_src + "\"" );
+      }
+      csv_reader reader( in_file );
+      std::vector<std::string> cells;
+      unsigned long rows = 0;
+      unsigned int page = 1;
+      /* the page that is being filled, NULL while it is the chapter's */
+      xmlpp::Document * page_doc = NULL;
+      Element * page_links = NULL;
+      try {
+	while ( reader.next_row( cells ) ) {
+	  if ( ( rows != 0 ) && ( rows % kRowsPerPage == 0 ) ) {
+	    page++;
+	    if ( page_doc != NULL ) {
+	      Element * next = page_doc->get_root_node()->add_child( "p" )->add_child( "a" );
+	      next->set_attribute( string("href"), page_file_name( page ) );
+	      next->add_child_text( "next page" );
+	      write_page( *page_doc, page - 1 );
+	      delete page_doc;
+	      page_doc = NULL;
+	    }
+	    if ( page_links == NULL ) {
+	      page_links = m_xml_node.add_child( "p" );
+	      page_links->set_attribute( string("class"), string("table-pages") );
+	      page_links->add_child_text( "More rows:" );
+	    }
+	    stringstream label;
+	    label << "from " << rows + 1;
+	    page_links->add_child_text( " " );
+	    Element * link = page_links->add_child( "a" );
+	    link->set_attribute( string("href"), page_file_name( page ) );
+	    link->add_child_text( label.str() );
+	    page_doc = new xmlpp::Document;
+	    m_table_node = start_page( *page_doc, rows + 1 );
+	    m_rows_in_page = 0;
+	  }
+	  Element & row = next_row_node();
+	  for ( std::vector<std::string>::const_iterator it = cells.begin(); it != cells.end(); ++it ) {
+	    row.add_child( "td" )->add_child_text( *it );
+	  }
+	  rows++;
+	}
+	if ( page_doc != NULL ) {
+	  write_page( *page_doc, page );
+	  delete page_doc;
+	  page_doc = NULL;
+	}
+      } catch ( ... ) {
+	delete page_doc;
+	throw;
+      }
+      /* pages of a longer version of the table, the output is updated in place when watching */
+      while ( unlink( ( m_current_dir + "/" + page_file_name( ++page ) ).c_str() ) == 0 ) {
+      }
+    }
+  };
+
+  const char html_table_state::kChildren[TAG_COUNT + 1] = "w--TTTTMEF--P..BR-..";
   
   html_state::html_state( html_state & parent, xmlpp::Element & xml_node, xmlpp::Element * paragraph_node, const std::string & current_dir )
-    : m_parent( parent ), m_xml_node( xml_node ), m_current_dir(current_dir), m_paragraph_node( paragraph_node ) {
+    : m_parent( parent ), m_first_child( NULL ), m_prev_sibling( NULL ), m_next_sibling( NULL ), m_arena( parent.m_arena ),
+      m_fallbacks( parent.m_fallbacks ), m_sprite( parent.m_sprite ), m_xml_node( xml_node ), m_current_dir(current_dir), m_paragraph_node( paragraph_node ) {
   }
   
-  html_state::html_state( xmlpp::Element & xml_node, const std::string & current_dir )
-    : m_parent( * this ), m_xml_node( xml_node ), m_current_dir(current_dir), m_paragraph_node( NULL ) {}
+  html_state::html_state( xmlpp::Element & xml_node, const std::string & current_dir, state_arena & arena, png_fallbacks & fallbacks,
+			  glyph_sprite * sprite )
+    : m_parent( * this ), m_first_child( NULL ), m_prev_sibling( NULL ), m_next_sibling( NULL ), m_arena( arena ),
+      m_fallbacks( fallbacks ), m_sprite( sprite ), m_xml_node( xml_node ), m_current_dir(current_dir), m_paragraph_node( NULL ) {}
   
   html_state::~html_state() {
+    /* finish() was not called if the conversion failed, the DOM may be gone already */
+    m_pending_text.clear();
     end_paragraph();
     if ( &m_parent != this ) {
-      vector<html_state*>::iterator it;
-      if ( ( it = find( m_parent.m_children.begin(), m_parent.m_children.end(), this ) )
-	   != m_parent.m_children.end() ) {
-	m_parent.m_children.erase( it );
+      if ( m_prev_sibling != NULL ) {
+	m_prev_sibling->m_next_sibling = m_next_sibling;
+      } else {
+	m_parent.m_first_child = m_next_sibling;
+      }
+      if ( m_next_sibling != NULL ) {
+	m_next_sibling->m_prev_sibling = m_prev_sibling;
       }
     }
     /* delete all my children */
-    if ( m_children.begin() != m_children.end() ) {
+    if ( m_first_child != NULL ) {
       cerr << "Warning: there are still children that have not been deleted" << endl;
-      vector<html_state*> copy( m_children );
-      m_children.clear();
-      for ( vector<html_state*>::iterator it = copy.begin(); it != copy.end(); ++it ) {
-	if ( *it != NULL ) {
-	  delete *it;
-	}
+      while ( m_first_child != NULL ) {
+	delete m_first_child;
       }
     }
   }
 
+  void html_state::adopt( html_state * child ) {
+    child->m_next_sibling = m_first_child;
+    if ( m_first_child != NULL ) {
+      m_first_child->m_prev_sibling = child;
+    }
+    m_first_child = child;
+  }
+
   void html_state::check_paragraph() {
     if ( m_paragraph_node == NULL ) {
       m_paragraph_node = m_xml_node.add_child( "p" );
@@ -582,17 +842,41 @@ namespace xml2epub {
   }
 
   void html_state::end_paragraph() {
-    /* we may need to add something here later on */
+    flush_text();
     m_paragraph_node = NULL;
   }
 
-  void html_state::put_text( const std::string & str ) {
+  void html_state::flush_text() {
+    if ( m_pending_text.size() == 0 ) {
+      return;
+    }
+    /* straight into the DOM, add_child_text() would copy into a ustring first.
+       Appending every fragment to the DOM instead costs a realloc of the
+       merged text node per fragment. */
+    xmlNode * node = xmlNewTextLen( reinterpret_cast<const xmlChar*>( m_pending_text.data() ), m_pending_text.size() );
+    if ( node != NULL ) {
+      xmlAddChild( m_paragraph_node->cobj(), node );
+      stats_add( "dom", "text_nodes" );
+    }
+    m_pending_text.clear();
+  }
+
+  void html_state::put_text( const text_view & text ) {
     check_paragraph();
-    m_paragraph_node->add_child_text( str );
+    const char * data = text.data();
+    size_t size = text.size();
+    if ( ( m_pending_text.size() != 0 ) && ( m_pending_text[m_pending_text.size()-1] == ' ' ) ) {
+      /* the white space run continues from the previous fragment */
+      size_t skip = skip_white_space( data, size );
+      data += skip;
+      size -= skip;
+    }
+    normalize_text( data, size, ESCAPE_NONE, m_pending_text );
   }
 
   void html_state::newline() {
     check_paragraph();
+    flush_text();
     m_paragraph_node->add_child( "br" );
   }
 
@@ -602,30 +886,34 @@ namespace xml2epub {
 
   output_state * html_state::bold() {
     check_paragraph();
+    flush_text();
     Element * new_node = m_paragraph_node->add_child( "b" );
     if ( new_node == NULL ) {
       throw runtime_error( "add_child() failed" );
     }
-    html_state * retval = new html_state( * this, * new_node, new_node,  m_current_dir );
-    m_children.push_back( retval );
+    html_state * retval = new ( m_arena ) html_state( * this, * new_node, new_node,  m_current_dir );
+    adopt( retval );
     return retval;
   }
 
   output_state * html_state::math() {
-    html_state * retval = new html_math_state( * this, * m_paragraph_node, m_current_dir );
-    m_children.push_back( retval );
+    check_paragraph();
+    flush_text();
+    html_state * retval = new ( m_arena ) html_math_state( * this, * m_paragraph_node, m_current_dir );
+    adopt( retval );
     return retval;
   }
 
   output_state * html_state::equation(const std::string & label ) {
     end_paragraph();
-    html_state * retval = new html_equation_state( * this, m_xml_node, label, m_current_dir );
-    m_children.push_back( retval );
+    html_state * retval = new ( m_arena ) html_equation_state( * this, m_xml_node, label, m_current_dir );
+    adopt( retval );
     return retval;
   }
 
   void html_state::reference( const std::string & label ) {
     check_paragraph();
+    flush_text();
     //TODO
     Element * link_node = m_paragraph_node->add_child( string("a") );
     link_node->set_attribute( string("href"), string("#")+label );
@@ -634,6 +922,7 @@ namespace xml2epub {
 
   void html_state::cite( const std::string & id ) {
     check_paragraph();
+    flush_text();
     //TODO
     Element * link_node = m_paragraph_node->add_child( string("a") );
     link_node->set_attribute( string("href"), string("bibliography.hmtl#")+id );
@@ -665,8 +954,8 @@ namespace xml2epub {
       ss << "sec:" << section_name;
       new_node->set_attribute( string("id"), ss.str() );
     }
-    html_state * retval = new html_state( * this, * new_node, NULL, m_current_dir );
-    m_children.push_back( retval );
+    html_state * retval = new ( m_arena ) html_state( * this, * new_node, NULL, m_current_dir );
+    adopt( retval );
     return retval;
   }
 
@@ -676,19 +965,97 @@ namespace xml2epub {
 
   output_state * html_state::plot(const std::string & label) {
     end_paragraph();
-    html_state * retval = new html_plot_state( * this, m_xml_node, label, m_current_dir );
-    m_children.push_back( retval );
+    html_state * retval = new ( m_arena ) html_plot_state( * this, m_xml_node, label, m_current_dir );
+    adopt( retval );
     return retval;
   }
 
   output_state * html_state::figure( const std::string & label ) {
     end_paragraph();
-    html_state * retval = new html_figure_state( * this, m_xml_node, label, m_current_dir );
-    m_children.push_back( retval );
+    html_state * retval = new ( m_arena ) html_figure_state( * this, m_xml_node, label, m_current_dir );
+    adopt( retval );
+    return retval;
+  }
+  
+  output_state * html_state::table( const std::string & src ) {
+    end_paragraph();
+    html_state * retval = new ( m_arena ) html_table_state( * this, m_xml_node, src, m_current_dir );
+    adopt( retval );
     return retval;
   }
   
   void html_state::finish() {
+    flush_text();
+  }
+
+  std::string html_state::write_cached_image( const std::string & key, const char * extension, image_renderer & renderer ) {
+    string file_name = content_hash( key ) + extension;
+    string image_file_path = m_current_dir + "/images/" + file_name;
+    if ( access( image_file_path.c_str(), F_OK ) == 0 ) {
+      /* same image already used in this output */
+      stats_add( "render_cache", "file_hit" );
+    } else {
+      string data = cached_render( key, renderer );
+      make_directories( m_current_dir + "/images" );
+      write_file_atomically( image_file_path, data );
+      stats_add( "bytes_written", extension + 1, data.size() );
+    }
+    return "images/" + file_name;
+  }
+
+  void html_state::add_rendered_image( xmlpp::Element & parent, const std::string & key, image_renderer & pdf_source,
+				       double scale_factor ) {
+    pdf_svg_renderer renderer( pdf_source, scale_factor );
+    /* the svg depends on the optimizer settings */
+    string svg_key;
+    {
+      stringstream ss;
+      ss << "svg-p" << svg_precision() << ":" << key;
+      svg_key = ss.str();
+    }
+    string svg_url;
+    if ( m_sprite == NULL ) {
+      svg_url = write_cached_image( svg_key, ".svg", renderer );
+    } else {
+      /* hoisted every time, the sprite needs the glyphs of every image */
+      string svg = m_sprite->hoist( cached_render( svg_key, renderer ) );
+      string file_name = content_hash( m_sprite->file_name() + ":" + svg_key ) + ".svg";
+      string image_file_path = m_current_dir + "/images/" + file_name;
+      if ( access( image_file_path.c_str(), F_OK ) == 0 ) {
+	stats_add( "render_cache", "file_hit" );
+      } else {
+	make_directories( m_current_dir + "/images" );
+	write_file_atomically( image_file_path, svg );
+	stats_add( "bytes_written", "svg", svg.size() );
+      }
+      svg_url = "images/" + file_name;
+    }
+    const vector<unsigned int> & dpis = png_fallback_dpis();
+    if ( ( m_sprite == NULL ) && ( dpis.size() == 0 ) ) {
+      Element * img = parent.add_child( "img" );
+      img->set_attribute( string("src"), svg_url );
+      return;
+    }
+    /* an svg shown by <img> can't load the sprite, and readers without svg
+       support show the content of the object instead */
+    Element * object = parent.add_child( "object" );
+    object->set_attribute( string("data"), svg_url );
+    object->set_attribute( string("type"), string("image/svg+xml") );
+    if ( dpis.size() == 0 ) {
+      return;
+    }
+    /* the lowest resolution unless the reader understands srcset */
+    vector<string> png_files = m_fallbacks.request( key, pdf_source, scale_factor, m_current_dir + "/images" );
+    Element * img = object->add_child( "img" );
+    img->set_attribute( string("src"), "images/" + png_files[0] );
+    if ( png_files.size() > 1 ) {
+      stringstream srcset;
+      for ( size_t i=0; i<png_files.size(); ++i ) {
+	srcset << ( i != 0 ? ", " : "" ) << "images/" << png_files[i] << " "
+	       << static_cast<double>( dpis[i] ) / dpis[0] << "x";
+      }
+      img->set_attribute( string("srcset"), srcset.str() );
+    }
   }
 
   class html_root_state;
@@ -700,10 +1067,10 @@ namespace xml2epub {
     std::ostream & m_out;
   protected:
     friend class html_root_state;
-    /* html_chapter_state is responsible for de-allocating xml-doc!! */
-    html_chapter_state( html_root_state & parent, xmlpp::Document * xml_doc, 
-			std::ostream & out, const std::string & label, const std::string & current_dir ) : 
-      html_state( *xml_doc->create_root_node( "html" ), current_dir ), m_parent(parent), m_doc(xml_doc), m_out(out) {
+    /* html_chapter_state is responsible for de-allocating xml-doc and the sprite!! */
+    html_chapter_state( html_root_state & parent, state_arena & arena, png_fallbacks & fallbacks, glyph_sprite * sprite,
+			xmlpp::Document * xml_doc, std::ostream & out, const std::string & label, const std::string & current_dir ) : 
+      html_state( *xml_doc->create_root_node( "html" ), current_dir, arena, fallbacks, sprite ), m_parent(parent), m_doc(xml_doc), m_out(out) {
       if ( label.size() != 0 ) {
 	Element * head_node = m_xml_node.add_child( "head" );
 	Element * title_node = head_node->add_child( "title" );
@@ -715,47 +1082,11 @@ namespace xml2epub {
   public:
     virtual ~html_chapter_state();
     void finish() {
-      string data;
-      data = m_doc->write_to_string();
-      /* delete the first line so that tidy will add it's own xml tag */
-      data = data.substr( data.find('\n')+1 );
-
-      TidyDoc tdoc = tidyCreate();
-      if ( tidyOptSetBool( tdoc, TidyXhtmlOut, yes ) == false ) {
-	throw runtime_error( "tidyOptSetBool failed" );
-      }
-      if ( tidyOptSetBool( tdoc, TidyXmlDecl, yes ) == false ) {
-	throw runtime_error( "tidyOptSetBool failed" );
-      }
-      tidySetInCharEncoding( tdoc, "utf8" );
-      tidySetOutCharEncoding( tdoc, "latin1" );
-      int rc=-1;
-      TidyBuffer errbuf;
-      tidyBufInit( &errbuf );
-	
-      rc = tidySetErrorBuffer( tdoc, &errbuf );
-      if ( rc < 0 ) {
-	throw runtime_error( "tidySetErrorBuffer failed" );
-      }
-      rc = tidyParseString( tdoc, data.c_str() );
-      if ( rc < 0 ) {
-	throw runtime_error( "tidyParseString failed" );
-      }
-      rc = tidyCleanAndRepair( tdoc );
-      if ( rc < 0 ) {
-	throw runtime_error( "tidyCleanAndRepair failed" );
-      }
-      TidyBuffer output_buffer;
-      tidyBufInit( &output_buffer );
-      rc = tidySaveBuffer( tdoc, &output_buffer );
-      if ( rc < 0 ) {
-	throw runtime_error( "tidySaveBuffer failed" );
-      }
-      string out_buffer( (const char *)output_buffer.bp );
-      tidyBufFree( &output_buffer );
-      tidyBufFree( &errbuf );
-      tidyRelease( tdoc );
-      m_out << out_buffer;
+      end_paragraph();
+      if ( m_sprite != NULL ) {
+	m_sprite->write( m_current_dir + "/images" );
+      }
+      write_xhtml( *m_doc, m_out );
     }
   };
 
@@ -764,26 +1095,29 @@ namespace xml2epub {
     html_builder & m_builder;
     string m_parent_directory;
     unsigned int chapter_number;
-    std::vector<std::pair<html_chapter_state*, std::ofstream*> > m_chapters;
+    /* holds the states of the open chapter */
+    state_arena m_arena;
+    png_fallbacks m_fallbacks;
+    std::vector<std::pair<html_chapter_state*, output_file*> > m_chapters;
     friend class html_builder;
-    html_root_state( html_builder & builder, const std::string & dir ) : m_builder(builder), m_parent_directory( dir ) {}
+    html_root_state( html_builder & builder, const std::string & dir ) : m_builder(builder), m_parent_directory( dir ), chapter_number( 0 ) {}
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     virtual ~html_root_state() {
       m_builder.m_root = NULL;
       if ( m_chapters.size() != 0 ) {
 	std::cerr << "WARNING: not all html chapters have been de-alloced!?!?" << std::endl;
-	for ( std::vector<std::pair<html_chapter_state*, std::ofstream*> >::const_iterator it = m_chapters.begin();
+	for ( std::vector<std::pair<html_chapter_state*, output_file*> >::const_iterator it = m_chapters.begin();
 	      it != m_chapters.end(); ++it ) {
 	  delete it->first;
 	  delete it->second;
 	}
       }
     }
-    void put_text( const std::string & str ) {
-      for ( std::string::const_iterator it = str.begin(); it != str.end(); ++it ) {
-	if ( ( *it != ' ' ) && ( *it != '\r' ) && ( *it != '\n' ) && ( *it != '\t' ) ) {
-	  throw std::runtime_error("You must open a chapter before putting in text!");
-	}
+    void put_text( const text_view & text ) {
+      if ( text.is_white_space() == false ) {
+	throw std::runtime_error("You must open a chapter before putting in text!");
       }
     }
     void newline() {
@@ -806,28 +1140,40 @@ namespace xml2epub {
 	ss << m_parent_directory << "/" << "chapter" << setw(2) << setfill('0') << chapter_number << ".html";
 	filename = ss.str();
       }
-      std::ofstream * outfile = new std::ofstream(filename.c_str());
+      output_file * outfile = new output_file( filename );
       string pretty_name;
       {
 	stringstream ss;
 	ss << "Chapter " << chapter_number << ": " << chapter_name;
 	pretty_name = ss.str();
       }
-      html_chapter_state * state = new html_chapter_state(*this, new xmlpp::Document, *outfile, pretty_name, 
-							  m_parent_directory);
+      glyph_sprite * sprite = NULL;
+      if ( svg_glyph_sprite() ) {
+	stringstream ss;
+	ss << "chapter" << setw(2) << setfill('0') << chapter_number << "-glyphs.svg";
+	sprite = new glyph_sprite( ss.str() );
+      }
+      html_chapter_state * state = new ( m_arena ) html_chapter_state( *this, m_arena, m_fallbacks, sprite, new xmlpp::Document,
+									*outfile, pretty_name, m_parent_directory );
       
-      m_chapters.push_back( std::pair<html_chapter_state*, std::ofstream*>( state, outfile ) );
+      m_chapters.push_back( std::pair<html_chapter_state*, output_file*>( state, outfile ) );
       return state;
     }
+    void skip_chapter( const std::string & chapter_name, const std::string & label ) {
+      /* chapterNN.html of the previous run is still valid */
+      chapter_number++;
+    }
     output_state * plot(const std::string & label) {
       throw std::runtime_error("You must open a chapter before putting in plot!");
     }
     void finish() {
+      /* the png fallbacks are rendered in the background */
+      m_fallbacks.wait();
     }
   private:
     friend class html_chapter_state;
     void remove_me( html_chapter_state & chapter_state ) {
-      for ( std::vector<std::pair<html_chapter_state*, std::ofstream*> >::iterator it = m_chapters.begin();
+      for ( std::vector<std::pair<html_chapter_state*, output_file*> >::iterator it = m_chapters.begin();
 	    it != m_chapters.end(); ++it ) {
 	if ( it->first == (&chapter_state) ) {
 	  if ( it->second != NULL ) {
@@ -841,17 +1187,22 @@ namespace xml2epub {
     }
   };
 
+  const char html_root_state::kChildren[TAG_COUNT + 1] = "w-T-----------------";
+
   html_chapter_state::~html_chapter_state() {
     m_parent.remove_me( *this );
     delete m_doc;
+    delete m_sprite;
   }
 
-  html_builder::html_builder( const std::string & output_dir ) 
+  html_builder::html_builder( const std::string & output_dir, bool clean ) 
     : m_output_directory(output_dir), m_root(NULL) {
-    {
+    if ( clean ) {
       stringstream ss;
-      ss << "rm -rf \"" << m_output_directory << "\" && mkdir -p \"" << m_output_directory << "\"";
-      system( ss.str().c_str() );
+      ss << "rm -rf -- " << shell_quote( m_output_directory ) << " && mkdir -p -- " << shell_quote( m_output_directory );
+      run_command( "rm", ss.str() );
+    } else {
+      make_directories( m_output_directory );
     }
   }
 
@@ -870,4 +1221,16 @@ namespace xml2epub {
     return m_root;
   }
 
+  const char * const kHtmlContextRules[CTX_COUNT] = {
+    html_root_state::kChildren,
+    /* html_chapter_state and the states of bold, captions and cells */
+    html_state::kChildren,
+    html_math_state::kChildren,
+    html_equation_state::kChildren,
+    html_plot_state::kChildren,
+    html_figure_state::kChildren,
+    html_table_state::kChildren,
+    html_table_row_state::kChildren
+  };
+
 }
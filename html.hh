@@ -14,7 +14,9 @@ namespace xml2epub {
     friend class html_root_state;
     html_root_state * m_root;
   public:
-    html_builder( const std::string & output_dir );
+    /* with clean == false the files of a previous conversion are kept so that
+       unchanged chapters and images can be reused */
+    html_builder( const std::string & output_dir, bool clean = true );
     virtual ~html_builder();
     output_state * create_root();
   };
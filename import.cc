@@ -0,0 +1,176 @@
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "import.hh"
+#include "input.hh"
+#include "render_cache.hh"
+#include "stats.hh"
+#include "output_sink.hh"
+
+using namespace std;
+
+namespace xml2epub {
+
+  void make_directories( const std::string & path ) {
+    for ( size_t pos = path.find( '/', 1 ); ; pos = path.find( '/', pos + 1 ) ) {
+      string prefix = path.substr( 0, pos );
+      if ( ( prefix.size() != 0 ) && ( mkdir( prefix.c_str(), 0755 ) != 0 ) && ( errno != EEXIST ) ) {
+	throw runtime_error( "Unable to create directory \"" + prefix + "\"" );
+      }
+      if ( pos == string::npos ) {
+	break;
+      }
+    }
+  }
+
+  struct hashed_file {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    std::string hash;
+  };
+
+  static pthread_mutex_t gHashMutex = PTHREAD_MUTEX_INITIALIZER;
+  static std::map<std::string, hashed_file> gHashes;
+
+  std::string file_content_hash( const std::string & path ) {
+    struct stat st;
+    if ( stat( path.c_str(), &st ) != 0 ) {
+      throw runtime_error( "Unable to open file \"" + path + "\" for input!" );
+    }
+    pthread_mutex_lock( &gHashMutex );
+    map<string, hashed_file>::const_iterator it = gHashes.find( path );
+    if ( ( it != gHashes.end() ) && ( it->second.device == st.st_dev ) && ( it->second.inode == st.st_ino ) &&
+	 ( it->second.size == st.st_size ) && ( it->second.mtime.tv_sec == st.st_mtim.tv_sec ) &&
+	 ( it->second.mtime.tv_nsec == st.st_mtim.tv_nsec ) ) {
+      string retval = it->second.hash;
+      pthread_mutex_unlock( &gHashMutex );
+      return retval;
+    }
+    pthread_mutex_unlock( &gHashMutex );
+    hashed_file entry;
+    entry.device = st.st_dev;
+    entry.inode = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtim;
+    {
+      input_document source( path, INPUT_COPIED );
+      entry.hash = content_hash( source.data(), source.size() );
+    }
+    pthread_mutex_lock( &gHashMutex );
+    gHashes[path] = entry;
+    pthread_mutex_unlock( &gHashMutex );
+    return entry.hash;
+  }
+
+  /* copies in the kernel, falls back to read/write where copy_file_range
+     can't cross file systems or isn't supported by them */
+  static bool copy_contents( int in, int out ) {
+    for ( ;; ) {
+      ssize_t copied = copy_file_range( in, NULL, out, NULL, 1 << 30, 0 );
+      if ( copied == 0 ) {
+	return true;
+      }
+      if ( copied < 0 ) {
+	if ( errno == EINTR ) {
+	  continue;
+	}
+	break;
+      }
+    }
+    if ( ( errno != EXDEV ) && ( errno != ENOSYS ) && ( errno != EINVAL ) && ( errno != EOPNOTSUPP ) &&
+	 ( errno != ETXTBSY ) ) {
+      return false;
+    }
+    char buffer[64 * 1024];
+    for ( ;; ) {
+      ssize_t length = read( in, buffer, sizeof(buffer) );
+      if ( length == 0 ) {
+	return true;
+      }
+      if ( length < 0 ) {
+	if ( errno == EINTR ) {
+	  continue;
+	}
+	return false;
+      }
+      for ( ssize_t done = 0; done < length; ) {
+	ssize_t written = write( out, buffer + done, length - done );
+	if ( written < 0 ) {
+	  if ( errno == EINTR ) {
+	    continue;
+	  }
+	  return false;
+	}
+	done += written;
+      }
+    }
+  }
+
+  void write_file_atomically( const std::string & path, const std::string & data ) {
+    stringstream tmp_path;
+    tmp_path << path << ".tmp" << getpid() << "_" << pthread_self();
+    bool written;
+    {
+      output_file out( tmp_path.str() );
+      out << data;
+      out.close();
+      written = !out.fail();
+    }
+    if ( !written || ( rename( tmp_path.str().c_str(), path.c_str() ) != 0 ) ) {
+      unlink( tmp_path.str().c_str() );
+      throw runtime_error( "Unable to write \"" + path + "\"" );
+    }
+  }
+
+  std::string import_file( const std::string & source, const std::string & directory, const std::string & extension ) {
+    string name = file_content_hash( source ) + extension;
+    string target = directory + "/" + name;
+    if ( access( target.c_str(), F_OK ) == 0 ) {
+      stats_add( "images", "deduplicated" );
+      return name;
+    }
+    make_directories( directory );
+    int in = open( source.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( in < 0 ) {
+      throw runtime_error( "Unable to open file \"" + source + "\" for input!" );
+    }
+    /* a half copied file must never show up under the final name */
+    stringstream tmp_path;
+    tmp_path << target << ".tmp" << getpid() << "_" << pthread_self();
+    int out = open( tmp_path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( out < 0 ) {
+      close( in );
+      throw runtime_error( "Unable to create image file" );
+    }
+    const char * method = NULL;
+    if ( ioctl( out, FICLONE, in ) == 0 ) {
+      method = "reflinked";
+    } else if ( ( link( source.c_str(), target.c_str() ) == 0 ) || ( errno == EEXIST ) ) {
+      close( out );
+      close( in );
+      unlink( tmp_path.str().c_str() );
+      stats_add( "images", "hardlinked" );
+      return name;
+    } else if ( copy_contents( in, out ) ) {
+      method = "copied";
+    }
+    close( in );
+    if ( ( close( out ) != 0 ) || ( method == NULL ) || ( rename( tmp_path.str().c_str(), target.c_str() ) != 0 ) ) {
+      unlink( tmp_path.str().c_str() );
+      throw runtime_error( "Unable to import \"" + source + "\"" );
+    }
+    stats_add( "images", method );
+    return name;
+  }
+
+}
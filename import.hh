@@ -0,0 +1,23 @@
+#include <string>
+
+#pragma once
+namespace xml2epub {
+
+  /* mkdir -p without a shell */
+  void make_directories( const std::string & path );
+
+  /* content hash of a file, computed once per process as long as its inode,
+     size and mtime don't change */
+  std::string file_content_hash( const std::string & path );
+
+  /* writes data to path through a temporary file next to it, so that a file
+     under path is always complete; throws if it can't be written */
+  void write_file_atomically( const std::string & path, const std::string & data );
+
+  /* places source in directory as <content hash><extension> and returns that
+     name. A file already imported under that name, in this run or an earlier
+     one, is reused; otherwise it is reflinked, hard linked or copied in the
+     kernel with copy_file_range, whichever works first. */
+  std::string import_file( const std::string & source, const std::string & directory, const std::string & extension );
+
+}
@@ -0,0 +1,194 @@
+#include <stdexcept>
+#include <iterator>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "input.hh"
+#include "profile.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  /* bytes read from a copied file, or handed to the sink by decompress, at once */
+  static const size_t kChunkSize = 64 * 1024;
+
+  input_document::input_document( const std::string & path, input_access access )
+    : m_map( NULL ), m_map_size( 0 ), m_data( NULL ), m_size( 0 ) {
+    stage_scope stage( "read" );
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) {
+      throw runtime_error( "Unable to open file \"" + path + "\" for input!" );
+    }
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 ) {
+      close( fd );
+      throw runtime_error( "Unable to stat \"" + path + "\"" );
+    }
+    if ( access == INPUT_COPIED ) {
+      /* the size is a hint only, the file may change while it is read */
+      m_buffer.reserve( st.st_size );
+      char buffer[kChunkSize];
+      for ( ;; ) {
+	ssize_t length = read( fd, buffer, sizeof(buffer) );
+	if ( length < 0 ) {
+	  if ( errno == EINTR ) {
+	    continue;
+	  }
+	  close( fd );
+	  throw runtime_error( "Unable to read \"" + path + "\"" );
+	}
+	if ( length == 0 ) {
+	  break;
+	}
+	m_buffer.append( buffer, length );
+      }
+      m_data = m_buffer.data();
+      m_size = m_buffer.size();
+    } else if ( st.st_size != 0 ) {
+      void * map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+      if ( map == MAP_FAILED ) {
+	close( fd );
+	throw runtime_error( "Unable to map \"" + path + "\"" );
+      }
+      /* read once front to back by the hash and the parser */
+      madvise( map, st.st_size, MADV_SEQUENTIAL );
+      m_map = map;
+      m_map_size = st.st_size;
+      m_data = static_cast<const char*>( map );
+      m_size = st.st_size;
+    } else {
+      m_data = m_buffer.data();
+    }
+    close( fd );
+    stats_add( "bytes_read", "input", m_size );
+  }
+
+  input_document::input_document( std::istream & in )
+    : m_map( NULL ), m_map_size( 0 ), m_data( NULL ), m_size( 0 ) {
+    stage_scope stage( "read" );
+    m_buffer.assign( istreambuf_iterator<char>( in ), istreambuf_iterator<char>() );
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    stats_add( "bytes_read", "input", m_size );
+  }
+
+  input_document::~input_document() {
+    if ( m_map != NULL ) {
+      munmap( m_map, m_map_size );
+    }
+  }
+
+  input_compression detect_compression( const char * data, size_t size ) {
+    const unsigned char * bytes = reinterpret_cast<const unsigned char*>( data );
+    if ( ( size >= 2 ) && ( bytes[0] == 0x1f ) && ( bytes[1] == 0x8b ) ) {
+      return COMPRESSION_GZIP;
+    }
+    if ( ( size >= 4 ) && ( bytes[0] == 0x28 ) && ( bytes[1] == 0xb5 ) && ( bytes[2] == 0x2f ) && ( bytes[3] == 0xfd ) ) {
+      return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+  }
+
+  static void gunzip( const char * data, size_t size, chunk_sink & sink ) {
+    z_stream stream;
+    memset( &stream, 0, sizeof(stream) );
+    /* 32: accept gzip and zlib headers */
+    if ( inflateInit2( &stream, 15 + 32 ) != Z_OK ) {
+      throw runtime_error( "inflateInit2 failed" );
+    }
+    string out( kChunkSize, '\0' );
+    stream.next_in = reinterpret_cast<Bytef*>( const_cast<char*>( data ) );
+    stream.avail_in = size;
+    int rc = Z_OK;
+    try {
+      while ( rc != Z_STREAM_END ) {
+	stream.next_out = reinterpret_cast<Bytef*>( &out[0] );
+	stream.avail_out = out.size();
+	rc = inflate( &stream, Z_NO_FLUSH );
+	if ( ( rc != Z_OK ) && ( rc != Z_STREAM_END ) ) {
+	  throw runtime_error( "corrupt gzip input" );
+	}
+	sink.write( out.data(), out.size() - stream.avail_out );
+	if ( ( rc == Z_STREAM_END ) && ( stream.avail_in != 0 ) ) {
+	  /* concatenated gzip members */
+	  if ( inflateReset( &stream ) != Z_OK ) {
+	    throw runtime_error( "inflateReset failed" );
+	  }
+	  rc = Z_OK;
+	}
+	if ( ( rc == Z_OK ) && ( stream.avail_in == 0 ) && ( stream.avail_out != 0 ) ) {
+	  throw runtime_error( "truncated gzip input" );
+	}
+      }
+    } catch ( ... ) {
+      inflateEnd( &stream );
+      throw;
+    }
+    inflateEnd( &stream );
+  }
+
+#ifdef HAVE_ZSTD
+  static void unzstd( const char * data, size_t size, chunk_sink & sink ) {
+    ZSTD_DStream * stream = ZSTD_createDStream();
+    if ( stream == NULL ) {
+      throw runtime_error( "ZSTD_createDStream failed" );
+    }
+    ZSTD_initDStream( stream );
+    string out( kChunkSize, '\0' );
+    ZSTD_inBuffer in = { data, size, 0 };
+    size_t rc = 1;
+    try {
+      while ( in.pos < in.size ) {
+	ZSTD_outBuffer buffer = { &out[0], out.size(), 0 };
+	rc = ZSTD_decompressStream( stream, &buffer, &in );
+	if ( ZSTD_isError( rc ) ) {
+	  throw runtime_error( string( "corrupt zstd input: " ) + ZSTD_getErrorName( rc ) );
+	}
+	sink.write( out.data(), buffer.pos );
+      }
+      /* flush what is still buffered in the decoder */
+      while ( rc != 0 ) {
+	ZSTD_outBuffer buffer = { &out[0], out.size(), 0 };
+	rc = ZSTD_decompressStream( stream, &buffer, &in );
+	if ( ZSTD_isError( rc ) ) {
+	  throw runtime_error( string( "corrupt zstd input: " ) + ZSTD_getErrorName( rc ) );
+	}
+	if ( buffer.pos == 0 ) {
+	  throw runtime_error( "truncated zstd input" );
+	}
+	sink.write( out.data(), buffer.pos );
+      }
+    } catch ( ... ) {
+      ZSTD_freeDStream( stream );
+      throw;
+    }
+    ZSTD_freeDStream( stream );
+  }
+#endif
+
+  void decompress( input_compression compression, const char * data, size_t size, chunk_sink & sink ) {
+    stage_scope stage( "decompress" );
+    switch ( compression ) {
+    case COMPRESSION_GZIP:
+      gunzip( data, size, sink );
+      break;
+    case COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+      unzstd( data, size, sink );
+      break;
+#else
+      throw runtime_error( "zstd compressed input, but xml2epub was built without libzstd" );
+#endif
+    default:
+      sink.write( data, size );
+    }
+  }
+}
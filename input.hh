@@ -0,0 +1,54 @@
+#include <string>
+#include <iostream>
+
+#pragma once
+namespace xml2epub {
+
+  /* how an input file gets into memory. A mapped file that is truncated
+     while it is read kills the process with SIGBUS, so long running modes
+     (watch, batch, daemon) where files are edited meanwhile read a copy. */
+  enum input_access {
+    INPUT_MAPPED,
+    INPUT_COPIED
+  };
+
+  /* the raw bytes of an input document. Files are mapped read-only or
+     copied, streams (standard input) are read into memory. */
+  class input_document {
+  private:
+    std::string m_buffer;
+    void * m_map;
+    size_t m_map_size;
+    const char * m_data;
+    size_t m_size;
+    input_document( const input_document & );
+    input_document & operator=( const input_document & );
+  public:
+    explicit input_document( const std::string & path, input_access access = INPUT_MAPPED );
+    explicit input_document( std::istream & in );
+    ~input_document();
+    const char * data() const { return m_data; }
+    size_t size() const { return m_size; }
+  };
+
+  enum input_compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+  };
+
+  /* by magic number, so compressed documents on standard input work too */
+  input_compression detect_compression( const char * data, size_t size );
+
+  class chunk_sink {
+  public:
+    virtual ~chunk_sink() {}
+    virtual void write( const char * data, size_t size ) = 0;
+  };
+
+  /* decompresses data piece by piece into sink, the decompressed document is
+     never held in memory as a whole. Throws on corrupt data and for zstd if
+     xml2epub was built without libzstd. */
+  void decompress( input_compression compression, const char * data, size_t size, chunk_sink & sink );
+
+}
@@ -2,6 +2,7 @@
 #include <sstream>
 #include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <libxml++/libxml++.h>
 #include <tidy.h>
 #include <buffio.h>
@@ -10,11 +11,34 @@
 #include "latex.hh"
 #include "latex2util.hh"
 #include "plot.hh"
+#include "csv.hh"
+#include "process.hh"
+#include "profile.hh"
+#include "stats.hh"
+#include "render_cache.hh"
+#include "text_kernel.hh"
+#include "output_sink.hh"
+#include "import.hh"
+#include "validate.hh"
+#include "raster.hh"
 
 using namespace xmlpp;
 using namespace std;
 
 namespace xml2epub {
+  /* writes text with every newline replaced by a space, without copying it */
+  static void write_without_newlines( std::ostream & out, const text_view & text ) {
+    const char * start = text.begin();
+    for ( const char * it = start; it != text.end(); ++it ) {
+      if ( *it == '\n' ) {
+	out.write( start, it - start );
+	out.put( ' ' );
+	start = it + 1;
+      }
+    }
+    out.write( start, text.end() - start );
+  }
+
   class encaps_state : public latex_state {
   public:
     encaps_state( const string & encaps, latex_builder & root, latex_state & parent, ostream & outs );
@@ -25,6 +49,8 @@ namespace xml2epub {
 
   class math_state : public latex_state {
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     math_state( latex_builder & root, latex_state & parent, ostream & outs ) :
       latex_state( root, parent, outs ) {
       m_out << "$";
@@ -42,21 +68,34 @@ namespace xml2epub {
       throw runtime_error( "can't use newline in math" );
     }
 
-    output_state * section( const std::string & section_name, unsigned int level ) {
+    output_state * section( const std::string & section_name, unsigned int level, const std::string & label ) {
       throw runtime_error( "can't use section xml tag in latex math" );
     }
 
-    output_state * plot() {
+    output_state * chapter( const std::string & chapter_name, const std::string & label ) {
+      throw runtime_error( "can't use chapter xml tag in latex math" );
+    }
+
+    output_state * plot( const std::string & label ) {
       throw runtime_error( "can't use plot xml tag in latex math" );
-    }    
+    }
+
+    /* the formula is latex already */
+    void put_text( const text_view & text ) {
+      write_without_newlines( m_out, text );
+    }
   public:
     void finish() {
       m_out << "$";
     }
   };
 
+  const char math_state::kChildren[TAG_COUNT + 1] = "t-------EF----.B--..";
+
   class latex_equation_state : public latex_state {
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     latex_equation_state( latex_builder & root, latex_state & parent, const std::string & label, ostream & outs ) :
       latex_state( root, parent, outs ) {
       m_out << "\\begin{equation}";
@@ -74,12 +113,8 @@ namespace xml2epub {
       throw runtime_error( "can't use math xml tag in latex math" );
     }
 
-    void put_text( const string & str ) {
-      std::string equation(str);
-      for ( size_t pos = equation.find("\n",0); pos != std::string::npos; pos = equation.find("\n",pos+1) ) {
-	equation[pos] = ' ';
-      }
-      m_out << equation;
+    void put_text( const text_view & text ) {
+      write_without_newlines( m_out, text );
     }
 
     void newline() {
@@ -90,20 +125,28 @@ namespace xml2epub {
       throw runtime_error( "can't use section xml tag in latex math" );
     }
 
+    output_state * chapter( const std::string & chapter_name, const std::string & label ) {
+      throw runtime_error( "can't use chapter xml tag in latex math" );
+    }
+
     output_state * plot( const std::string & label ) {
       throw runtime_error( "can't use plot xml tag in latex math" );
-    }    
+    }
   public:
     void finish() {
       m_out << "\\end{equation}\n";
     }
   };
 
+  const char latex_equation_state::kChildren[TAG_COUNT + 1] = "t-------EF----.B--..";
+
   class latex_plot_state : public latex_state {
   private:
-    stringstream m_data;
+    string m_data;
     string m_label;
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     latex_plot_state( latex_builder & root, latex_state & parent, const std::string & label, ostream & outs ) 
       : latex_state( root, parent, outs ), m_label(label) {
     }
@@ -127,28 +170,30 @@ namespace xml2epub {
       throw runtime_error( "can't use section xml tag in plot" );
     }
 
-    output_state * plot() {
+    output_state * chapter( const std::string & chapter_name, const std::string & label ) {
+      throw runtime_error( "can't use chapter xml tag in plot" );
+    }
+
+    output_state * plot( const std::string & label ) {
       throw runtime_error( "can't use plot xml tag in plot" );
-    }    
+    }
 
-    void put_text( const string & str ) {
-      m_data << str;
+    void put_text( const text_view & text ) {
+      text.append_to( m_data );
     }
 
     void finish() {
-      string image_file_path;
-      {
-	stringstream ss;
-	ss << getRootDirectory() << "/images/" << getpid() << "_" << random() << ".pdf";
-	image_file_path = ss.str();
-      }
-      system( std::string(std::string("mkdir -p ") + getRootDirectory() + std::string("/images")).c_str() );
-      {
-	ofstream pdf_file( image_file_path.c_str() );
-	if ( !pdf_file ) {
-	  throw runtime_error( "Unable to create image file" );
-	}
-	parse_plot( m_data.str(), pdf_file, false );
+      stage_scope stage( "plot" );
+      stage.arg( "label", m_label );
+      const string & data = m_data;
+      string image_file_path = getRootDirectory() + "/images/" + content_hash( "plot-pdf:" + data ) + ".pdf";
+      if ( access( image_file_path.c_str(), F_OK ) == 0 ) {
+	stats_add( "render_cache", "file_hit" );
+      } else {
+	string pdf = plot_pdf( data );
+	make_directories( getRootDirectory() + "/images" );
+	write_file_atomically( image_file_path, pdf );
+	stats_add( "bytes_written", "pdf", pdf.size() );
       }
       m_out << "\\begin{figure}";
       if ( m_label.size() != 0 ) {
@@ -161,13 +206,26 @@ namespace xml2epub {
     }
   };
 
+  const char latex_plot_state::kChildren[TAG_COUNT + 1] = "t-------EF----.B--..";
+
+  class svg2pdf_renderer : public image_renderer {
+  private:
+    const std::string & m_svg_path;
+  public:
+    svg2pdf_renderer( const std::string & svg_path ) : m_svg_path( svg_path ) {}
+    void render( std::ostream & out ) {
+      svg2pdf( m_svg_path, out );
+    }
+  };
+
   class latex_figure_state : public latex_state {
   private:
-    stringstream m_data;
     string m_label;
     std::vector<string> m_pdf_list;
     std::stringstream m_caption_stream;
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     latex_figure_state( latex_builder & root,
 			latex_state & parent, const std::string & label, ostream & outs ) 
       : latex_state( root, parent, outs ), m_label(label) {
@@ -177,26 +235,35 @@ namespace xml2epub {
     }
 
     void image( const std::string & filename ) {
-      string image_file_path;
-      {
-	stringstream ss;
-	ss << getRootDirectory() << "/images/" << getpid() << "_" << random() << ".pdf";
-	image_file_path = ss.str();
+      stage_scope stage( "figure" );
+      stage.arg( "src", filename );
+      if ( is_raster_image( filename ) ) {
+	/* xelatex includes png and jpeg files as they are, at print resolution */
+	string extension = filename.substr( filename.find_last_of( '.' ) );
+	m_pdf_list.push_back( getRootDirectory() + "/images/" +
+			      import_file( filename, getRootDirectory() + "/images", extension ) );
+	return;
       }
-      system( std::string(std::string("mkdir -p ") + getRootDirectory() + std::string("/images")).c_str() );
-      {
-	ofstream pdf_file( image_file_path.c_str() );
-	if ( !pdf_file ) {
-	  throw runtime_error( "Unable to create image file" );
-	}
-	svg2pdf( filename, pdf_file );
+      /* one pdf per distinct source, converted once per process (or cache
+	 directory) */
+      string key = "svg-pdf:" + file_content_hash( filename );
+      string image_file_path = getRootDirectory() + "/images/" + content_hash( key ) + ".pdf";
+      if ( access( image_file_path.c_str(), F_OK ) == 0 ) {
+	stats_add( "images", "deduplicated" );
+      } else {
+	svg2pdf_renderer renderer( filename );
+	string pdf = cached_render( key, renderer );
+	make_directories( getRootDirectory() + "/images" );
+	write_file_atomically( image_file_path, pdf );
+	stats_add( "images", "converted" );
+	stats_add( "bytes_written", "pdf", pdf.size() );
       }
       m_pdf_list.push_back( image_file_path );
     }
 
     output_state * caption( ) {
-      latex_state * retval = new latex_state( m_root, *this, m_caption_stream );
-      m_children.push_back( retval );
+      latex_state * retval = new ( arena() ) latex_state( m_root, *this, m_caption_stream );
+      adopt( retval );
       return retval;
     }
 
@@ -222,8 +289,154 @@ namespace xml2epub {
     }
   };
 
+  const char latex_figure_state::kChildren[TAG_COUNT + 1] = "t-TTTTTMEF.TP..B--..";
+
+  /* constructed before latex_state, so that the buffer exists when it is
+     handed to it */
+  struct chapter_buffer {
+    std::stringstream m_buffer;
+  };
+
+  /* a top level chapter in its own file. The chapter is buffered, written
+     only if it differs from the file of the previous run, and the master
+     gets an \include of it. */
+  class latex_chapter_state : private chapter_buffer, public latex_state {
+  private:
+    std::ostream & m_master;
+    std::string m_include_name;
+  public:
+    latex_chapter_state( latex_builder & root, latex_state & parent, std::ostream & master, const std::string & include_name )
+      : latex_state( root, parent, m_buffer ), m_master( master ), m_include_name( include_name ) {
+    }
+    virtual ~latex_chapter_state() {
+    }
+    void finish() {
+      m_root.write_chapter_file( m_include_name, m_buffer.str() );
+      m_master << "\\include{" << m_include_name << "}" << endl;
+    }
+  };
+
+  static void begin_longtable( std::ostream & out, size_t columns ) {
+    out << "\\begin{longtable}{|";
+    for ( size_t i=0; i<columns; ++i ) {
+      out << "l|";
+    }
+    out << "}\n\\hline\n";
+  }
+
+  class latex_table_state;
+
+  class latex_table_row_state : public latex_state {
+  private:
+    latex_table_state & m_table;
+    unsigned int m_columns;
+  public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
+    latex_table_row_state( latex_builder & root, latex_table_state & parent, ostream & outs );
+    virtual ~latex_table_row_state() {
+    }
+
+    void put_text( const text_view & text ) {
+      if ( text.is_white_space() == false ) {
+	throw runtime_error( "text in a table row must be inside a cell" );
+      }
+    }
+
+    output_state * table_cell() {
+      if ( m_columns++ != 0 ) {
+	m_out << " & ";
+      }
+      latex_state * retval = new ( arena() ) latex_state( m_root, * this, m_out );
+      adopt( retval );
+      return retval;
+    }
+
+    void finish();
+  };
+
+  const char latex_table_row_state::kChildren[TAG_COUNT + 1] = "w-TTTTTMEF--P..B-T..";
+
+  /* inline tables are buffered until the column count is known, tables with
+     a src attribute are streamed row by row straight from the csv file */
+  class latex_table_state : public latex_state {
+  private:
+    friend class latex_table_row_state;
+    std::string m_src;
+    std::stringstream m_rows;
+    size_t m_columns;
+  public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
+    latex_table_state( latex_builder & root, latex_state & parent, const std::string & src, ostream & outs ) 
+      : latex_state( root, parent, outs ), m_src( src ), m_columns( 0 ) {
+    }
+    virtual ~latex_table_state() {
+    }
+
+    void put_text( const text_view & text ) {
+      if ( text.is_white_space() == false ) {
+	throw runtime_error( "text in a table must be inside a cell" );
+      }
+    }
+
+    output_state * table_row() {
+      if ( m_src.size() != 0 ) {
+	throw runtime_error( "a table with a src attribute can't have rows" );
+      }
+      latex_state * retval = new ( arena() ) latex_table_row_state( m_root, * this, m_rows );
+      adopt( retval );
+      return retval;
+    }
+
+    void finish() {
+      if ( m_src.size() == 0 ) {
+	if ( m_columns != 0 ) {
+	  begin_longtable( m_out, m_columns );
+	  m_out << m_rows.rdbuf();
+	  m_out << "\\end{longtable}\n";
+	}
+	return;
+      }
+      std::ifstream in_file( m_src.c_str() );
+      if ( !in_file ) {
+	throw runtime_error( "Unable to open table source file \"" + m_src + "\"" );
+      }
+      csv_reader reader( in_file );
+      std::vector<std::string> cells;
+      if ( reader.next_row( cells ) == false ) {
+	return;
+      }
+      begin_longtable( m_out, cells.size() );
+      do {
+	for ( size_t i=0; i<cells.size(); ++i ) {
+	  if ( i != 0 ) {
+	    m_out << " & ";
+	  }
+	  write_text( cells[i] );
+	}
+	m_out << " \\\\ \\hline\n";
+      } while ( reader.next_row( cells ) );
+      m_out << "\\end{longtable}\n";
+    }
+  };
+
+  const char latex_table_state::kChildren[TAG_COUNT + 1] = "w-TTTTTMEF--P..BR-..";
+
+  latex_table_row_state::latex_table_row_state( latex_builder & root, latex_table_state & parent, ostream & outs )
+    : latex_state( root, parent, outs ), m_table( parent ), m_columns( 0 ) {
+  }
+
+  void latex_table_row_state::finish() {
+    m_out << " \\\\ \\hline\n";
+    if ( m_columns > m_table.m_columns ) {
+      m_table.m_columns = m_columns;
+    }
+  }
+
   latex_state::latex_state( latex_builder & root, latex_state & parent, ostream & outs ) 
-    : m_root( root ), m_parent( parent ), m_out( outs ) {
+    : m_root( root ), m_parent( parent ), m_first_child( NULL ), m_prev_sibling( NULL ), m_next_sibling( NULL ),
+      m_out( outs ) {
   }
 
   latex_state::~latex_state() {
@@ -231,24 +444,35 @@ namespace xml2epub {
       /* i am root */
       m_root.m_root = NULL;
     } else {
-      vector<latex_state*>::iterator it;
-      if ( ( it = find( m_parent.m_children.begin(), m_parent.m_children.end(), this ) )
-	   != m_parent.m_children.end() ) {
-	m_parent.m_children.erase( it );
+      if ( m_prev_sibling != NULL ) {
+	m_prev_sibling->m_next_sibling = m_next_sibling;
+      } else {
+	m_parent.m_first_child = m_next_sibling;
+      }
+      if ( m_next_sibling != NULL ) {
+	m_next_sibling->m_prev_sibling = m_prev_sibling;
       }
     }
     /* delete all my children */
-    if ( m_children.begin() != m_children.end() ) {
+    if ( m_first_child != NULL ) {
       cerr << "Warning: there are still children that have not been deleted" << endl;
-      vector<latex_state*> copy( m_children );
-      m_children.clear();
-      for ( vector<latex_state*>::iterator it = copy.begin(); it != copy.end(); ++it ) {
-	if ( *it != NULL ) {
-	  delete *it;
-	}
+      while ( m_first_child != NULL ) {
+	delete m_first_child;
       }
     }
   }
+
+  state_arena & latex_state::arena() {
+    return m_root.m_arena;
+  }
+
+  void latex_state::adopt( latex_state * child ) {
+    child->m_next_sibling = m_first_child;
+    if ( m_first_child != NULL ) {
+      m_first_child->m_prev_sibling = child;
+    }
+    m_first_child = child;
+  }
   
   void latex_state::reference( const std::string & label ) {
     m_out << "\\ref{" << label << "}";
@@ -258,10 +482,15 @@ namespace xml2epub {
     m_out << "\\ref{" << id << "}";
   }
 
-  void latex_state::put_text( const string & str ) {
-    std::string filtered_string(str);
-    std::replace(filtered_string.begin(), filtered_string.end(), '\n', ' ');
-    m_out << filtered_string;
+  void latex_state::put_text( const text_view & text ) {
+    write_text( text );
+  }
+
+  void latex_state::write_text( const text_view & text ) {
+    std::string & buffer = m_root.m_text_buffer;
+    buffer.clear();
+    normalize_text( text.data(), text.size(), ESCAPE_LATEX, buffer );
+    m_out.write( buffer.data(), buffer.size() );
   }
 
   void latex_state::newline() {
@@ -272,6 +501,8 @@ namespace xml2epub {
     m_out << endl << endl;
   }
 
+  const char latex_state::kChildren[TAG_COUNT + 1] = "t-TTTTTMEF--P..B--..";
+
   output_state * latex_state::section( const std::string & section_name, unsigned int level, const std::string & label ) {
     if ( level > 2 ) {
       throw runtime_error( "latex backend only supports subsubsection (level=2)" );
@@ -284,49 +515,60 @@ namespace xml2epub {
     if ( label.size() != 0 ) {
       m_out << "\\label{" << label << "}" << endl;
     }
-    latex_state * retval = new latex_state( m_root, *this, m_out );
-    m_children.push_back( retval );
+    latex_state * retval = new ( arena() ) latex_state( m_root, *this, m_out );
+    adopt( retval );
     return retval;
   }
 
   output_state * latex_state::chapter( const std::string & chapter_name, const std::string & label ) {
-    m_out << "\\";
-    m_out << "chapter{" << chapter_name << "}" << endl;
+    latex_state * retval;
+    if ( ( &m_parent == this ) && ( m_root.chapter_mode() != LATEX_SINGLE_FILE ) ) {
+      retval = new ( arena() ) latex_chapter_state( m_root, *this, m_out, m_root.next_chapter_file() );
+    } else {
+      retval = new ( arena() ) latex_state( m_root, *this, m_out );
+    }
+    adopt( retval );
+    retval->m_out << "\\";
+    retval->m_out << "chapter{" << chapter_name << "}" << endl;
     if ( label.size() != 0 ) {
-      m_out << "\\label{" << label << "}" << endl;
+      retval->m_out << "\\label{" << label << "}" << endl;
     }
-    latex_state * retval = new latex_state( m_root, *this, m_out );
-    m_children.push_back( retval );
     return retval;
   }
 
   output_state * latex_state::bold() {
-    latex_state * retval = new encaps_state( "bf", m_root, * this, m_out );
-    m_children.push_back( retval );
+    latex_state * retval = new ( arena() ) encaps_state( "bf", m_root, * this, m_out );
+    adopt( retval );
     return retval;
   }
 
   output_state * latex_state::math() {
-    latex_state * retval = new math_state( m_root, * this, m_out );
-    m_children.push_back( retval );
+    latex_state * retval = new ( arena() ) math_state( m_root, * this, m_out );
+    adopt( retval );
     return retval;
   }
 
   output_state * latex_state::equation(const std::string & label ) {
-    latex_state * retval = new latex_equation_state( m_root, * this, label, m_out );
-    m_children.push_back( retval );
+    latex_state * retval = new ( arena() ) latex_equation_state( m_root, * this, label, m_out );
+    adopt( retval );
     return retval;
   }
 
   output_state * latex_state::plot( const std::string & label ) {
-    latex_state * retval = new latex_plot_state( m_root, * this, label, m_out );
-    m_children.push_back( retval );
+    latex_state * retval = new ( arena() ) latex_plot_state( m_root, * this, label, m_out );
+    adopt( retval );
+    return retval;
+  }
+
+  output_state * latex_state::table( const std::string & src ) {
+    latex_state * retval = new ( arena() ) latex_table_state( m_root, * this, src, m_out );
+    adopt( retval );
     return retval;
   }
 
   output_state * latex_state::figure( const std::string & label ) {
-    latex_state * retval = new latex_figure_state( m_root, * this, label, m_out );
-    m_children.push_back( retval );
+    latex_state * retval = new ( arena() ) latex_figure_state( m_root, * this, label, m_out );
+    adopt( retval );
     return retval;
   }
 
@@ -351,6 +593,8 @@ namespace xml2epub {
 
   class root_state : public latex_state {
   public:
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[TAG_COUNT + 1];
     root_state( latex_builder & root, std::ostream & outs, bool minimal ) :
       latex_state( root, *this, outs ) {
       if ( minimal == true ) {
@@ -361,6 +605,10 @@ namespace xml2epub {
 	m_out << "\\usepackage{graphicx}" << endl;
 	m_out << "\\usepackage{fullpage}" << endl;
 	m_out << "\\usepackage{amsmath}" << endl;
+	m_out << "\\usepackage{longtable}" << endl;
+	if ( root.chapter_mode() != LATEX_SINGLE_FILE ) {
+	  m_out << "\\InputIfFileExists{" << root.draft_file() << "}{}{}" << endl;
+	}
 	m_out << "\\begin{document}" << endl;
       }
     }
@@ -368,14 +616,27 @@ namespace xml2epub {
       
     }
     void finish() {
+      if ( m_root.chapter_mode() != LATEX_SINGLE_FILE ) {
+	m_root.write_draft_file();
+      }
       m_out << "\\end{document}" << endl;
     }
   };
 
+  const char root_state::kChildren[TAG_COUNT + 1] = "t-TTTTTMEF--P..B--..";
+
     
-  latex_builder::latex_builder( ostream & output_stream, const std::string & output_file_path, bool minimal ) 
+  latex_builder::latex_builder( ostream & output_stream, const std::string & output_file_path, bool minimal,
+				latex_chapter_mode chapter_mode ) 
     : m_out( output_stream ), m_root( NULL ), m_minimal( minimal ),
-      m_base_dir(output_file_path.substr(0,output_file_path.find_last_of( '/' ))) {
+      m_base_dir(output_file_path.substr(0,output_file_path.find_last_of( '/' ))),
+      m_chapter_mode( chapter_mode ), m_chapter_count( 0 ) {
+    m_output_stem = output_file_path;
+    if ( ( m_output_stem.size() > 4 ) && ( m_output_stem.compare( m_output_stem.size() - 4, 4, ".tex" ) == 0 ) ) {
+      m_output_stem.resize( m_output_stem.size() - 4 );
+    }
+    size_t slash = m_output_stem.find_last_of( '/' );
+    m_include_stem = ( slash == std::string::npos ) ? m_output_stem : m_output_stem.substr( slash + 1 );
   }
     
   latex_builder::~latex_builder() {
@@ -396,4 +657,70 @@ namespace xml2epub {
     return m_base_dir;
   }
 
+  /* leaves the file and its mtime alone if it already holds content, returns
+     whether it was written */
+  static bool write_if_changed( const std::string & path, const std::string & content ) {
+    {
+      ifstream in( path.c_str() );
+      if ( in ) {
+	stringstream existing;
+	existing << in.rdbuf();
+	if ( existing.str() == content ) {
+	  return false;
+	}
+      }
+    }
+    output_file out( path );
+    out << content;
+    out.close();
+    if ( !out ) {
+      throw runtime_error( "Unable to write \"" + path + "\"" );
+    }
+    stats_add( "bytes_written", "latex", content.size() );
+    return true;
+  }
+
+  std::string latex_builder::next_chapter_file() {
+    stringstream ss;
+    ss << m_include_stem << "-chapter" << setw(2) << setfill('0') << ++m_chapter_count;
+    return ss.str();
+  }
+
+  void latex_builder::write_chapter_file( const std::string & include_name, const std::string & content ) {
+    string directory = m_output_stem.substr( 0, m_output_stem.size() - m_include_stem.size() );
+    if ( write_if_changed( directory + include_name + ".tex", content ) ) {
+      m_changed_chapters.push_back( include_name );
+      stats_add( "latex_chapters", "rewritten" );
+    } else {
+      stats_add( "latex_chapters", "unchanged" );
+    }
+  }
+
+  void latex_builder::write_draft_file() {
+    string content;
+    if ( ( m_chapter_mode == LATEX_CHAPTER_DRAFT ) && ( m_changed_chapters.size() != 0 ) ) {
+      /* only the changed chapters are typeset, the others keep the page
+	 numbers and references of their .aux files */
+      content = "\\includeonly{";
+      for ( size_t i=0; i<m_changed_chapters.size(); ++i ) {
+	content += ( i != 0 ) ? "," : "";
+	content += m_changed_chapters[i];
+      }
+      content += "}\n";
+    }
+    write_if_changed( m_output_stem + "-draft.tex", content );
+  }
+
+  const char * const kLatexContextRules[CTX_COUNT] = {
+    root_state::kChildren,
+    /* chapters, sections, encaps_state and the states of captions and cells */
+    latex_state::kChildren,
+    math_state::kChildren,
+    latex_equation_state::kChildren,
+    latex_plot_state::kChildren,
+    latex_figure_state::kChildren,
+    latex_table_state::kChildren,
+    latex_table_row_state::kChildren
+  };
+
 }
@@ -3,24 +3,34 @@
 #include <iostream>
 #include <libxml++/libxml++.h>
 #include "builder.hh"
+#include "arena.hh"
 #pragma once
 
 namespace xml2epub {
   class latex_builder;
 
-  class latex_state : public output_state {
+  class latex_state : public output_state, public arena_object {
   protected:
     friend class latex_builder;
     latex_builder & m_root;
     latex_state & m_parent;
-    std::vector<latex_state*> m_children;
+    /* intrusive list of the children that are still open */
+    latex_state * m_first_child;
+    latex_state * m_prev_sibling;
+    latex_state * m_next_sibling;
     std::ostream & m_out;
+    void adopt( latex_state * child );
+    state_arena & arena();
+    /* user text with white space collapsed and the latex specials escaped */
+    void write_text( const text_view & text );
   public:
     latex_state( latex_builder & root, latex_state & parent, std::ostream & outs );  
+    /* the children this state accepts, see validate.hh */
+    static const char kChildren[];
   public:
     virtual ~latex_state();
   
-    void put_text( const std::string & str );  
+    void put_text( const text_view & text );  
     void newline();
     void new_paragraph();
     void reference( const std::string & label );
@@ -32,11 +42,21 @@ namespace xml2epub {
     output_state * chapter( const std::string & chapter_name, const std::string & label );
     output_state * plot( const std::string & label );
     output_state * figure( const std::string & label );
+    output_state * table( const std::string & src );
     void finish();
   public:
     const std::string & getRootDirectory() const;
   };
 
+  enum latex_chapter_mode {
+    /* the whole book in the output file */
+    LATEX_SINGLE_FILE,
+    /* every top level chapter in a file of its own, pulled in with \include */
+    LATEX_CHAPTER_FILES,
+    /* chapter files plus an \includeonly list of the chapters that changed */
+    LATEX_CHAPTER_DRAFT
+  };
+
   class latex_builder : public output_builder {
   private:
     friend class latex_state;
@@ -44,11 +64,32 @@ namespace xml2epub {
     latex_state * m_root;
     bool m_minimal;
     std::string m_base_dir;
+    latex_chapter_mode m_chapter_mode;
+    /* output path without the .tex extension and its file name part, the
+       chapter files are named after it */
+    std::string m_output_stem;
+    std::string m_include_stem;
+    unsigned int m_chapter_count;
+    std::vector<std::string> m_changed_chapters;
+    /* holds all states below the root, rewound after every chapter */
+    state_arena m_arena;
+    /* reused by write_text() so that writing text does not allocate */
+    std::string m_text_buffer;
   public:
-    latex_builder( std::ostream & output_stream, const std::string & output_file_path, bool minimal = false );
+    latex_builder( std::ostream & output_stream, const std::string & output_file_path, bool minimal = false,
+		   latex_chapter_mode chapter_mode = LATEX_SINGLE_FILE );
     virtual ~latex_builder();
     output_state * create_root();
     const std::string & getRootDirectory() const;
+    latex_chapter_mode chapter_mode() const { return m_chapter_mode; }
+    /* the \include name of the next chapter file */
+    std::string next_chapter_file();
+    /* writes a chapter file unless it already has this content */
+    void write_chapter_file( const std::string & include_name, const std::string & content );
+    /* the file the master reads in its preamble, holds the \includeonly list
+       in draft mode */
+    std::string draft_file() const { return m_include_stem + "-draft"; }
+    void write_draft_file();
   };
 
 }
@@ -1,7 +1,10 @@
 #include <cstdlib>
+#include <cmath>
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <unistd.h>
 #include <glib.h>
 #include <poppler.h>
 #include <poppler-document.h>
@@ -13,11 +16,16 @@
 #include <librsvg/rsvg-cairo.h>
 
 #include "latex2util.hh"
+#include "process.hh"
+#include "profile.hh"
+#include "output_sink.hh"
+#include "progress.hh"
 
 using namespace std;
 
 namespace xml2epub {
   void latex2pdf( istream & input, string & pdf_path ) {
+    stage_scope stage( "latex2pdf" );
     string file_name;
     {
       stringstream ss;
@@ -28,8 +36,7 @@ namespace xml2epub {
     string tex_file("/tmp/");
     tex_file += file_name;
     tex_file += ".tex";
-    ofstream file;
-    file.open( tex_file.c_str(), ios_base::trunc | ios_base::out );
+    output_file file( tex_file );
     if ( !file ) {
       throw runtime_error( "Unable to open tmp file" );
     }
@@ -46,7 +53,7 @@ namespace xml2epub {
       ss << "(( cd /tmp; xelatex " << file_name << ".tex && mv " << file_name << ".pdf pdf_" << file_name << ".pdf ) 2>&1 ) > /dev/null";
       command = ss.str();
     }
-    system( command.c_str() );
+    run_command( "xelatex", command );
     
     {
       stringstream ss;
@@ -59,7 +66,7 @@ namespace xml2epub {
       ss << "rm -fr /tmp/" << file_name << "*";
       command = ss.str();
     }
-    system( command.c_str() );
+    run_command( "rm", command );
   }
 
   cairo_status_t cairo_to_stream_write( void * closure, const unsigned char * data, unsigned int length ) {
@@ -69,7 +76,7 @@ namespace xml2epub {
   }
 
   void latex2png( istream & input, string & png_path ) {
-    std::ofstream png_file(png_path.c_str());
+    output_file png_file( png_path );
     latex2png(input, png_file);
   }
   
@@ -87,12 +94,8 @@ namespace xml2epub {
     unlink( pdf_path.c_str() );    
   }
 
-  void pdf2svg( const std::string & pdf_path, std::ostream & output, double scale_factor ) {
-    gchar * filename_uri = g_filename_to_uri( pdf_path.c_str(), NULL, NULL );
-    PopplerDocument * doc = poppler_document_new_from_file( filename_uri, NULL, NULL );
-    if ( doc == NULL ) {
-      throw runtime_error( "poppler_document_new_from_file failed!" );
-    }
+  /* svg of the first page of doc, cropped to what is drawn */
+  static void first_page2svg( PopplerDocument * doc, std::ostream & output, double scale_factor ) {
     PopplerPage * page = poppler_document_get_page( doc, 0 );
     if ( page != NULL ) {
       double width, height;
@@ -133,7 +136,87 @@ namespace xml2epub {
     g_object_unref( doc );
   }
 
+  void pdf2svg( const std::string & pdf_path, std::ostream & output, double scale_factor ) {
+    stage_scope stage( "pdf2svg" );
+    gchar * filename_uri = g_filename_to_uri( pdf_path.c_str(), NULL, NULL );
+    PopplerDocument * doc = poppler_document_new_from_file( filename_uri, NULL, NULL );
+    g_free( filename_uri );
+    if ( doc == NULL ) {
+      throw runtime_error( "poppler_document_new_from_file failed!" );
+    }
+    first_page2svg( doc, output, scale_factor );
+  }
+
+  /* poppler only reads the data, it has to stay alive as long as the
+     document */
+  static PopplerDocument * open_pdf_data( const std::string & pdf ) {
+    PopplerDocument * doc = poppler_document_new_from_data( const_cast<char*>( pdf.data() ), pdf.size(), NULL, NULL );
+    if ( doc == NULL ) {
+      throw runtime_error( "poppler_document_new_from_data failed!" );
+    }
+    return doc;
+  }
+
+  void pdf_data2svg( const std::string & pdf, std::ostream & output, double scale_factor ) {
+    stage_scope stage( "pdf2svg" );
+    first_page2svg( open_pdf_data( pdf ), output, scale_factor );
+  }
+
+  void pdf_data2png( const std::string & pdf, const std::vector<unsigned int> & dpis, std::vector<std::string> & pngs,
+		     double scale_factor, std::vector<double> * seconds ) {
+    stage_scope stage( "pdf2png" );
+    pngs.assign( dpis.size(), string() );
+    if ( seconds != NULL ) {
+      seconds->assign( dpis.size(), 0. );
+    }
+    PopplerDocument * doc = open_pdf_data( pdf );
+    PopplerPage * page = poppler_document_get_page( doc, 0 );
+    if ( page == NULL ) {
+      g_object_unref( doc );
+      return;
+    }
+    /* poppler renders once into the recording, every resolution replays it */
+    cairo_surface_t * recording = cairo_recording_surface_create( CAIRO_CONTENT_COLOR_ALPHA, NULL );
+    cairo_t * drawcontext = cairo_create( recording );
+    cairo_scale( drawcontext, scale_factor, scale_factor );
+    poppler_page_render( page, drawcontext );
+    cairo_show_page( drawcontext );
+    cairo_destroy( drawcontext );
+    g_object_unref( page );
+    g_object_unref( doc );
+    double bbox_x, bbox_y, bbox_width, bbox_height;
+    cairo_recording_surface_ink_extents( recording, &bbox_x, &bbox_y, &bbox_width, &bbox_height );
+
+    for ( size_t i=0; i<dpis.size(); ++i ) {
+      double start = progress_clock();
+      /* pdf units are points, 72 per inch */
+      double zoom = dpis[i] / 72.;
+      int width = static_cast<int>( ceil( bbox_width * zoom ) );
+      int height = static_cast<int>( ceil( bbox_height * zoom ) );
+      cairo_surface_t * surface = cairo_image_surface_create( CAIRO_FORMAT_ARGB32, max( width, 1 ), max( height, 1 ) );
+      if ( cairo_surface_status( surface ) != CAIRO_STATUS_SUCCESS ) {
+	cairo_surface_destroy( surface );
+	cairo_surface_destroy( recording );
+	throw runtime_error( "cairo_image_surface_create failed" );
+      }
+      drawcontext = cairo_create( surface );
+      cairo_scale( drawcontext, zoom, zoom );
+      cairo_set_source_surface( drawcontext, recording, -1.*bbox_x, -1.*bbox_y );
+      cairo_paint( drawcontext );
+      cairo_destroy( drawcontext );
+      stringstream png;
+      cairo_surface_write_to_png_stream( surface, cairo_to_stream_write, &png );
+      cairo_surface_destroy( surface );
+      pngs[i] = png.str();
+      if ( seconds != NULL ) {
+	(*seconds)[i] = progress_clock() - start;
+      }
+    }
+    cairo_surface_destroy( recording );
+  }
+
   void pdf2png( const std::string & pdf_path, std::ostream & output, double scale_factor ) {
+    stage_scope stage( "pdf2png" );
     gchar * filename_uri = g_filename_to_uri( pdf_path.c_str(), NULL, NULL );
     PopplerDocument * doc = poppler_document_new_from_file( filename_uri, NULL, NULL );
     if ( doc == NULL ) {
@@ -182,6 +265,8 @@ namespace xml2epub {
   }
 
   void svg2pdf( const std::string & svg_path, std::ostream & output, double scale_factor ) {
+    stage_scope stage( "svg2pdf" );
+    stage.arg( "src", svg_path );
     RsvgHandle * svg = NULL;
     {
       std::string svg_data;
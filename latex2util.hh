@@ -1,4 +1,6 @@
 #include <iostream>
+#include <string>
+#include <vector>
 
 namespace xml2epub {
 
@@ -7,6 +9,13 @@ namespace xml2epub {
   void latex2png( std::istream & input, std::ostream & png_stream );
   void pdf2svg( const std::string & pdf_path, std::ostream & output, double scale_factor=1.0 );
   void pdf2png( const std::string & pdf_path, std::ostream & output, double scale_factor=1.0 );
+  /* the first page of a pdf held in memory */
+  void pdf_data2svg( const std::string & pdf, std::ostream & output, double scale_factor=1.0 );
+  /* png images of the first page of a pdf held in memory at several
+     resolutions (dots per inch at scale factor 1), all replayed from a
+     single poppler render. seconds receives the time spent per resolution. */
+  void pdf_data2png( const std::string & pdf, const std::vector<unsigned int> & dpis, std::vector<std::string> & pngs,
+		     double scale_factor=1.0, std::vector<double> * seconds=NULL );
   void svg2pdf( const std::string & svg_path, std::ostream & output, double scale_factor=1.0 );
   void latex2svg( std::istream & input, std::ostream & output );
 }
@@ -4,51 +4,82 @@
 #include <vector>
 #include <stdexcept>
 #include <sstream>
-#include <cmath>
+#include <unistd.h>
 #include <boost/program_options.hpp>
 #include <libxml++/libxml++.h>
+#include <libxml/parser.h>
 #include <tidy.h>
 #include <buffio.h>
 #include <glib-object.h>
 
-#include "builder.hh"
-#include "html.hh"
-#include "latex.hh"
+#include "parse.hh"
+#include "batch.hh"
+#include "serve.hh"
+#include "watch.hh"
+#include "input.hh"
+#include "catalog.hh"
+#include "raster.hh"
+#include "fallback.hh"
+#include "svgopt.hh"
+#include "pool.hh"
+#include "render_cache.hh"
 #include "symmap.hh"
+#include "profile.hh"
+#include "trace.hh"
+#include "stats.hh"
+#include "progress.hh"
 
 namespace po = boost::program_options;
 using namespace std;
 using namespace xmlpp;
 
 namespace xml2epub {
-  unsigned int count_total_xml_elements( const Node & in_node ) {
-    unsigned int retval = 1;
-    const Element * elem_pre = dynamic_cast<const Element*>(&in_node);
-    if ( elem_pre != NULL ) {
-      const Element & elem = *elem_pre;
-      Node::NodeList list = elem.get_children();
-      for ( Node::NodeList::iterator iter = list.begin(); iter != list.end(); ++iter ) {
-	if ( *iter != NULL ) {
-	  retval += count_total_xml_elements( **iter );
-	}
-      }
-    }
-    return retval;
-  }
+  struct cmdline_args {
+    bool keep_text;
+    string input_file;
+    bool input_file_is_cin;
+    string output_file;
+    conversion_options conversion;
+    string profile_file;
+    string trace_file;
+    string stats_format;
+    string batch_manifest;
+    unsigned int jobs;
+    string cache_dir;
+    string serve_socket;
+    unsigned int serve_max_megabytes;
+    string submit_socket;
+    bool watch;
+    unsigned int device_width;
+    unsigned int device_height;
+    vector<unsigned int> png_fallback_dpis;
+    int svg_precision;
+    bool svg_glyph_sprite;
+  };
 
-  void parse_cmdline_args( int argc, char * argv[], bool keep_text, 
-			   string & input_file,
-			   bool & input_file_is_cin,
-			   string & output_file,
-			   bool & output_file_is_cout,
-			   bool & output_html ) {
+  void parse_cmdline_args( int argc, char * argv[], cmdline_args & args ) {
     /* defaults */
-    keep_text = false;
-    input_file = "";
-    input_file_is_cin = true;
-    output_file = "";
-    output_file_is_cout = true;
-    output_html = true;
+    args.keep_text = false;
+    args.input_file = "";
+    args.input_file_is_cin = true;
+    args.output_file = "";
+    args.conversion.html = true;
+    args.conversion.progress_mode = "weighted";
+    args.conversion.cost_model_path = default_cost_model_path();
+    args.profile_file = "";
+    args.trace_file = "";
+    args.stats_format = "";
+    args.batch_manifest = "";
+    args.jobs = hardware_threads();
+    args.cache_dir = "";
+    args.serve_socket = "";
+    args.serve_max_megabytes = 64;
+    args.submit_socket = "";
+    args.watch = false;
+    args.device_width = 1200;
+    args.device_height = 1600;
+    args.svg_precision = 2;
+    args.svg_glyph_sprite = false;
     
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -56,7 +87,27 @@ namespace xml2epub {
       ( "keep-text,t", po::value<bool>(), "When converting equations to svg images, keep text or convert to path" )
       ( "input-file,i", po::value< vector<string> >(), "input xml file path (default is standard input)" )
       ( "output-file,o", po::value< vector<string> >(), "output html file" )
-      ( "latex,l", po::value<bool>(), "output latex file" );
+      ( "latex,l", po::value<bool>(), "output latex file" )
+      ( "latex-output", po::value<string>(), "with html output: also write the latex edition to this file, sharing the parse and the rendered plots" )
+      ( "latex-chapters", "write every chapter of the latex output to a file of its own, included from the output file and only rewritten when it changes" )
+      ( "latex-draft", "like --latex-chapters, and let latex typeset only the chapters that changed (\\includeonly)" )
+      ( "device-resolution", po::value<string>(), "fit png and jpeg figures of the html output into this many pixels (WIDTHxHEIGHT, default 1200x1600, 0x0 keeps them as they are)" )
+      ( "png-fallback", po::value<string>(), "html: also render formulas, equations and plots as png at these resolutions (comma separated dpi, e.g. 96,192) for readers without svg support" )
+      ( "svg-precision", po::value<int>(), "digits after the decimal point kept in the coordinates of formula and plot images (default 2, -1 keeps all)" )
+      ( "svg-glyph-sprite", "html: define the glyphs of all formula and plot images of a chapter once, in a file the images refer to" )
+      ( "pdf", "typeset the latex output into a pdf, rerunning xelatex only until the cross references settle" )
+      ( "batch", po::value<string>(), "convert all documents listed in this manifest (lines of: input output html|latex)" )
+      ( "jobs,j", po::value<unsigned int>(), "number of documents converted in parallel in batch and daemon mode, worker threads of a single conversion otherwise, also the threads rendering png fallbacks (default: number of cpus)" )
+      ( "cache-dir", po::value<string>(), "keep rendered formulas, plots and parsed documents in this directory across runs" )
+      ( "serve", po::value<string>(), "run as conversion daemon listening on this unix socket" )
+      ( "serve-max-document", po::value<unsigned int>(), "largest document the daemon accepts over the socket, in megabytes (default 64)" )
+      ( "submit", po::value<string>(), "let the daemon listening on this unix socket convert the input file" )
+      ( "watch", "keep running and rebuild the changed chapters whenever the input or a file it references changes" )
+      ( "profile", po::value<string>(), "write per-stage timings and process counts to this file" )
+      ( "trace", po::value<string>(), "write a chrome trace-event json file of all pipeline stages (not with --serve or --watch)" )
+      ( "stats", po::value<string>(), "print build statistics to standard output (text or json)" )
+      ( "progress", po::value<string>(), "progress report: weighted (default), streaming (no counting pass) or none" )
+      ( "progress-costs", po::value<string>(), "file with the per-tag costs learned from previous runs (empty to disable learning)" );
     po::variables_map vm;
     po::store( po::parse_command_line( argc, argv, desc ), vm );
 
@@ -64,189 +115,154 @@ namespace xml2epub {
       cout << desc << endl;
     }
     if ( vm.count("keep-text") ) {
-      keep_text = vm["keep-text"].as<bool>();
+      args.keep_text = vm["keep-text"].as<bool>();
     }
     if ( vm.count("latex") ) {
-      output_html = ( vm["latex"].as<bool>() == false );
-    }
-    if ( vm.count("input-file") > 1 ) {
-      throw runtime_error( "You may only specify one input file (or none for standard input)" );
+      args.conversion.html = ( vm["latex"].as<bool>() == false );
     }
-    if ( vm.count("input-file") == 1 ) {
-      input_file = vm["input-file"].as< vector<string> >()[0];
-      input_file_is_cin = false;
+    if ( vm.count("latex-output") ) {
+      args.conversion.latex_output = vm["latex-output"].as<string>();
     }
-
-    if ( vm.count("output-file") > 1 ) {
-      throw runtime_error( "You may only specify one output file (or none for standard output)" );
+    if ( vm.count("latex-chapters") ) {
+      args.conversion.latex_chapter_files = true;
     }
-    if ( vm.count("output-file") != 1 ) {
-      throw runtime_error( "You must specify an output path" );
+    if ( vm.count("latex-draft") ) {
+      args.conversion.latex_chapter_files = true;
+      args.conversion.latex_draft = true;
     }
-    output_file = vm["output-file"].as< vector<string> >()[0];
-    output_file_is_cout = false;
-  }
-
-  class NodeParser {
-  private:
-    unsigned int m_total, m_current, m_last_percent;
-  public:
-    NodeParser( unsigned int total_elements )
-      : m_total(total_elements), m_current(0), m_last_percent(0) {
-      std::cerr << "0% finished" << std::endl;
+    if ( vm.count("device-resolution") ) {
+      string resolution = vm["device-resolution"].as<string>();
+      char separator = '\0';
+      istringstream ss( resolution );
+      if ( !( ss >> args.device_width >> separator >> args.device_height ) || ( separator != 'x' ) || !ss.eof() ||
+	   ( ( args.device_width == 0 ) != ( args.device_height == 0 ) ) ) {
+	throw runtime_error( "--device-resolution must be WIDTHxHEIGHT" );
+      }
     }
-
-    void parse_node( const Node & in_node, output_state & state ) {
-      m_current++;
-      {
-	unsigned int new_percent = ceil( static_cast<double>(m_current)*100./static_cast<double>(m_total) );
-	if ( new_percent != m_last_percent ) {
-	  m_last_percent = new_percent;
-	  std::cerr << new_percent << "% finished" << std::endl;
+    if ( vm.count("png-fallback") ) {
+      stringstream ss( vm["png-fallback"].as<string>() );
+      string dpi;
+      while ( getline( ss, dpi, ',' ) ) {
+	istringstream dpi_stream( dpi );
+	unsigned int value = 0;
+	if ( !( dpi_stream >> value ) || !dpi_stream.eof() || ( value == 0 ) ) {
+	  throw runtime_error( "--png-fallback must be a comma separated list of resolutions in dpi" );
 	}
+	args.png_fallback_dpis.push_back( value );
       }
-      if ( dynamic_cast<const ContentNode*>( &in_node ) != NULL ) {
-	const ContentNode & content = dynamic_cast<const ContentNode &>( in_node );
-	state.put_text( content.get_content() );
-      } else {
-	if ( dynamic_cast<const TextNode*>( &in_node ) != NULL ) {
-	  const TextNode & text = dynamic_cast<const TextNode &>( in_node );
-	  if ( text.is_white_space() ) {
-	    return;
-	  }
-	} else if ( dynamic_cast<const Element*>( &in_node ) != NULL ) {
-	  const Element & element = dynamic_cast<const Element&>( in_node );
-	  output_state * out = NULL;
-	  string name = element.get_name();
-	  string label = element.get_attribute_value( "label" );
-	  if ( name == "b" ) {
-	    out = state.bold();
-	  } else if ( name == "math" ) {
-	    out = state.math();
-	  } else if ( name == "equation" ) {
-	    out = state.equation(label);
-	  } else if ( name == "figure" ) {
-	    out = state.figure(label);
-	  } else if ( name == "image" ) {
-	    string filename = element.get_attribute_value( "src" );
-	    state.image(filename);
-	  } else if ( name == "caption" ) {
-	    out = state.caption();
-	  } else if ( name == "plot" ) {
-	    out = state.plot(label);
-	  } else if ( name == "br" ) {
-	    state.newline();
-	  } else if ( name == "np" ) {
-	    state.new_paragraph();
-	  } else if ( name == "table" ) {
-	    out = state.table();
-	  } else if ( name == "tr" ) {
-	    out = state.table_row();
-	  } else if ( name == "ref" ) {
-	    state.reference(label);
-	  } else if ( name == "td" ) {
-	    out = state.table_cell();
-	  } else if ( name == "cite" ) {
-	    state.cite(element.get_attribute_value( "id" ));
-	  } else if ( ( name == "section" ) || ( name == "subsection" ) || ( name == "subsubsection" ) ) {
-	    string section_name = element.get_attribute_value( "name" );
-	    if ( section_name.length() == 0 ) {
-	      throw runtime_error( "Sections must have a name attribute" );
-	    }
-	    unsigned int level;
-	    if ( name == "subsection" ) {
-	      level = 1;
-	    } else if ( name == "subsubsection" ) {
-	      level = 2;
-	    } else {
-	      level = 0;
-	    }
-	    out = state.section( section_name, level, label );
-	  } else if ( name == "chapter" ) {
-	    string section_name = element.get_attribute_value( "name" );
-	    if ( section_name.length() == 0 ) {
-	      throw runtime_error( "Sections must have a name attribute" );
-	    }
-	    out = state.chapter( section_name, label );
-	  } else {
-	    stringstream ss;
-	    ss << "Unknown element with name \"" << name << "\" found!" << endl;
-	    throw runtime_error( ss.str().c_str() );
-	  }
-	  if ( out != NULL ) {
-	    Node::NodeList list = in_node.get_children();
-	    for ( Node::NodeList::iterator iter = list.begin(); iter != list.end(); ++iter ) {
-	      if ( *iter != NULL ) {
-		parse_node( **iter, *out );
-	      }
-	    }
-	    out->finish();
-	    delete out;
-	  }
-	}
+    }
+    if ( vm.count("svg-precision") ) {
+      args.svg_precision = vm["svg-precision"].as<int>();
+    }
+    if ( vm.count("svg-glyph-sprite") ) {
+      args.svg_glyph_sprite = true;
+    }
+    if ( vm.count("pdf") ) {
+      args.conversion.pdf = true;
+    }
+    if ( vm.count("batch") ) {
+      args.batch_manifest = vm["batch"].as<string>();
+    }
+    if ( vm.count("jobs") ) {
+      args.jobs = vm["jobs"].as<unsigned int>();
+    }
+    if ( vm.count("cache-dir") ) {
+      args.cache_dir = vm["cache-dir"].as<string>();
+    }
+    if ( vm.count("serve") ) {
+      args.serve_socket = vm["serve"].as<string>();
+    }
+    if ( vm.count("serve-max-document") ) {
+      args.serve_max_megabytes = vm["serve-max-document"].as<unsigned int>();
+    }
+    if ( vm.count("submit") ) {
+      args.submit_socket = vm["submit"].as<string>();
+    }
+    if ( vm.count("watch") ) {
+      args.watch = true;
+    }
+    if ( vm.count("profile") ) {
+      args.profile_file = vm["profile"].as<string>();
+    }
+    if ( vm.count("trace") ) {
+      args.trace_file = vm["trace"].as<string>();
+      /* the trace is written on exit, until then every span stays in memory */
+      if ( ( args.serve_socket.size() != 0 ) || args.watch ) {
+	throw runtime_error( "--trace can't be combined with --serve or --watch, they never exit" );
       }
     }
-  };
-
-  void parse_file( bool do_html, istream & input_stream, const std::string & output_path ) {
-    DomParser parser;
-    parser.set_substitute_entities( true );
-    parser.parse_stream( input_stream );
-    if ( parser ) {
-      /* if succesfull create output */
-      const Element * rootNode = parser.get_document()->get_root_node();
-      if ( rootNode == NULL ) {
-	throw runtime_error( "get_root_node() failed" );
+    if ( vm.count("stats") ) {
+      args.stats_format = vm["stats"].as<string>();
+      if ( ( args.stats_format != "text" ) && ( args.stats_format != "json" ) ) {
+	throw runtime_error( "--stats must be text or json" );
       }
-      
-      output_builder * b;
-      std::ofstream * outfile = NULL;
-      if ( do_html ) {
-	b = new html_builder( output_path );
-      } else {
-	outfile = new std::ofstream(output_path.c_str());
-	b = new latex_builder( *outfile, output_path );
+    }
+    if ( vm.count("progress") ) {
+      args.conversion.progress_mode = vm["progress"].as<string>();
+      if ( ( args.conversion.progress_mode != "weighted" ) && ( args.conversion.progress_mode != "streaming" ) &&
+	   ( args.conversion.progress_mode != "none" ) ) {
+	throw runtime_error( "--progress must be weighted, streaming or none" );
       }
+    }
+    if ( vm.count("progress-costs") ) {
+      args.conversion.cost_model_path = vm["progress-costs"].as<string>();
+    }
+    if ( vm.count("input-file") > 1 ) {
+      throw runtime_error( "You may only specify one input file (or none for standard input)" );
+    }
+    if ( vm.count("input-file") == 1 ) {
+      args.input_file = vm["input-file"].as< vector<string> >()[0];
+      args.input_file_is_cin = false;
+    }
 
-      /* do stuff */
-      {	
-	const Element & root_in = dynamic_cast<const Element &>( *rootNode );
-	if ( root_in.get_name() != "document" ) {
-	  throw runtime_error( "root node must be document" );
-	}
-	unsigned int total_elements = count_total_xml_elements( root_in );
-
-	output_state * s = b->create_root();
-	Node::NodeList list = root_in.get_children();
-	{
-	  NodeParser nparser(total_elements);
-	  for ( Node::NodeList::iterator iter = list.begin(); iter != list.end(); ++iter ) {
-	    if ( *iter != NULL ) {
-	      nparser.parse_node( **iter, * s );
-	    }
-	  }
-	}
-	s->finish();
-	delete s;
+    if ( vm.count("output-file") > 1 ) {
+      throw runtime_error( "You may only specify one output file (or none for standard output)" );
+    }
+    if ( args.conversion.latex_output.size() != 0 ) {
+      if ( args.conversion.html == false ) {
+	throw runtime_error( "--latex-output needs html output" );
       }
-      delete b;
-      if ( outfile != NULL ) {
-	delete outfile;
+      if ( ( args.batch_manifest.size() != 0 ) || ( args.serve_socket.size() != 0 ) ||
+	   ( args.submit_socket.size() != 0 ) ) {
+	throw runtime_error( "--latex-output is only supported for single conversions" );
       }
     }
+    if ( args.conversion.latex_chapter_files && args.conversion.html && ( args.conversion.latex_output.size() == 0 ) &&
+	 ( args.batch_manifest.size() == 0 ) && ( args.serve_socket.size() == 0 ) ) {
+      throw runtime_error( "--latex-chapters and --latex-draft need latex output" );
+    }
+    if ( args.conversion.pdf && args.conversion.html && ( args.conversion.latex_output.size() == 0 ) &&
+	 ( args.batch_manifest.size() == 0 ) && ( args.serve_socket.size() == 0 ) ) {
+      throw runtime_error( "--pdf needs latex output" );
+    }
+    if ( ( args.batch_manifest.size() != 0 ) || ( args.serve_socket.size() != 0 ) ) {
+      /* --jobs documents at a time already use up the threads */
+      args.conversion.threads = 1;
+      /* input and output paths come from the manifest or the clients */
+      return;
+    }
+    args.conversion.threads = args.jobs;
+    if ( ( args.submit_socket.size() != 0 ) && args.input_file_is_cin ) {
+      throw runtime_error( "--submit needs an input file" );
+    }
+    if ( args.watch && args.input_file_is_cin ) {
+      throw runtime_error( "--watch needs an input file" );
+    }
+    if ( vm.count("output-file") != 1 ) {
+      throw runtime_error( "You must specify an output path" );
+    }
+    args.output_file = vm["output-file"].as< vector<string> >()[0];
   }
+
   map<string, string> gSymmap;
 }
 
 int main( int argc, char * argv[] ) {
-  bool keep_text;
-  string input_file_path;
-  bool input_file_is_cin;
-  string output_file_path;
-  bool output_file_is_cout;
-  bool output_html;
+  xml2epub::cmdline_args args;
 
   g_type_init();
+  xmlInitParser();
+  xml2epub::install_entity_catalog();
 
   /* init symbol map */
   {
@@ -255,23 +271,58 @@ int main( int argc, char * argv[] ) {
     }
   }
 
-  xml2epub::parse_cmdline_args( argc, argv, keep_text, input_file_path, input_file_is_cin,
-				output_file_path, output_file_is_cout, output_html );
-  istream * in_stream = &cin;
+  xml2epub::parse_cmdline_args( argc, argv, args );
+  xml2epub::enable_profiling( args.profile_file.size() != 0 );
+  xml2epub::enable_tracing( args.trace_file.size() != 0 );
+  xml2epub::enable_stats( args.stats_format.size() != 0 );
+  xml2epub::global_render_cache().set_directory( args.cache_dir );
+  xml2epub::set_device_resolution( args.device_width, args.device_height );
+  xml2epub::set_png_fallback_dpis( args.png_fallback_dpis );
+  xml2epub::set_png_fallback_threads( args.jobs );
+  xml2epub::set_svg_precision( args.svg_precision );
+  xml2epub::set_svg_glyph_sprite( args.svg_glyph_sprite );
 
-  if ( input_file_is_cin == false ) {
-    in_stream = new ifstream( input_file_path.c_str() );
-    if ( !(*in_stream) ) {
-      cerr << "Unable to open file \"" << input_file_path << "\" for input!" << endl;
-      return -1;
+  int retval = 0;
+  if ( args.serve_socket.size() != 0 ) {
+    xml2epub::run_server( args.serve_socket, args.jobs, static_cast<size_t>( args.serve_max_megabytes ) << 20,
+			  args.conversion );
+  } else if ( args.submit_socket.size() != 0 ) {
+    string error;
+    if ( xml2epub::submit_conversion( args.submit_socket, args.conversion.html, args.input_file,
+				      args.output_file, error ) == false ) {
+      cerr << "Conversion failed: " << error << endl;
+      retval = 1;
+    }
+  } else if ( args.watch ) {
+    xml2epub::run_watch( args.conversion, args.input_file, args.output_file );
+  } else if ( args.batch_manifest.size() != 0 ) {
+    if ( xml2epub::run_batch( args.batch_manifest, args.jobs, args.conversion ) != 0 ) {
+      retval = 1;
+    }
+  } else {
+    if ( args.input_file_is_cin ) {
+      xml2epub::parse_file( args.conversion, cin, args.output_file );
+    } else {
+      if ( access( args.input_file.c_str(), R_OK ) != 0 ) {
+	cerr << "Unable to open file \"" << args.input_file << "\" for input!" << endl;
+	return -1;
+      }
+      /* mapped, not read through a stream */
+      xml2epub::input_document input( args.input_file );
+      xml2epub::parse_file( args.conversion, input, args.output_file );
     }
   }
 
-  xml2epub::parse_file( output_html, *in_stream, output_file_path );
-  
-  if ( input_file_is_cin == false ) {
-    delete in_stream;
+  if ( args.profile_file.size() != 0 ) {
+    ofstream profile_out( args.profile_file.c_str() );
+    xml2epub::write_profile_report( profile_out );
+  }
+  if ( args.trace_file.size() != 0 ) {
+    xml2epub::write_trace( args.trace_file );
+  }
+  if ( args.stats_format.size() != 0 ) {
+    xml2epub::write_stats( cout, args.stats_format == "json" );
   }
 
-  return 0;
+  return retval;
 }
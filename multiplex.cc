@@ -0,0 +1,151 @@
+#include "multiplex.hh"
+
+using namespace std;
+
+/* calls expr on every backend state, collects the child states it returns
+   and combines them; children created before a backend threw are released */
+#define FAN_OUT_CHILDREN( expr )					\
+  vector<output_state*> children;					\
+  try {									\
+    for ( vector<output_state*>::iterator iter = m_states.begin(); iter != m_states.end(); ++iter ) { \
+      children.push_back( ( *iter != NULL ) ? (*iter)->expr : NULL );	\
+    }									\
+  } catch ( ... ) {							\
+    for ( vector<output_state*>::iterator iter = children.begin(); iter != children.end(); ++iter ) { \
+      delete *iter;							\
+    }									\
+    throw;								\
+  }									\
+  return combine( children )
+
+#define FAN_OUT( expr )							\
+  for ( vector<output_state*>::iterator iter = m_states.begin(); iter != m_states.end(); ++iter ) { \
+    if ( *iter != NULL ) {						\
+      (*iter)->expr;							\
+    }									\
+  }
+
+namespace xml2epub {
+  multiplex_state::multiplex_state( const std::vector<output_state*> & states )
+    : m_states( states ) {
+  }
+
+  multiplex_state::~multiplex_state() {
+    for ( vector<output_state*>::iterator iter = m_states.begin(); iter != m_states.end(); ++iter ) {
+      delete *iter;
+    }
+  }
+
+  output_state * multiplex_state::combine( std::vector<output_state*> & children ) {
+    for ( vector<output_state*>::iterator iter = children.begin(); iter != children.end(); ++iter ) {
+      if ( *iter != NULL ) {
+	return new multiplex_state( children );
+      }
+    }
+    return NULL;
+  }
+
+  void multiplex_state::put_text( const text_view & text ) {
+    FAN_OUT( put_text( text ) );
+  }
+
+  void multiplex_state::newline() {
+    FAN_OUT( newline() );
+  }
+
+  void multiplex_state::new_paragraph() {
+    FAN_OUT( new_paragraph() );
+  }
+
+  output_state * multiplex_state::bold() {
+    FAN_OUT_CHILDREN( bold() );
+  }
+
+  output_state * multiplex_state::math() {
+    FAN_OUT_CHILDREN( math() );
+  }
+
+  output_state * multiplex_state::equation( const std::string & label ) {
+    FAN_OUT_CHILDREN( equation( label ) );
+  }
+
+  output_state * multiplex_state::table( const std::string & src ) {
+    FAN_OUT_CHILDREN( table( src ) );
+  }
+
+  output_state * multiplex_state::table_row() {
+    FAN_OUT_CHILDREN( table_row() );
+  }
+
+  output_state * multiplex_state::table_cell() {
+    FAN_OUT_CHILDREN( table_cell() );
+  }
+
+  void multiplex_state::reference( const std::string & label ) {
+    FAN_OUT( reference( label ) );
+  }
+
+  void multiplex_state::cite( const std::string & id ) {
+    FAN_OUT( cite( id ) );
+  }
+
+  output_state * multiplex_state::section( const std::string & section_name, unsigned int level, const std::string & label ) {
+    FAN_OUT_CHILDREN( section( section_name, level, label ) );
+  }
+
+  output_state * multiplex_state::chapter( const std::string & chapter_name, const std::string & label ) {
+    FAN_OUT_CHILDREN( chapter( chapter_name, label ) );
+  }
+
+  void multiplex_state::skip_chapter( const std::string & chapter_name, const std::string & label ) {
+    FAN_OUT( skip_chapter( chapter_name, label ) );
+  }
+
+  output_state * multiplex_state::plot( const std::string & label ) {
+    FAN_OUT_CHILDREN( plot( label ) );
+  }
+
+  output_state * multiplex_state::figure( const std::string & label ) {
+    FAN_OUT_CHILDREN( figure( label ) );
+  }
+
+  output_state * multiplex_state::caption( ) {
+    FAN_OUT_CHILDREN( caption() );
+  }
+
+  void multiplex_state::image( const std::string & filename ) {
+    FAN_OUT( image( filename ) );
+  }
+
+  void multiplex_state::finish() {
+    FAN_OUT( finish() );
+  }
+
+  multiplex_builder::multiplex_builder() {
+  }
+
+  multiplex_builder::~multiplex_builder() {
+    for ( vector<output_builder*>::iterator iter = m_builders.begin(); iter != m_builders.end(); ++iter ) {
+      delete *iter;
+    }
+  }
+
+  void multiplex_builder::add( output_builder * builder ) {
+    m_builders.push_back( builder );
+  }
+
+  output_state * multiplex_builder::create_root() {
+    vector<output_state*> roots;
+    try {
+      for ( vector<output_builder*>::iterator iter = m_builders.begin(); iter != m_builders.end(); ++iter ) {
+	roots.push_back( (*iter)->create_root() );
+      }
+    } catch ( ... ) {
+      for ( vector<output_state*>::iterator iter = roots.begin(); iter != roots.end(); ++iter ) {
+	delete *iter;
+      }
+      throw;
+    }
+    return new multiplex_state( roots );
+  }
+}
@@ -0,0 +1,55 @@
+#include <string>
+#include <vector>
+#include "builder.hh"
+#pragma once
+
+namespace xml2epub {
+
+  /* forwards every call to one state per backend, so that several outputs are
+     produced from a single walk over the document */
+  class multiplex_state : public output_state {
+  private:
+    std::vector<output_state*> m_states;
+    static output_state * combine( std::vector<output_state*> & children );
+  public:
+    /* takes ownership of states, NULL entries are backends that have no
+       state for the current element */
+    multiplex_state( const std::vector<output_state*> & states );
+    virtual ~multiplex_state();
+
+    void put_text( const text_view & text );
+    void newline();
+    void new_paragraph();
+    output_state * bold();
+    output_state * math();
+    output_state * equation( const std::string & label );
+
+    output_state * table( const std::string & src );
+    output_state * table_row();
+    output_state * table_cell();
+    void reference( const std::string & label );
+    void cite( const std::string & id );
+
+    output_state * section( const std::string & section_name, unsigned int level, const std::string & label );
+    output_state * chapter( const std::string & chapter_name, const std::string & label );
+    void skip_chapter( const std::string & chapter_name, const std::string & label );
+    output_state * plot( const std::string & label );
+    output_state * figure( const std::string & label );
+    output_state * caption( );
+    void image( const std::string & filename );
+    void finish();
+  };
+
+  class multiplex_builder : public output_builder {
+  private:
+    std::vector<output_builder*> m_builders;
+  public:
+    multiplex_builder();
+    /* builders are deleted in the order they were added */
+    virtual ~multiplex_builder();
+    /* takes ownership of builder */
+    void add( output_builder * builder );
+    output_state * create_root();
+  };
+
+}
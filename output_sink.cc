@@ -0,0 +1,144 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "output_sink.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  /* large enough that a chapter or a rendered image takes a handful of
+     writes, small enough for one per open file of a batch */
+  static const size_t kSinkBufferSize = 256 * 1024;
+
+  sink_buffer::sink_buffer() : m_fd( -1 ), m_buffer( NULL ), m_written( 0 ), m_syscalls( 0 ), m_failed( false ) {
+  }
+
+  sink_buffer::~sink_buffer() {
+    close();
+  }
+
+  bool sink_buffer::open( const std::string & path ) {
+    close();
+    m_fd = ::open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+    if ( m_fd < 0 ) {
+      return false;
+    }
+    m_buffer = new char[kSinkBufferSize];
+    setp( m_buffer, m_buffer + kSinkBufferSize );
+    m_written = 0;
+    m_syscalls = 0;
+    m_failed = false;
+    return true;
+  }
+
+  /* writes the buffered bytes followed by extra */
+  bool sink_buffer::write_out( const char * extra, size_t extra_size ) {
+    struct iovec chunks[2];
+    chunks[0].iov_base = pbase();
+    chunks[0].iov_len = pptr() - pbase();
+    chunks[1].iov_base = const_cast<char*>( extra );
+    chunks[1].iov_len = extra_size;
+    struct iovec * next = chunks;
+    int count = 2;
+    while ( ( count != 0 ) && ( next->iov_len == 0 ) ) {
+      ++next;
+      --count;
+    }
+    while ( count != 0 ) {
+      ssize_t written = writev( m_fd, next, count );
+      ++m_syscalls;
+      if ( written < 0 ) {
+	if ( errno == EINTR ) {
+	  continue;
+	}
+	m_failed = true;
+	break;
+      }
+      m_written += written;
+      while ( ( count != 0 ) && ( static_cast<size_t>( written ) >= next->iov_len ) ) {
+	written -= next->iov_len;
+	++next;
+	--count;
+      }
+      if ( count != 0 ) {
+	next->iov_base = static_cast<char*>( next->iov_base ) + written;
+	next->iov_len -= written;
+      }
+    }
+    setp( m_buffer, m_buffer + kSinkBufferSize );
+    return !m_failed;
+  }
+
+  int sink_buffer::overflow( int c ) {
+    if ( ( m_fd < 0 ) || !write_out( NULL, 0 ) ) {
+      return traits_type::eof();
+    }
+    if ( c != traits_type::eof() ) {
+      *pptr() = static_cast<char>( c );
+      pbump( 1 );
+    }
+    return traits_type::not_eof( c );
+  }
+
+  std::streamsize sink_buffer::xsputn( const char * data, std::streamsize size ) {
+    if ( size <= epptr() - pptr() ) {
+      memcpy( pptr(), data, size );
+      pbump( size );
+      return size;
+    }
+    if ( ( m_fd < 0 ) || !write_out( data, size ) ) {
+      return 0;
+    }
+    return size;
+  }
+
+  int sink_buffer::sync() {
+    /* the point of the buffer is to not write on every std::endl */
+    return m_failed ? -1 : 0;
+  }
+
+  std::streampos sink_buffer::seekoff( std::streamoff offset, std::ios_base::seekdir dir, std::ios_base::openmode mode ) {
+    /* only tellp() */
+    if ( ( offset != 0 ) || ( dir != std::ios_base::cur ) || ( ( mode & std::ios_base::out ) == 0 ) ) {
+      return std::streampos( std::streamoff( -1 ) );
+    }
+    return std::streampos( static_cast<std::streamoff>( m_written + ( pptr() - pbase() ) ) );
+  }
+
+  bool sink_buffer::close() {
+    if ( m_fd < 0 ) {
+      return true;
+    }
+    write_out( NULL, 0 );
+    if ( ::close( m_fd ) != 0 ) {
+      m_failed = true;
+    }
+    stats_add( "syscalls", "write", m_syscalls );
+    m_fd = -1;
+    setp( NULL, NULL );
+    delete [] m_buffer;
+    m_buffer = NULL;
+    return !m_failed;
+  }
+
+  output_file::output_file( const std::string & path ) : std::ostream( NULL ) {
+    rdbuf( &m_buffer );
+    if ( !m_buffer.open( path ) ) {
+      setstate( std::ios_base::failbit );
+    }
+  }
+
+  output_file::~output_file() {
+    m_buffer.close();
+  }
+
+  void output_file::close() {
+    if ( !m_buffer.close() ) {
+      setstate( std::ios_base::badbit );
+    }
+  }
+
+}
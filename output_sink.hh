@@ -0,0 +1,50 @@
+#include <string>
+#include <ostream>
+#include <streambuf>
+
+#pragma once
+namespace xml2epub {
+
+  /* streambuf writing to a file descriptor through one large buffer. sync()
+     (std::endl, std::flush) does not write anything, the buffer goes out
+     when it is full or the file is closed. A write that doesn't fit goes out
+     together with the buffered bytes in a single writev(), without being
+     copied. */
+  class sink_buffer : public std::streambuf {
+  private:
+    int m_fd;
+    char * m_buffer;
+    /* bytes that reached the file */
+    unsigned long long m_written;
+    unsigned long m_syscalls;
+    bool m_failed;
+    bool write_out( const char * extra, size_t extra_size );
+    sink_buffer( const sink_buffer & );
+    sink_buffer & operator=( const sink_buffer & );
+  protected:
+    int overflow( int c );
+    std::streamsize xsputn( const char * data, std::streamsize size );
+    int sync();
+    std::streampos seekoff( std::streamoff offset, std::ios_base::seekdir dir, std::ios_base::openmode mode );
+  public:
+    sink_buffer();
+    ~sink_buffer();
+    bool open( const std::string & path );
+    bool is_open() const { return m_fd >= 0; }
+    /* false if any write failed */
+    bool close();
+  };
+
+  /* drop-in replacement of std::ofstream for everything we write: like it,
+     a file that can't be opened or written sets the failbit */
+  class output_file : public std::ostream {
+  private:
+    sink_buffer m_buffer;
+  public:
+    explicit output_file( const std::string & path );
+    ~output_file();
+    bool is_open() const { return m_buffer.is_open(); }
+    void close();
+  };
+
+}
@@ -0,0 +1,576 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <sstream>
+#include <sys/stat.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "parse.hh"
+#include "builder.hh"
+#include "html.hh"
+#include "latex.hh"
+#include "multiplex.hh"
+#include "profile.hh"
+#include "trace.hh"
+#include "stats.hh"
+#include "progress.hh"
+#include "render_cache.hh"
+#include "flatdoc.hh"
+#include "input.hh"
+#include "validate.hh"
+#include "pdf.hh"
+#include "output_sink.hh"
+#include "raster.hh"
+#include "pool.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  double estimate_total_cost( const flat_document & doc, const cost_model & model ) {
+    /* every node below the root is converted exactly once */
+    double retval = 0.;
+    for ( size_t i=0; i<doc.size(); ++i ) {
+      retval += model.cost( tag_name( doc.node( i ).tag ) );
+    }
+    return retval;
+  }
+
+  /* serializes a chapter subtree together with the state of every file it
+     references, so that the hash changes with either */
+  class chapter_signature : public flat_visitor {
+  private:
+    std::string & m_signature;
+    std::set<std::string> & m_files;
+  public:
+    chapter_signature( std::string & signature, std::set<std::string> & files )
+      : m_signature( signature ), m_files( files ) {
+    }
+
+    bool enter( const flat_document & doc, uint32_t index ) {
+      const flat_node & node = doc.node( index );
+      if ( node.tag == TAG_TEXT ) {
+	m_signature += doc.text( index );
+	return false;
+      }
+      m_signature += "<";
+      m_signature += tag_name( node.tag );
+      for ( unsigned int i=0; i<ATTR_COUNT; ++i ) {
+	m_signature += " \"" + doc.attribute( index, static_cast<attribute_id>( i ) ) + "\"";
+      }
+      m_signature += ">";
+      if ( ( node.tag == TAG_IMAGE ) || ( node.tag == TAG_TABLE ) ) {
+	string src = doc.attribute( index, ATTR_SRC );
+	if ( src.size() != 0 ) {
+	  m_files.insert( src );
+	  struct stat st;
+	  stringstream ss;
+	  if ( stat( src.c_str(), &st ) == 0 ) {
+	    ss << src << ":" << st.st_mtime << ":" << st.st_size << ";";
+	  }
+	  m_signature += ss.str();
+	}
+      }
+      return true;
+    }
+
+    void leave( const flat_document & doc, uint32_t index ) {
+      if ( doc.node( index ).tag != TAG_TEXT ) {
+	m_signature += "</>";
+      }
+    }
+  };
+
+  static std::string chapter_hash( const flat_document & doc, uint32_t chapter, std::set<std::string> & files ) {
+    string signature;
+    chapter_signature visitor( signature, files );
+    doc.walk( chapter, visitor );
+    return content_hash( signature );
+  }
+
+  /* one handler per element, the switch over tag names happens once when the
+     document is flattened. A handler reads only the attributes it needs and
+     returns the state of the element, NULL for elements without content. */
+  typedef output_state * ( * tag_handler )( const flat_document & doc, uint32_t index, output_state & state );
+
+  static output_state * handle_text( const flat_document & doc, uint32_t index, output_state & state ) {
+    state.put_text( text_view( doc.text_data( index ), doc.node( index ).count ) );
+    return NULL;
+  }
+
+  static output_state * handle_not_allowed( const flat_document & doc, uint32_t index, output_state & state ) {
+    const flat_node & node = doc.node( index );
+    stringstream ss;
+    ss << "Element \"" << tag_name( node.tag ) << "\" not allowed in line " << node.line << "!" << endl;
+    throw runtime_error( ss.str().c_str() );
+  }
+
+  static output_state * handle_chapter( const flat_document & doc, uint32_t index, output_state & state ) {
+    string chapter_name = doc.attribute( index, ATTR_NAME );
+    if ( chapter_name.length() == 0 ) {
+      throw runtime_error( "Sections must have a name attribute" );
+    }
+    return state.chapter( chapter_name, doc.attribute( index, ATTR_LABEL ) );
+  }
+
+  static output_state * handle_section( const flat_document & doc, uint32_t index, output_state & state ) {
+    string section_name = doc.attribute( index, ATTR_NAME );
+    if ( section_name.length() == 0 ) {
+      throw runtime_error( "Sections must have a name attribute" );
+    }
+    unsigned int level;
+    switch ( doc.node( index ).tag ) {
+    case TAG_SUBSECTION:
+      level = 1;
+      break;
+    case TAG_SUBSUBSECTION:
+      level = 2;
+      break;
+    default:
+      level = 0;
+    }
+    return state.section( section_name, level, doc.attribute( index, ATTR_LABEL ) );
+  }
+
+  static output_state * handle_bold( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.bold();
+  }
+
+  static output_state * handle_math( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.math();
+  }
+
+  static output_state * handle_equation( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.equation( doc.attribute( index, ATTR_LABEL ) );
+  }
+
+  static output_state * handle_figure( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.figure( doc.attribute( index, ATTR_LABEL ) );
+  }
+
+  static output_state * handle_image( const flat_document & doc, uint32_t index, output_state & state ) {
+    state.image( doc.attribute( index, ATTR_SRC ) );
+    return NULL;
+  }
+
+  static output_state * handle_caption( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.caption();
+  }
+
+  static output_state * handle_plot( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.plot( doc.attribute( index, ATTR_LABEL ) );
+  }
+
+  static output_state * handle_newline( const flat_document & doc, uint32_t index, output_state & state ) {
+    state.newline();
+    return NULL;
+  }
+
+  static output_state * handle_new_paragraph( const flat_document & doc, uint32_t index, output_state & state ) {
+    state.new_paragraph();
+    return NULL;
+  }
+
+  static output_state * handle_table( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.table( doc.attribute( index, ATTR_SRC ) );
+  }
+
+  static output_state * handle_table_row( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.table_row();
+  }
+
+  static output_state * handle_table_cell( const flat_document & doc, uint32_t index, output_state & state ) {
+    return state.table_cell();
+  }
+
+  static output_state * handle_reference( const flat_document & doc, uint32_t index, output_state & state ) {
+    state.reference( doc.attribute( index, ATTR_LABEL ) );
+    return NULL;
+  }
+
+  static output_state * handle_cite( const flat_document & doc, uint32_t index, output_state & state ) {
+    state.cite( doc.attribute( index, ATTR_ID ) );
+    return NULL;
+  }
+
+  struct tag_entry {
+    tag_handler handler;
+    /* attributes worth recording on the trace span of the element */
+    bool trace_label;
+    bool trace_name;
+  };
+
+  /* indexed by tag_id, a new tag needs its name in flatdoc.cc, a row here and
+     a column in the tables of validate.cc */
+  static const tag_entry kTagRegistry[] = {
+    { handle_text, false, false },          /* #text */
+    { handle_not_allowed, false, false },   /* document */
+    { handle_chapter, true, true },         /* chapter */
+    { handle_section, true, false },        /* section */
+    { handle_section, true, false },        /* subsection */
+    { handle_section, true, false },        /* subsubsection */
+    { handle_bold, false, false },          /* b */
+    { handle_math, false, false },          /* math */
+    { handle_equation, true, false },       /* equation */
+    { handle_figure, true, false },         /* figure */
+    { handle_image, false, false },         /* image */
+    { handle_caption, false, false },       /* caption */
+    { handle_plot, true, false },           /* plot */
+    { handle_newline, false, false },       /* br */
+    { handle_new_paragraph, false, false }, /* np */
+    { handle_table, false, false },         /* table */
+    { handle_table_row, false, false },     /* tr */
+    { handle_table_cell, false, false },    /* td */
+    { handle_reference, false, false },     /* ref */
+    { handle_cite, false, false }           /* cite */
+  };
+  /* fails to compile unless there is exactly one entry per tag */
+  typedef char tag_registry_is_complete[ ( sizeof(kTagRegistry) / sizeof(kTagRegistry[0]) == TAG_COUNT ) ? 1 : -1 ];
+
+  /* deletes what it holds when it goes out of scope, so that a conversion
+     that throws half way doesn't leak its builders, states and files */
+  template <class T> class owned {
+  private:
+    T * m_ptr;
+    owned( const owned & );
+    owned & operator=( const owned & );
+  public:
+    explicit owned( T * ptr = NULL ) : m_ptr( ptr ) {}
+    ~owned() { delete m_ptr; }
+    void reset( T * ptr ) {
+      delete m_ptr;
+      m_ptr = ptr;
+    }
+    T * get() const { return m_ptr; }
+    T * operator->() const { return m_ptr; }
+    T & operator*() const { return *m_ptr; }
+  };
+
+  /* drives the output states over a subtree of the flat document. The stack
+     of open elements lives on the heap, so the document depth is unlimited */
+  class NodeParser : public flat_visitor {
+  private:
+    struct frame {
+      output_state * out;
+      trace_span * span;
+      double start;
+      double children_time;
+    };
+    progress_reporter & m_progress;
+    output_state * m_base;
+    std::vector<frame> m_stack;
+    double m_last_time;
+
+    output_state & current_state() {
+      for ( std::vector<frame>::reverse_iterator it = m_stack.rbegin(); it != m_stack.rend(); ++it ) {
+	if ( it->out != NULL ) {
+	  return *it->out;
+	}
+      }
+      return *m_base;
+    }
+
+  public:
+    NodeParser( progress_reporter & progress )
+      : m_progress( progress ), m_base( NULL ), m_last_time( 0. ) {
+    }
+
+    ~NodeParser() {
+      /* only left over if a backend threw */
+      for ( std::vector<frame>::reverse_iterator it = m_stack.rbegin(); it != m_stack.rend(); ++it ) {
+	delete it->span;
+	delete it->out;
+      }
+    }
+
+    bool enter( const flat_document & doc, uint32_t index ) {
+      const flat_node & node = doc.node( index );
+      frame f;
+      f.out = NULL;
+      f.span = NULL;
+      f.start = progress_clock();
+      f.children_time = 0.;
+      if ( stats_enabled() ) {
+	stats_add( "elements", tag_name( node.tag ) );
+      }
+      const tag_entry & entry = kTagRegistry[node.tag];
+      f.out = entry.handler( doc, index, current_state() );
+      if ( ( f.out != NULL ) && tracing_enabled() ) {
+	f.span = new trace_span( tag_name( node.tag ) );
+	if ( entry.trace_label ) {
+	  string label = doc.attribute( index, ATTR_LABEL );
+	  if ( label.size() != 0 ) {
+	    f.span->arg( "label", label );
+	  }
+	}
+	if ( entry.trace_name ) {
+	  f.span->arg( "name", doc.attribute( index, ATTR_NAME ) );
+	}
+      }
+      m_stack.push_back( f );
+      /* elements without a state of their own have no content */
+      return ( f.out != NULL );
+    }
+
+    void leave( const flat_document & doc, uint32_t index ) {
+      frame & top = m_stack.back();
+      if ( top.out != NULL ) {
+	top.out->finish();
+	delete top.out;
+	top.out = NULL;
+	delete top.span;
+	top.span = NULL;
+      }
+      frame f = top;
+      m_stack.pop_back();
+      double total_time = progress_clock() - f.start;
+      const flat_node & node = doc.node( index );
+      m_progress.element_done( tag_name( node.tag ), total_time - f.children_time, node.line );
+      if ( !m_stack.empty() ) {
+	m_stack.back().children_time += total_time;
+      }
+      m_last_time = total_time;
+    }
+
+    /* returns the time spent on the node including its children, the time
+       spent on the node itself is fed into the progress cost model */
+    double parse_node( const flat_document & doc, uint32_t index, output_state & state ) {
+      m_base = &state;
+      doc.walk( index, *this );
+      return m_last_time;
+    }
+  };
+
+  /* feeds decompressed chunks into a libxml push parser */
+  class push_parser_sink : public chunk_sink {
+  private:
+    xmlParserCtxtPtr m_context;
+  public:
+    push_parser_sink( xmlParserCtxtPtr context ) : m_context( context ) {}
+    void write( const char * data, size_t size ) {
+      if ( ( size != 0 ) && ( xmlParseChunk( m_context, data, size, 0 ) != 0 ) ) {
+	/* the error is reported from the context */
+	xmlStopParser( m_context );
+      }
+    }
+  };
+
+  /* the DTD is loaded for its entities, from the built in catalog, never
+     from the network. Line numbers past 65535 are kept for errors and
+     progress. */
+  static const int kParserOptions = XML_PARSE_NOENT | XML_PARSE_DTDLOAD | XML_PARSE_NONET |
+    XML_PARSE_BIG_LINES;
+
+  /* parses the (possibly compressed) input into a libxml tree, the caller frees it */
+  static xmlDocPtr parse_input( const input_document & input ) {
+    stage_scope stage( "parse" );
+    input_compression compression = detect_compression( input.data(), input.size() );
+    xmlDocPtr xml_doc = NULL;
+    xmlParserCtxtPtr context;
+    if ( compression == COMPRESSION_NONE ) {
+      context = xmlNewParserCtxt();
+      if ( context == NULL ) {
+	throw runtime_error( "xmlNewParserCtxt failed" );
+      }
+      xml_doc = xmlCtxtReadMemory( context, input.data(), input.size(), NULL, NULL, kParserOptions );
+    } else {
+      context = xmlCreatePushParserCtxt( NULL, NULL, NULL, 0, NULL );
+      if ( context == NULL ) {
+	throw runtime_error( "xmlCreatePushParserCtxt failed" );
+      }
+      xmlCtxtUseOptions( context, kParserOptions );
+      push_parser_sink sink( context );
+      try {
+	decompress( compression, input.data(), input.size(), sink );
+      } catch ( ... ) {
+	if ( context->myDoc != NULL ) {
+	  xmlFreeDoc( context->myDoc );
+	}
+	xmlFreeParserCtxt( context );
+	throw;
+      }
+      xmlParseChunk( context, NULL, 0, 1 );
+      xml_doc = context->myDoc;
+    }
+    if ( ( xml_doc == NULL ) || ( context->wellFormed == 0 ) ) {
+      stringstream ss;
+      ss << "Unable to parse input";
+      if ( context->lastError.message != NULL ) {
+	ss << " (line " << context->lastError.line << "): " << context->lastError.message;
+      }
+      if ( xml_doc != NULL ) {
+	xmlFreeDoc( xml_doc );
+      }
+      xmlFreeParserCtxt( context );
+      throw runtime_error( ss.str() );
+    }
+    xmlFreeParserCtxt( context );
+    return xml_doc;
+  }
+
+  /* flattens the input, with a cache directory the flat document of an
+     unchanged input is mapped back instead of parsed again */
+  static void load_document( const input_document & input, flat_document & doc ) {
+    string cache_path;
+    if ( global_render_cache().directory().size() != 0 ) {
+      /* compressed inputs are keyed by their compressed bytes */
+      cache_path = global_render_cache().directory() + "/" + content_hash( input.data(), input.size() ) + ".ast";
+      stage_scope stage( "ast_map" );
+      if ( doc.map_file( cache_path ) ) {
+	stats_add( "ast_cache", "hit" );
+	return;
+      }
+      stats_add( "ast_cache", "miss" );
+    }
+    xmlDocPtr xml_doc = parse_input( input );
+    try {
+      const xmlNode * root = xmlDocGetRootElement( xml_doc );
+      if ( root == NULL ) {
+	throw runtime_error( "get_root_node() failed" );
+      }
+      stage_scope stage( "flatten" );
+      doc.build( root );
+    } catch ( ... ) {
+      xmlFreeDoc( xml_doc );
+      throw;
+    }
+    xmlFreeDoc( xml_doc );
+    if ( ( cache_path.size() != 0 ) && !doc.save( cache_path ) ) {
+      stats_add( "ast_cache", "store_failed" );
+    }
+  }
+
+  void parse_file( const conversion_options & options, istream & input_stream, const std::string & output_path ) {
+    input_document input( input_stream );
+    parse_file( options, input, output_path );
+  }
+
+  void parse_file( const conversion_options & options, const input_document & input, const std::string & output_path ) {
+    const std::string & progress_mode = options.progress_mode;
+    const std::string & cost_model_path = options.cost_model_path;
+    flat_document doc;
+    load_document( input, doc );
+    uint32_t root_in = doc.root();
+    if ( ( root_in == kNoNode ) || ( doc.node( root_in ).tag != TAG_DOCUMENT ) ) {
+      throw runtime_error( "root node must be document" );
+    }
+    {
+      /* all structural errors are reported before anything is rendered */
+      stage_scope stage( "validate" );
+      unsigned int backends = options.html ? VALIDATE_HTML : VALIDATE_LATEX;
+      if ( options.html && ( options.latex_output.size() != 0 ) ) {
+	backends |= VALIDATE_LATEX;
+      }
+      validate_document( doc, backends );
+    }
+    if ( options.html ) {
+      /* the figures are converted one after the other, their downscaled
+	 renditions are decoded and encoded in parallel beforehand */
+      prepare_raster_images( doc, options.threads );
+    }
+
+    latex_chapter_mode chapter_mode = LATEX_SINGLE_FILE;
+    if ( options.latex_draft ) {
+      chapter_mode = LATEX_CHAPTER_DRAFT;
+    } else if ( options.latex_chapter_files ) {
+      chapter_mode = LATEX_CHAPTER_FILES;
+    }
+    /* declared in the order they depend on each other, so that a conversion
+       that throws destroys them in reverse */
+    owned<output_file> outfile;
+    owned<output_builder> b;
+    if ( options.html && ( options.latex_output.size() != 0 ) ) {
+      multiplex_builder * both = new multiplex_builder;
+      b.reset( both );
+      both->add( new html_builder( output_path, options.clean_output ) );
+      outfile.reset( new output_file( options.latex_output ) );
+      both->add( new latex_builder( *outfile, options.latex_output, false, chapter_mode ) );
+    } else if ( options.html ) {
+      b.reset( new html_builder( output_path, options.clean_output ) );
+    } else {
+      outfile.reset( new output_file( output_path ) );
+      b.reset( new latex_builder( *outfile, output_path, false, chapter_mode ) );
+    }
+
+    /* do stuff */
+    {	
+      cost_model model;
+      if ( cost_model_path.size() != 0 ) {
+	model.load( cost_model_path );
+      }
+
+      stage_scope stage( "render" );
+      owned<output_state> s( b->create_root() );
+      {
+	bool show_progress = ( progress_mode != "none" );
+	owned<progress_reporter> progress;
+	if ( progress_mode == "streaming" ) {
+	  /* no counting pass, the position in the input is estimated from line
+	     numbers; nodes are in document order, so the last one is the deepest
+	     last descendant of the document */
+	  unsigned int last_line = doc.node( static_cast<uint32_t>( doc.size() - 1 ) ).line;
+	  progress.reset( new progress_reporter( model, show_progress, doc.node( root_in ).line, last_line ) );
+	} else {
+	  double total_cost = show_progress ? estimate_total_cost( doc, model ) : 0.;
+	  progress.reset( new progress_reporter( model, show_progress, total_cost ) );
+	}
+	NodeParser nparser( *progress );
+	incremental_state * incremental = options.incremental;
+	unsigned int chapter_index = 0;
+	if ( incremental != NULL ) {
+	  incremental->referenced_files.clear();
+	}
+	for ( uint32_t child = doc.node( root_in ).first_child; child != kNoNode; child = doc.node( child ).next_sibling ) {
+	  if ( ( incremental != NULL ) && ( doc.node( child ).tag == TAG_CHAPTER ) ) {
+	    string hash = chapter_hash( doc, child, incremental->referenced_files );
+	    if ( chapter_index >= incremental->chapter_hashes.size() ) {
+	      incremental->chapter_hashes.resize( chapter_index + 1 );
+	    }
+	    string & previous = incremental->chapter_hashes[chapter_index++];
+	    /* the latex edition is a single file that is always rewritten */
+	    bool reusable = options.html && ( options.latex_output.size() == 0 );
+	    if ( reusable && ( previous == hash ) ) {
+	      s->skip_chapter( doc.attribute( child, ATTR_NAME ), doc.attribute( child, ATTR_LABEL ) );
+	      stats_add( "incremental", "chapters_reused" );
+	      continue;
+	    }
+	    /* a chapter that fails half way must not be reused next time */
+	    previous = "";
+	    nparser.parse_node( doc, child, * s );
+	    previous = hash;
+	    stats_add( "incremental", "chapters_rebuilt" );
+	  } else {
+	    nparser.parse_node( doc, child, * s );
+	  }
+	}
+	if ( incremental != NULL ) {
+	  incremental->chapter_hashes.resize( chapter_index );
+	}
+	progress->finish();
+      }
+      s->finish();
+      s.reset( NULL );
+      if ( cost_model_path.size() != 0 ) {
+	model.save( cost_model_path );
+      }
+    }
+    {
+      stage_scope stage( "serialize" );
+      b.reset( NULL );
+      if ( outfile.get() != NULL ) {
+	stats_add( "bytes_written", "tex", outfile->tellp() );
+	outfile->close();
+	bool failed = outfile->fail();
+	outfile.reset( NULL );
+	if ( failed ) {
+	  throw runtime_error( "Unable to write the latex output" );
+	}
+      }
+    }
+    /* html conversions only have latex to typeset with --latex-output */
+    if ( options.pdf && ( !options.html || ( options.latex_output.size() != 0 ) ) ) {
+      build_pdf( options.html ? options.latex_output : output_path, progress_mode != "none" );
+    }
+  }
+}
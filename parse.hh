@@ -0,0 +1,47 @@
+#include <string>
+#include <vector>
+#include <set>
+#include <iostream>
+
+#pragma once
+namespace xml2epub {
+
+  /* what an incremental (watch mode) conversion remembers between runs */
+  struct incremental_state {
+    /* hash of every chapter subtree including the files it references */
+    std::vector<std::string> chapter_hashes;
+    /* image and table sources referenced by the document */
+    std::set<std::string> referenced_files;
+  };
+
+  struct conversion_options {
+    bool html;
+    /* html only: also write the latex edition to this file from the same parse */
+    std::string latex_output;
+    /* latex: every chapter in a file of its own, pulled in with \include */
+    bool latex_chapter_files;
+    /* latex chapter files: typeset only the chapters that changed */
+    bool latex_draft;
+    /* typeset the latex output into a pdf */
+    bool pdf;
+    /* remove the output of previous conversions first */
+    bool clean_output;
+    /* if set, chapters that did not change since the last run are not
+       regenerated (html backend only) */
+    incremental_state * incremental;
+    /* none, weighted or streaming */
+    std::string progress_mode;
+    /* per-tag cost model of the progress report, not learned if empty */
+    std::string cost_model_path;
+    /* worker threads of this conversion (resizing figures) */
+    unsigned int threads;
+    conversion_options() : html( true ), latex_chapter_files( false ), latex_draft( false ), pdf( false ), clean_output( true ), incremental( NULL ), progress_mode( "weighted" ), threads( 1 ) {}
+  };
+
+  class input_document;
+
+  void parse_file( const conversion_options & options, const input_document & input, const std::string & output_path );
+  /* reads the whole stream first */
+  void parse_file( const conversion_options & options, std::istream & input_stream, const std::string & output_path );
+
+}
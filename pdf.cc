@@ -0,0 +1,178 @@
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <stdexcept>
+#include <iostream>
+#include <cstdio>
+#include <unistd.h>
+#include "pdf.hh"
+#include "process.hh"
+#include "profile.hh"
+#include "progress.hh"
+#include "pool.hh"
+#include "stats.hh"
+#include "render_cache.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  /* a document whose cross references still move after this many passes
+     never settles */
+  static const unsigned int kMaxPasses = 5;
+
+  /* files written by one pass and read by the next */
+  static const char * const kPassFiles[] = { ".aux", ".toc", ".lof", ".lot", ".bbl", ".ind" };
+  static const size_t kPassFileCount = sizeof(kPassFiles) / sizeof(kPassFiles[0]);
+
+  /* "" for files that don't exist */
+  static string file_hash( const std::string & path ) {
+    ifstream in( path.c_str() );
+    if ( !in ) {
+      return "";
+    }
+    stringstream ss;
+    ss << in.rdbuf();
+    return content_hash( ss.str() );
+  }
+
+  static bool file_contains( const std::string & path, const char * needle ) {
+    ifstream in( path.c_str() );
+    string line;
+    while ( getline( in, line ) ) {
+      if ( line.find( needle ) != string::npos ) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  /* hashes of the .aux files that the master .aux reads with \@input, one
+     per \include'd chapter, which is where their labels end up */
+  static map<string, string> included_aux_hashes( const std::string & directory, const std::string & aux_path ) {
+    map<string, string> retval;
+    ifstream in( aux_path.c_str() );
+    string line;
+    static const string kInput = "\\@input{";
+    while ( getline( in, line ) ) {
+      size_t start = line.find( kInput );
+      size_t end = ( start != string::npos ) ? line.find( '}', start ) : string::npos;
+      if ( end != string::npos ) {
+	string path = directory + "/" + line.substr( start + kInput.size(), end - start - kInput.size() );
+	retval[path] = file_hash( path );
+      }
+    }
+    return retval;
+  }
+
+  class aux_job : public pool_job {
+  private:
+    std::string m_tool;
+    std::string m_command;
+  public:
+    int m_status;
+    aux_job( const std::string & tool, const std::string & command )
+      : m_tool( tool ), m_command( command ), m_status( 0 ) {}
+    void run() {
+      m_status = run_command( m_tool, m_command );
+    }
+  };
+
+  void build_pdf( const std::string & tex_path, bool report ) {
+    stage_scope stage( "pdf" );
+    string directory = ".";
+    string base = tex_path;
+    size_t slash = tex_path.find_last_of( '/' );
+    if ( slash != string::npos ) {
+      directory = tex_path.substr( 0, slash );
+      base = tex_path.substr( slash + 1 );
+    }
+    if ( ( base.size() > 4 ) && ( base.compare( base.size() - 4, 4, ".tex" ) == 0 ) ) {
+      base.resize( base.size() - 4 );
+    }
+    string stem = directory + "/" + base;
+    string in_directory = "cd " + shell_quote( directory ) + " && ";
+
+    vector<string> previous( kPassFileCount );
+    for ( size_t i=0; i<kPassFileCount; ++i ) {
+      previous[i] = file_hash( stem + kPassFiles[i] );
+    }
+    map<string, string> previous_chapters = included_aux_hashes( directory, stem + ".aux" );
+    string previous_index = file_hash( stem + ".idx" );
+    unsigned int pass;
+    bool settled = false;
+    for ( pass = 1; ( pass <= kMaxPasses ) && !settled; ++pass ) {
+      double start = progress_clock();
+      {
+	stage_scope pass_stage( "tex_pass" );
+	pass_stage.arg( "pass", static_cast<long>( pass ) );
+	string command = in_directory + "xelatex -interaction=nonstopmode -halt-on-error " +
+	  shell_quote( base + ".tex" ) + " > /dev/null 2>&1";
+	if ( run_command( "xelatex", command ) != 0 ) {
+	  throw runtime_error( "xelatex failed, see " + stem + ".log" );
+	}
+      }
+      double tex_time = progress_clock() - start;
+
+      /* bibliography and index only depend on what this pass wrote */
+      aux_job bibtex( "bibtex", in_directory + "bibtex " + shell_quote( base ) + " > /dev/null 2>&1" );
+      aux_job makeindex( "makeindex", in_directory + "makeindex " + shell_quote( base + ".idx" ) + " > /dev/null 2>&1" );
+      vector<aux_job*> jobs;
+      /* the citations of \include'd chapters are in their own .aux files */
+      map<string, string> chapters = included_aux_hashes( directory, stem + ".aux" );
+      bool aux_changed = ( file_hash( stem + ".aux" ) != previous[0] ) || ( chapters != previous_chapters );
+      if ( aux_changed && file_contains( stem + ".aux", "\\bibdata{" ) ) {
+	jobs.push_back( &bibtex );
+      }
+      string index = file_hash( stem + ".idx" );
+      if ( ( index.size() != 0 ) && ( ( index != previous_index ) || ( access( ( stem + ".ind" ).c_str(), R_OK ) != 0 ) ) ) {
+	jobs.push_back( &makeindex );
+      }
+      previous_index = index;
+      if ( jobs.size() != 0 ) {
+	stage_scope aux_stage( "tex_aux" );
+	worker_pool pool( jobs.size() );
+	for ( size_t i=0; i<jobs.size(); ++i ) {
+	  pool.submit( jobs[i] );
+	}
+	pool.wait();
+	if ( bibtex.m_status != 0 ) {
+	  throw runtime_error( "bibtex failed, see " + stem + ".blg" );
+	}
+	if ( makeindex.m_status != 0 ) {
+	  throw runtime_error( "makeindex failed, see " + stem + ".ilg" );
+	}
+      }
+
+      string changed;
+      for ( size_t i=0; i<kPassFileCount; ++i ) {
+	string hash = file_hash( stem + kPassFiles[i] );
+	if ( hash != previous[i] ) {
+	  changed += ( changed.size() != 0 ) ? ", " : "";
+	  changed += kPassFiles[i] + 1;
+	  previous[i] = hash;
+	}
+      }
+      if ( chapters != previous_chapters ) {
+	changed += ( changed.size() != 0 ) ? ", " : "";
+	changed += "chapter aux";
+	previous_chapters = chapters;
+      }
+      settled = ( changed.size() == 0 );
+      stats_add( "pdf", "passes" );
+      if ( report ) {
+	char line[96];
+	snprintf( line, sizeof(line), "xelatex pass %u: %.3fs", pass, tex_time );
+	cerr << line;
+	if ( jobs.size() != 0 ) {
+	  snprintf( line, sizeof(line), ", bibliography/index %.3fs", progress_clock() - start - tex_time );
+	  cerr << line;
+	}
+	cerr << ( settled ? ", settled" : ", changed: " + changed ) << endl;
+      }
+    }
+    if ( !settled ) {
+      cerr << "WARNING: cross references of " << stem << ".pdf still changed after " << kMaxPasses << " passes" << endl;
+    }
+  }
+
+}
@@ -0,0 +1,13 @@
+#include <string>
+
+#pragma once
+namespace xml2epub {
+
+  /* typesets a .tex file written by the latex backend into a pdf next to it.
+     xelatex is rerun until the .aux, .toc and .lof files it reads are the
+     ones it writes (at most a few passes), bibtex and makeindex run
+     concurrently between passes when the document uses them. With report
+     the time of every pass is printed to standard error. */
+  void build_pdf( const std::string & tex_path, bool report );
+
+}
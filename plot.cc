@@ -5,11 +5,17 @@
 #include <unistd.h>
 #include "plot.hh"
 #include "latex2util.hh"
+#include "process.hh"
+#include "profile.hh"
+#include "render_cache.hh"
+#include "output_sink.hh"
 
 using namespace std;
 
 namespace xml2epub {
   void parse_plot( const string & data, ostream & out, bool out_svg ) {
+    stage_scope stage( "gnuplot" );
+    stage.arg( "data_length", static_cast<long>( data.size() ) );
     string file_name;
     {
       stringstream ss;
@@ -23,7 +29,7 @@ namespace xml2epub {
       plt_file = ss.str();
     }
     {
-      ofstream gnu_plot_file( plt_file.c_str() );
+      output_file gnu_plot_file( plt_file );
       if ( !gnu_plot_file ) {
 	throw runtime_error( "Cannot creat tmp file" );
       }
@@ -40,7 +46,7 @@ namespace xml2epub {
       ss << "( ( cd /tmp; gnuplot " << file_name << ".plt && cat \"/tmp/" << file_name << "_pre.tex\" | sed 's/\\\\usepackage{graphicx}/\\\\usepackage{unicode-math}\\n\\\\usepackage{graphicx}\\n\\\\setmainfont{STIXGeneral}\\n\\\\setmathfont{STIXGeneral}/g' > \"/tmp/" << file_name << ".tex\" && xelatex " << file_name << ".tex; cd -; ) 2>&1 ) > /dev/null";
       shell_command = ss.str();
     }
-    system( shell_command.c_str() );
+    run_command( "gnuplot", shell_command );
     {
       string pdf_file;
       {
@@ -60,6 +66,21 @@ namespace xml2epub {
       ss << "rm -f /tmp/" << file_name << "*";
       shell_command = ss.str();
     }
-    system( shell_command.c_str() );
+    run_command( "rm", shell_command );
+  }
+
+  class plot_pdf_renderer : public image_renderer {
+  private:
+    const std::string & m_data;
+  public:
+    plot_pdf_renderer( const std::string & data ) : m_data( data ) {}
+    void render( std::ostream & out ) {
+      parse_plot( m_data, out, false );
+    }
+  };
+
+  std::string plot_pdf( const std::string & data ) {
+    plot_pdf_renderer renderer( data );
+    return cached_render( "plot-pdf:" + data, renderer );
   }
 }
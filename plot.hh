@@ -6,4 +6,8 @@ namespace xml2epub {
 
   void parse_plot( const std::string & data, std::ostream & out, bool out_svg );
 
+  /* pdf of the plot, gnuplot and xelatex run once per plot and process (or
+     cache directory) no matter how many backends ask for it */
+  std::string plot_pdf( const std::string & data );
+
 }
@@ -0,0 +1,85 @@
+#include <stdexcept>
+#include <unistd.h>
+#include "pool.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  worker_pool::worker_pool( unsigned int threads )
+    : m_busy( 0 ), m_shutdown( false ) {
+    pthread_mutex_init( &m_mutex, NULL );
+    pthread_cond_init( &m_work_cond, NULL );
+    pthread_cond_init( &m_idle_cond, NULL );
+    if ( threads == 0 ) {
+      threads = 1;
+    }
+    for ( unsigned int i=0; i<threads; ++i ) {
+      pthread_t thread;
+      if ( pthread_create( &thread, NULL, thread_main, this ) != 0 ) {
+	throw runtime_error( "pthread_create failed" );
+      }
+      m_threads.push_back( thread );
+    }
+  }
+
+  worker_pool::~worker_pool() {
+    pthread_mutex_lock( &m_mutex );
+    m_shutdown = true;
+    pthread_cond_broadcast( &m_work_cond );
+    pthread_mutex_unlock( &m_mutex );
+    for ( vector<pthread_t>::iterator it = m_threads.begin(); it != m_threads.end(); ++it ) {
+      pthread_join( *it, NULL );
+    }
+    pthread_cond_destroy( &m_idle_cond );
+    pthread_cond_destroy( &m_work_cond );
+    pthread_mutex_destroy( &m_mutex );
+  }
+
+  void * worker_pool::thread_main( void * arg ) {
+    static_cast<worker_pool*>( arg )->worker();
+    return NULL;
+  }
+
+  void worker_pool::worker() {
+    pthread_mutex_lock( &m_mutex );
+    for ( ;; ) {
+      while ( m_queue.empty() && ( m_shutdown == false ) ) {
+	pthread_cond_wait( &m_work_cond, &m_mutex );
+      }
+      if ( m_queue.empty() ) {
+	break;
+      }
+      pool_job * job = m_queue.front();
+      m_queue.pop_front();
+      m_busy++;
+      pthread_mutex_unlock( &m_mutex );
+      job->run();
+      pthread_mutex_lock( &m_mutex );
+      m_busy--;
+      if ( m_queue.empty() && ( m_busy == 0 ) ) {
+	pthread_cond_broadcast( &m_idle_cond );
+      }
+    }
+    pthread_mutex_unlock( &m_mutex );
+  }
+
+  void worker_pool::submit( pool_job * job ) {
+    pthread_mutex_lock( &m_mutex );
+    m_queue.push_back( job );
+    pthread_cond_signal( &m_work_cond );
+    pthread_mutex_unlock( &m_mutex );
+  }
+
+  void worker_pool::wait() {
+    pthread_mutex_lock( &m_mutex );
+    while ( ( m_queue.empty() == false ) || ( m_busy != 0 ) ) {
+      pthread_cond_wait( &m_idle_cond, &m_mutex );
+    }
+    pthread_mutex_unlock( &m_mutex );
+  }
+
+  unsigned int hardware_threads() {
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    return ( n > 0 ) ? static_cast<unsigned int>( n ) : 1;
+  }
+}
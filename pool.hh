@@ -0,0 +1,39 @@
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+#pragma once
+namespace xml2epub {
+
+  class pool_job {
+  public:
+    virtual ~pool_job() {}
+    virtual void run() = 0;
+  };
+
+  /* fixed number of worker threads executing submitted jobs in order of
+     submission. Jobs are owned by the caller, must outlive wait() and must
+     not throw from run(). */
+  class worker_pool {
+  private:
+    std::vector<pthread_t> m_threads;
+    std::deque<pool_job*> m_queue;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_work_cond;
+    pthread_cond_t m_idle_cond;
+    unsigned int m_busy;
+    bool m_shutdown;
+    static void * thread_main( void * arg );
+    void worker();
+  public:
+    explicit worker_pool( unsigned int threads );
+    ~worker_pool();
+    void submit( pool_job * job );
+    /* blocks until every submitted job has finished */
+    void wait();
+    unsigned int size() const { return m_threads.size(); }
+  };
+
+  unsigned int hardware_threads();
+
+}
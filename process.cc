@@ -0,0 +1,24 @@
+#include <cstdlib>
+#include "process.hh"
+#include "profile.hh"
+#include "stats.hh"
+
+namespace xml2epub {
+  int run_command( const std::string & tool, const std::string & command ) {
+    profile_count_process( tool );
+    stats_add( "processes", tool );
+    return system( command.c_str() );
+  }
+
+  std::string shell_quote( const std::string & str ) {
+    std::string retval = "'";
+    for ( size_t i=0; i<str.size(); ++i ) {
+      if ( str[i] == '\'' ) {
+	retval += "'\\''";
+      } else {
+	retval += str[i];
+      }
+    }
+    return retval + "'";
+  }
+}
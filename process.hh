@@ -0,0 +1,13 @@
+#include <string>
+
+#pragma once
+namespace xml2epub {
+
+  /* runs a shell command and accounts the spawned process to the tool name
+     and the currently active profiling stage */
+  int run_command( const std::string & tool, const std::string & command );
+
+  /* single quotes str for /bin/sh */
+  std::string shell_quote( const std::string & str );
+
+}
@@ -0,0 +1,98 @@
+#include <map>
+#include <string>
+#include <ctime>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "profile.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  struct stage_totals {
+    unsigned long calls;
+    double wall, cpu, child_cpu;
+    map<string, unsigned long> processes;
+    stage_totals() : calls(0), wall(0.), cpu(0.), child_cpu(0.) {}
+  };
+
+  static bool gProfiling = false;
+  static pthread_mutex_t gProfileMutex = PTHREAD_MUTEX_INITIALIZER;
+  static map<string, stage_totals> gStages;
+  static __thread const char * tCurrentStage = NULL;
+
+  static double wall_seconds() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return static_cast<double>(ts.tv_sec) + 1e-9 * static_cast<double>(ts.tv_nsec);
+  }
+
+  static double rusage_seconds( int who ) {
+    struct rusage usage;
+    getrusage( who, &usage );
+    return static_cast<double>( usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) + 
+      1e-6 * static_cast<double>( usage.ru_utime.tv_usec + usage.ru_stime.tv_usec );
+  }
+
+  void enable_profiling( bool enable ) {
+    gProfiling = enable;
+  }
+
+  bool profiling_enabled() {
+    return gProfiling;
+  }
+
+  stage_scope::stage_scope( const char * name )
+    : m_name( name ), m_outer( tCurrentStage ), m_active( gProfiling ), m_span( name ) {
+    if ( m_active ) {
+      tCurrentStage = name;
+      m_wall = wall_seconds();
+      m_cpu = rusage_seconds( RUSAGE_THREAD );
+      m_child_cpu = rusage_seconds( RUSAGE_CHILDREN );
+    }
+  }
+
+  stage_scope::~stage_scope() {
+    if ( m_active ) {
+      double wall = wall_seconds() - m_wall;
+      double cpu = rusage_seconds( RUSAGE_THREAD ) - m_cpu;
+      double child_cpu = rusage_seconds( RUSAGE_CHILDREN ) - m_child_cpu;
+      tCurrentStage = m_outer;
+      pthread_mutex_lock( &gProfileMutex );
+      stage_totals & totals = gStages[m_name];
+      totals.calls++;
+      totals.wall += wall;
+      totals.cpu += cpu;
+      totals.child_cpu += child_cpu;
+      pthread_mutex_unlock( &gProfileMutex );
+    }
+  }
+
+  void profile_count_process( const std::string & tool ) {
+    if ( gProfiling ) {
+      pthread_mutex_lock( &gProfileMutex );
+      gStages[ ( tCurrentStage != NULL ) ? tCurrentStage : "other" ].processes[tool]++;
+      pthread_mutex_unlock( &gProfileMutex );
+    }
+  }
+
+  void write_profile_report( std::ostream & out ) {
+    pthread_mutex_lock( &gProfileMutex );
+    out << "# stage <name> <calls> <wall s> <cpu s> <child cpu s>" << '\n';
+    out << "# process <stage> <tool> <count>" << '\n';
+    for ( map<string, stage_totals>::const_iterator it = gStages.begin(); it != gStages.end(); ++it ) {
+      out << "stage " << it->first << " " << it->second.calls << " " << it->second.wall << " "
+	  << it->second.cpu << " " << it->second.child_cpu << '\n';
+      for ( map<string, unsigned long>::const_iterator jt = it->second.processes.begin();
+	    jt != it->second.processes.end(); ++jt ) {
+	out << "process " << it->first << " " << jt->first << " " << jt->second << '\n';
+      }
+    }
+    pthread_mutex_unlock( &gProfileMutex );
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    out << "peak_rss_kb " << usage.ru_maxrss << '\n';
+    getrusage( RUSAGE_CHILDREN, &usage );
+    out << "peak_child_rss_kb " << usage.ru_maxrss << '\n';
+  }
+}
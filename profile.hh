@@ -0,0 +1,32 @@
+#include <string>
+#include <iostream>
+#include "trace.hh"
+
+#pragma once
+namespace xml2epub {
+
+  void enable_profiling( bool enable );
+  bool profiling_enabled();
+
+  /* accumulates wall time, cpu time of this thread, cpu time of waited-for
+     child processes and the number of spawned processes under a stage name.
+     Stages nest, the reported times are inclusive. Every stage is also
+     recorded as a trace span, arguments only end up in the trace. */
+  class stage_scope {
+  private:
+    const char * m_name;
+    const char * m_outer;
+    bool m_active;
+    double m_wall, m_cpu, m_child_cpu;
+    trace_span m_span;
+  public:
+    explicit stage_scope( const char * name );
+    ~stage_scope();
+    void arg( const char * key, const std::string & value ) { m_span.arg( key, value ); }
+    void arg( const char * key, long value ) { m_span.arg( key, value ); }
+  };
+
+  void profile_count_process( const std::string & tool );
+  void write_profile_report( std::ostream & out );
+
+}
@@ -0,0 +1,196 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <ctime>
+#include <cerrno>
+#include <iostream>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "progress.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  static const double kPrintInterval = 0.5;
+  /* weight of the history when merging in a new run, keeps the model adaptive */
+  static const double kMaxSamples = 1000.;
+
+  static const struct {
+    const char * tag;
+    double seconds;
+  } kDefaultCosts[] = {
+    { "#text", 2e-5 },
+    { "b", 2e-5 },
+    { "br", 5e-6 },
+    { "np", 5e-6 },
+    { "ref", 1e-5 },
+    { "cite", 1e-5 },
+    { "math", 0.3 },
+    { "equation", 1.5 },
+    { "plot", 2.0 },
+    { "figure", 0.05 },
+    { "image", 0.2 },
+    { "caption", 1e-4 },
+    { "table", 1e-3 },
+    { "tr", 1e-4 },
+    { "td", 2e-5 },
+    { "section", 1e-4 },
+    { "subsection", 1e-4 },
+    { "subsubsection", 1e-4 },
+    { "chapter", 0.05 },
+    { NULL, 0. }
+  };
+  static const double kUnknownCost = 1e-4;
+
+  double progress_clock() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return static_cast<double>(ts.tv_sec) + 1e-9 * static_cast<double>(ts.tv_nsec);
+  }
+
+  std::string default_cost_model_path() {
+    const char * cache = getenv( "XDG_CACHE_HOME" );
+    string dir;
+    if ( ( cache != NULL ) && ( cache[0] != '\0' ) ) {
+      dir = cache;
+    } else {
+      const char * home = getenv( "HOME" );
+      if ( ( home == NULL ) || ( home[0] == '\0' ) ) {
+	return "";
+      }
+      dir = string( home ) + "/.cache";
+    }
+    return dir + "/xml2epub/costs.txt";
+  }
+
+  cost_model::cost_model() {
+    for ( unsigned int i=0; kDefaultCosts[i].tag != NULL; ++i ) {
+      tag_cost & c = m_costs[kDefaultCosts[i].tag];
+      c.mean = kDefaultCosts[i].seconds;
+      c.samples = 1.;
+    }
+  }
+
+  void cost_model::load( const std::string & path ) {
+    ifstream in( path.c_str() );
+    string tag;
+    double mean, samples;
+    while ( in >> tag >> mean >> samples ) {
+      tag_cost & c = m_costs[tag];
+      c.mean = mean;
+      c.samples = samples;
+    }
+  }
+
+  void cost_model::save( const std::string & path ) {
+    for ( map<string, tag_cost>::iterator it = m_costs.begin(); it != m_costs.end(); ++it ) {
+      tag_cost & c = it->second;
+      if ( c.run_samples != 0 ) {
+	double n = static_cast<double>( c.run_samples );
+	c.mean = ( c.mean * c.samples + c.run_seconds ) / ( c.samples + n );
+	c.samples = ( c.samples + n > kMaxSamples ) ? kMaxSamples : c.samples + n;
+	c.run_seconds = 0.;
+	c.run_samples = 0;
+      }
+    }
+    /* create the parent directories */
+    for ( size_t pos = path.find( '/', 1 ); pos != string::npos; pos = path.find( '/', pos + 1 ) ) {
+      if ( ( mkdir( path.substr( 0, pos ).c_str(), 0755 ) != 0 ) && ( errno != EEXIST ) ) {
+	return;
+      }
+    }
+    /* conversions running side by side must not write the same temporary file */
+    stringstream tmp_path;
+    tmp_path << path << ".tmp" << getpid() << "_" << pthread_self();
+    bool written;
+    {
+      ofstream out( tmp_path.str().c_str() );
+      for ( map<string, tag_cost>::const_iterator it = m_costs.begin(); it != m_costs.end(); ++it ) {
+	out << it->first << " " << it->second.mean << " " << it->second.samples << '\n';
+      }
+      out.close();
+      written = !out.fail();
+    }
+    if ( !written || ( rename( tmp_path.str().c_str(), path.c_str() ) != 0 ) ) {
+      unlink( tmp_path.str().c_str() );
+    }
+  }
+
+  double cost_model::cost( const std::string & tag ) const {
+    map<string, tag_cost>::const_iterator it = m_costs.find( tag );
+    if ( it == m_costs.end() ) {
+      return kUnknownCost;
+    }
+    return it->second.mean;
+  }
+
+  void cost_model::record( const std::string & tag, double seconds ) {
+    tag_cost & c = m_costs[tag];
+    c.run_seconds += seconds;
+    c.run_samples++;
+  }
+
+  progress_reporter::progress_reporter( cost_model & model, bool enabled, double total_cost )
+    : m_model( model ), m_enabled( enabled ), m_streaming( false ), m_first_line( 0. ), m_total( total_cost ), m_done( 0. ),
+      m_start( progress_clock() ), m_last_print( 0. ), m_last_percent( -1 ) {
+    print( 0., true );
+  }
+
+  progress_reporter::progress_reporter( cost_model & model, bool enabled, unsigned int first_line, unsigned int last_line )
+    : m_model( model ), m_enabled( enabled ), m_streaming( true ), m_first_line( first_line ),
+      m_total( ( last_line > first_line ) ? last_line - first_line : 0 ), m_done( 0. ),
+      m_start( progress_clock() ), m_last_print( 0. ), m_last_percent( -1 ) {
+    print( 0., true );
+  }
+
+  void progress_reporter::element_done( const std::string & tag, double seconds, unsigned int line ) {
+    m_model.record( tag, seconds );
+    if ( m_enabled == false ) {
+      return;
+    }
+    if ( m_streaming ) {
+      if ( line > m_first_line + m_done ) {
+	m_done = line - m_first_line;
+      }
+    } else {
+      m_done += m_model.cost( tag );
+    }
+    print( ( m_total > 0. ) ? ( m_done / m_total ) : 1., false );
+  }
+
+  void progress_reporter::finish() {
+    print( 1., true );
+  }
+
+  void progress_reporter::print( double fraction, bool force ) {
+    if ( m_enabled == false ) {
+      return;
+    }
+    if ( fraction > 1. ) {
+      fraction = 1.;
+    }
+    int percent = static_cast<int>( fraction * 100. );
+    double now = progress_clock();
+    if ( ( force == false ) && ( ( now - m_last_print < kPrintInterval ) || ( percent == m_last_percent ) ) ) {
+      return;
+    }
+    if ( force && ( percent == m_last_percent ) ) {
+      return;
+    }
+    m_last_print = now;
+    m_last_percent = percent;
+    double elapsed = now - m_start;
+    char line[128];
+    if ( ( fraction > 0. ) && ( fraction < 1. ) ) {
+      snprintf( line, sizeof(line), "%d%% finished, %.1fs elapsed, ETA %.0fs\n",
+		percent, elapsed, elapsed * ( 1. - fraction ) / fraction );
+    } else {
+      snprintf( line, sizeof(line), "%d%% finished, %.1fs elapsed\n", percent, elapsed );
+    }
+    /* one write per line, no flush per element */
+    cerr.write( line, strlen( line ) );
+  }
+}
@@ -0,0 +1,51 @@
+#include <map>
+#include <string>
+
+#pragma once
+namespace xml2epub {
+
+  /* expected processing time per element tag, learned from previous runs */
+  class cost_model {
+  private:
+    struct tag_cost {
+      double mean;
+      double samples;
+      double run_seconds;
+      unsigned long run_samples;
+      tag_cost() : mean(0.), samples(0.), run_seconds(0.), run_samples(0) {}
+    };
+    std::map<std::string, tag_cost> m_costs;
+  public:
+    cost_model();
+    /* a missing file is not an error, the built-in defaults are used */
+    void load( const std::string & path );
+    void save( const std::string & path );
+    double cost( const std::string & tag ) const;
+    void record( const std::string & tag, double seconds );
+  };
+
+  /* prints rate-limited progress with an ETA to standard error. In weighted
+     mode the progress is the expected cost of the finished elements relative
+     to the expected cost of the whole document, in streaming mode it is the
+     position of the last finished element's input line between the first
+     and the last line. */
+  class progress_reporter {
+  private:
+    cost_model & m_model;
+    bool m_enabled;
+    bool m_streaming;
+    double m_first_line, m_total, m_done;
+    double m_start, m_last_print;
+    int m_last_percent;
+    void print( double fraction, bool force );
+  public:
+    progress_reporter( cost_model & model, bool enabled, double total_cost );
+    progress_reporter( cost_model & model, bool enabled, unsigned int first_line, unsigned int last_line );
+    void element_done( const std::string & tag, double seconds, unsigned int line );
+    void finish();
+  };
+
+  double progress_clock();
+  std::string default_cost_model_path();
+
+}
@@ -0,0 +1,271 @@
+#include <set>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cctype>
+#include <unistd.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "raster.hh"
+#include "flatdoc.hh"
+#include "import.hh"
+#include "pool.hh"
+#include "profile.hh"
+#include "render_cache.hh"
+#include "stats.hh"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace xml2epub {
+  static unsigned int gDeviceWidth = 0;
+  static unsigned int gDeviceHeight = 0;
+
+  /* visually lossless on e-ink and lcd readers */
+  static const char * const kJpegQuality = "85";
+
+  void set_device_resolution( unsigned int width, unsigned int height ) {
+    gDeviceWidth = width;
+    gDeviceHeight = height;
+  }
+
+  /* ".png", ".jpg" or "" */
+  static string raster_extension( const std::string & path ) {
+    size_t dot = path.find_last_of( '.' );
+    if ( ( dot == string::npos ) || ( path.find( '/', dot ) != string::npos ) ) {
+      return "";
+    }
+    string extension;
+    for ( size_t i=dot; i<path.size(); ++i ) {
+      extension += tolower( static_cast<unsigned char>( path[i] ) );
+    }
+    if ( extension == ".png" ) {
+      return ".png";
+    }
+    if ( ( extension == ".jpg" ) || ( extension == ".jpeg" ) ) {
+      return ".jpg";
+    }
+    return "";
+  }
+
+  bool is_raster_image( const std::string & path ) {
+    return raster_extension( path ).size() != 0;
+  }
+
+  /* adds one source row to the per byte column sums */
+  static void accumulate_row( const uint8_t * row, size_t bytes, uint32_t * sums ) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for ( ; i + 16 <= bytes; i += 16 ) {
+      __m128i pixels = _mm_loadu_si128( reinterpret_cast<const __m128i*>( row + i ) );
+      __m128i low = _mm_unpacklo_epi8( pixels, zero );
+      __m128i high = _mm_unpackhi_epi8( pixels, zero );
+      __m128i * out = reinterpret_cast<__m128i*>( sums + i );
+      _mm_storeu_si128( out, _mm_add_epi32( _mm_loadu_si128( out ), _mm_unpacklo_epi16( low, zero ) ) );
+      _mm_storeu_si128( out + 1, _mm_add_epi32( _mm_loadu_si128( out + 1 ), _mm_unpackhi_epi16( low, zero ) ) );
+      _mm_storeu_si128( out + 2, _mm_add_epi32( _mm_loadu_si128( out + 2 ), _mm_unpacklo_epi16( high, zero ) ) );
+      _mm_storeu_si128( out + 3, _mm_add_epi32( _mm_loadu_si128( out + 3 ), _mm_unpackhi_epi16( high, zero ) ) );
+    }
+#endif
+    for ( ; i < bytes; ++i ) {
+      sums[i] += row[i];
+    }
+  }
+
+  void downscale_pixels( const uint8_t * src, unsigned int src_width, unsigned int src_height, size_t src_stride,
+			 uint8_t * dst, unsigned int dst_width, unsigned int dst_height, size_t dst_stride,
+			 unsigned int channels ) {
+    if ( ( dst_width == 0 ) || ( dst_height == 0 ) || ( dst_width > src_width ) || ( dst_height > src_height ) ) {
+      throw invalid_argument( "downscale_pixels can only shrink images" );
+    }
+    /* every destination pixel averages the block of source pixels it covers,
+       rows are summed first (vectorized), then the columns of each block */
+    vector<uint32_t> sums( static_cast<size_t>( src_width ) * channels );
+    for ( unsigned int y=0; y<dst_height; ++y ) {
+      unsigned int y0 = static_cast<unsigned long long>( y ) * src_height / dst_height;
+      unsigned int y1 = static_cast<unsigned long long>( y + 1 ) * src_height / dst_height;
+      fill( sums.begin(), sums.end(), 0 );
+      for ( unsigned int sy=y0; sy<y1; ++sy ) {
+	accumulate_row( src + sy * src_stride, sums.size(), &sums[0] );
+      }
+      uint8_t * out = dst + y * dst_stride;
+      for ( unsigned int x=0; x<dst_width; ++x ) {
+	unsigned int x0 = static_cast<unsigned long long>( x ) * src_width / dst_width;
+	unsigned int x1 = static_cast<unsigned long long>( x + 1 ) * src_width / dst_width;
+	uint32_t area = ( x1 - x0 ) * ( y1 - y0 );
+	for ( unsigned int c=0; c<channels; ++c ) {
+	  uint32_t total = 0;
+	  for ( unsigned int sx=x0; sx<x1; ++sx ) {
+	    total += sums[sx * channels + c];
+	  }
+	  out[x * channels + c] = static_cast<uint8_t>( ( total + area / 2 ) / area );
+	}
+      }
+    }
+  }
+
+  /* false if an image of this size already fits the device */
+  static bool device_size( int source_width, int source_height, unsigned int & width, unsigned int & height ) {
+    if ( ( gDeviceWidth == 0 ) || ( gDeviceHeight == 0 ) ||
+	 ( ( static_cast<unsigned int>( source_width ) <= gDeviceWidth ) &&
+	   ( static_cast<unsigned int>( source_height ) <= gDeviceHeight ) ) ) {
+      return false;
+    }
+    /* keep the aspect ratio, the tighter side decides */
+    double scale = min( static_cast<double>( gDeviceWidth ) / source_width,
+			static_cast<double>( gDeviceHeight ) / source_height );
+    width = min( source_width, max( 1, static_cast<int>( source_width * scale + 0.5 ) ) );
+    height = min( source_height, max( 1, static_cast<int>( source_height * scale + 0.5 ) ) );
+    return true;
+  }
+
+  /* decodes, downscales and re-encodes in the format of the source */
+  class raster_renderer : public image_renderer {
+  private:
+    const std::string & m_path;
+  public:
+    raster_renderer( const std::string & path ) : m_path( path ) {}
+    void render( std::ostream & out ) {
+      stage_scope stage( "raster" );
+      stage.arg( "src", m_path );
+      GError * error = NULL;
+      GdkPixbuf * decoded = gdk_pixbuf_new_from_file( m_path.c_str(), &error );
+      if ( decoded == NULL ) {
+	string message = ( error != NULL ) ? error->message : "unknown error";
+	if ( error != NULL ) {
+	  g_error_free( error );
+	}
+	throw runtime_error( "Unable to decode \"" + m_path + "\": " + message );
+      }
+      /* cameras store the rotation in the exif data */
+      GdkPixbuf * source = gdk_pixbuf_apply_embedded_orientation( decoded );
+      g_object_unref( decoded );
+      unsigned int width, height;
+      if ( !device_size( gdk_pixbuf_get_width( source ), gdk_pixbuf_get_height( source ), width, height ) ) {
+	/* only too large before the rotation, the reader rotates it as well */
+	g_object_unref( source );
+	ifstream original( m_path.c_str(), ios::binary );
+	out << original.rdbuf();
+	stats_add( "images", "kept" );
+	return;
+      }
+      GdkPixbuf * scaled = gdk_pixbuf_new( GDK_COLORSPACE_RGB, gdk_pixbuf_get_has_alpha( source ), 8, width, height );
+      if ( scaled == NULL ) {
+	g_object_unref( source );
+	throw runtime_error( "Unable to allocate the downscaled image" );
+      }
+      downscale_pixels( gdk_pixbuf_get_pixels( source ), gdk_pixbuf_get_width( source ), gdk_pixbuf_get_height( source ),
+			gdk_pixbuf_get_rowstride( source ), gdk_pixbuf_get_pixels( scaled ), width, height,
+			gdk_pixbuf_get_rowstride( scaled ), gdk_pixbuf_get_n_channels( source ) );
+      g_object_unref( source );
+      gchar * buffer = NULL;
+      gsize size = 0;
+      gboolean saved;
+      if ( raster_extension( m_path ) == ".jpg" ) {
+	saved = gdk_pixbuf_save_to_buffer( scaled, &buffer, &size, "jpeg", &error, "quality", kJpegQuality, NULL );
+      } else {
+	saved = gdk_pixbuf_save_to_buffer( scaled, &buffer, &size, "png", &error, NULL );
+      }
+      g_object_unref( scaled );
+      if ( !saved ) {
+	string message = ( error != NULL ) ? error->message : "unknown error";
+	if ( error != NULL ) {
+	  g_error_free( error );
+	}
+	throw runtime_error( "Unable to encode \"" + m_path + "\": " + message );
+      }
+      out.write( buffer, size );
+      g_free( buffer );
+      stats_add( "images", "downscaled" );
+    }
+  };
+
+  /* false if the image fits the device without decoding it. The stored size
+     is before the exif rotation, so it has to fit either way round. */
+  static bool may_need_downscaling( const std::string & path ) {
+    int stored_width = 0, stored_height = 0;
+    if ( gdk_pixbuf_get_file_info( path.c_str(), &stored_width, &stored_height ) == NULL ) {
+      throw runtime_error( "Unable to read the size of \"" + path + "\"" );
+    }
+    unsigned int width, height;
+    return device_size( stored_width, stored_height, width, height ) ||
+      device_size( stored_height, stored_width, width, height );
+  }
+
+  static string rendition_key( const std::string & path ) {
+    stringstream ss;
+    ss << "raster:" << gDeviceWidth << "x" << gDeviceHeight << ":" << file_content_hash( path );
+    return ss.str();
+  }
+
+  std::string import_raster( const std::string & source, const std::string & directory ) {
+    if ( !may_need_downscaling( source ) ) {
+      return import_file( source, directory, raster_extension( source ) );
+    }
+    string key = rendition_key( source );
+    string file_name = content_hash( key ) + raster_extension( source );
+    string image_file_path = directory + "/" + file_name;
+    if ( access( image_file_path.c_str(), F_OK ) == 0 ) {
+      stats_add( "images", "deduplicated" );
+      return file_name;
+    }
+    raster_renderer renderer( source );
+    string data = cached_render( key, renderer );
+    make_directories( directory );
+    write_file_atomically( image_file_path, data );
+    stats_add( "bytes_written", raster_extension( source ).c_str() + 1, data.size() );
+    return file_name;
+  }
+
+  class raster_job : public pool_job {
+  private:
+    std::string m_path;
+  public:
+    raster_job( const std::string & path ) : m_path( path ) {}
+    void run() {
+      try {
+	if ( may_need_downscaling( m_path ) ) {
+	  raster_renderer renderer( m_path );
+	  cached_render( rendition_key( m_path ), renderer );
+	}
+      } catch ( std::exception & e ) {
+	/* reported when the figure itself is converted */
+      }
+    }
+  };
+
+  void prepare_raster_images( const flat_document & doc, unsigned int threads ) {
+    set<string> sources;
+    for ( uint32_t i=0; i<doc.size(); ++i ) {
+      if ( doc.node( i ).tag == TAG_IMAGE ) {
+	string src = doc.attribute( i, ATTR_SRC );
+	if ( is_raster_image( src ) ) {
+	  sources.insert( src );
+	}
+      }
+    }
+    if ( sources.size() < 2 ) {
+      /* nothing to parallelize */
+      return;
+    }
+    stage_scope stage( "raster_images" );
+    vector<raster_job*> jobs;
+    {
+      worker_pool pool( max<size_t>( 1, min<size_t>( threads, sources.size() ) ) );
+      for ( set<string>::const_iterator it = sources.begin(); it != sources.end(); ++it ) {
+	jobs.push_back( new raster_job( *it ) );
+	pool.submit( jobs.back() );
+      }
+      pool.wait();
+    }
+    for ( size_t i=0; i<jobs.size(); ++i ) {
+      delete jobs[i];
+    }
+  }
+
+}
@@ -0,0 +1,33 @@
+#include <string>
+#include <stdint.h>
+
+#pragma once
+namespace xml2epub {
+
+  class flat_document;
+
+  /* the screen raster figures are fitted into for html output, 0x0 keeps
+     them at their original size */
+  void set_device_resolution( unsigned int width, unsigned int height );
+
+  /* png and jpeg files, by extension */
+  bool is_raster_image( const std::string & path );
+
+  /* imports a raster figure into directory, downscaled to the device
+     resolution and re-encoded if it is larger, and returns its file name.
+     Renditions are kept in the render cache keyed by the content of the
+     source. */
+  std::string import_raster( const std::string & source, const std::string & directory );
+
+  /* renders the renditions of all raster figures of the document on a
+     worker pool, so that import_raster() finds them in the render cache */
+  void prepare_raster_images( const flat_document & doc, unsigned int threads );
+
+  /* area average of 8 bit pixels with the given number of channels, rows
+     are stride bytes apart. Throws std::invalid_argument unless the
+     destination is at least 1x1 and not larger than the source. */
+  void downscale_pixels( const uint8_t * src, unsigned int src_width, unsigned int src_height, size_t src_stride,
+			 uint8_t * dst, unsigned int dst_width, unsigned int dst_height, size_t dst_stride,
+			 unsigned int channels );
+
+}
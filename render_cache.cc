@@ -0,0 +1,124 @@
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include "render_cache.hh"
+#include "stats.hh"
+#include "process.hh"
+#include "trace.hh"
+#include "import.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  /* the in memory part is dropped once it grows beyond this */
+  static const size_t kMaxCacheBytes = 256 * 1024 * 1024;
+
+  std::string content_hash( const char * data, size_t size ) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for ( size_t i=0; i<size; ++i ) {
+      hash ^= static_cast<unsigned char>( data[i] );
+      hash *= 1099511628211ULL;
+    }
+    char hex[17];
+    snprintf( hex, sizeof(hex), "%016llx", hash );
+    return string( hex );
+  }
+
+  std::string content_hash( const std::string & data ) {
+    return content_hash( data.data(), data.size() );
+  }
+
+  render_cache::render_cache() : m_size( 0 ) {
+    pthread_mutex_init( &m_mutex, NULL );
+  }
+
+  render_cache::~render_cache() {
+    pthread_mutex_destroy( &m_mutex );
+  }
+
+  void render_cache::set_directory( const std::string & directory ) {
+    m_directory = directory;
+    if ( m_directory.size() != 0 ) {
+      make_directories( m_directory );
+    }
+  }
+
+  std::string render_cache::disk_path( const std::string & key ) const {
+    return m_directory + "/" + content_hash( key );
+  }
+
+  /* a cache file starts with the length of the key and the key itself */
+  std::string render_cache::disk_header( const std::string & key ) const {
+    stringstream ss;
+    ss << key.size() << "\n" << key;
+    return ss.str();
+  }
+
+  bool render_cache::lookup( const std::string & key, std::string & data ) {
+    pthread_mutex_lock( &m_mutex );
+    map<string, string>::const_iterator it = m_entries.find( key );
+    if ( it != m_entries.end() ) {
+      data = it->second;
+      pthread_mutex_unlock( &m_mutex );
+      stats_add( "render_cache", "memory_hit" );
+      return true;
+    }
+    pthread_mutex_unlock( &m_mutex );
+    if ( m_directory.size() != 0 ) {
+      ifstream in( disk_path( key ).c_str() );
+      string file;
+      if ( in ) {
+	file.assign( istreambuf_iterator<char>( in ), istreambuf_iterator<char>() );
+      }
+      /* two keys with the same hash share the file, the key in it decides */
+      string header = disk_header( key );
+      if ( ( file.size() >= header.size() ) && ( file.compare( 0, header.size(), header ) == 0 ) ) {
+	data.assign( file, header.size(), string::npos );
+	stats_add( "render_cache", "disk_hit" );
+	return true;
+      }
+    }
+    stats_add( "render_cache", "miss" );
+    return false;
+  }
+
+  void render_cache::store( const std::string & key, const std::string & data ) {
+    pthread_mutex_lock( &m_mutex );
+    if ( m_size + data.size() > kMaxCacheBytes ) {
+      m_entries.clear();
+      m_size = 0;
+    }
+    string & entry = m_entries[key];
+    m_size += data.size() - entry.size();
+    entry = data;
+    pthread_mutex_unlock( &m_mutex );
+    if ( m_directory.size() != 0 ) {
+      /* the rendering is still good without its disk copy */
+      try {
+	write_file_atomically( disk_path( key ), disk_header( key ) + data );
+      } catch ( std::exception & e ) {
+	stats_add( "render_cache", "store_failed" );
+      }
+    }
+  }
+
+  std::string cached_render( const std::string & key, image_renderer & renderer ) {
+    trace_span span( "render_cache" );
+    string data;
+    if ( global_render_cache().lookup( key, data ) == false ) {
+      span.arg( "cache", "miss" );
+      stringstream ss;
+      renderer.render( ss );
+      data = ss.str();
+      global_render_cache().store( key, data );
+    } else {
+      span.arg( "cache", "hit" );
+    }
+    return data;
+  }
+
+  render_cache & global_render_cache() {
+    static render_cache cache;
+    return cache;
+  }
+}
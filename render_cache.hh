@@ -0,0 +1,46 @@
+#include <map>
+#include <string>
+#include <iostream>
+#include <pthread.h>
+
+#pragma once
+namespace xml2epub {
+
+  /* 64 bit FNV-1a hash of data as 16 hex digits, used to name rendered and
+     imported files after their content */
+  std::string content_hash( const std::string & data );
+  std::string content_hash( const char * data, size_t size );
+
+  /* process wide cache of rendered images (svg of a formula, pdf of a plot, ...)
+     keyed by what was rendered. Shared by all documents converted by one
+     process; with a cache directory the rendered files also survive the
+     process. */
+  class render_cache {
+  private:
+    pthread_mutex_t m_mutex;
+    std::map<std::string, std::string> m_entries;
+    size_t m_size;
+    std::string m_directory;
+    std::string disk_path( const std::string & key ) const;
+    std::string disk_header( const std::string & key ) const;
+  public:
+    render_cache();
+    ~render_cache();
+    void set_directory( const std::string & directory );
+    const std::string & directory() const { return m_directory; }
+    bool lookup( const std::string & key, std::string & data );
+    void store( const std::string & key, const std::string & data );
+  };
+
+  render_cache & global_render_cache();
+
+  class image_renderer {
+  public:
+    virtual ~image_renderer() {}
+    virtual void render( std::ostream & out ) = 0;
+  };
+
+  /* returns the cached rendering of key, renders and stores it on a miss */
+  std::string cached_render( const std::string & key, image_renderer & renderer );
+
+}
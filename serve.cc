@@ -0,0 +1,398 @@
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <sstream>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <iostream>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include "serve.hh"
+#include "input.hh"
+#include "pool.hh"
+#include "profile.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  /* line and block reads on a socket with a small read-ahead buffer */
+  class socket_reader {
+  private:
+    int m_fd;
+    char m_buffer[4096];
+    size_t m_pos, m_end;
+    bool fill() {
+      ssize_t n;
+      do {
+	n = read( m_fd, m_buffer, sizeof(m_buffer) );
+      } while ( ( n < 0 ) && ( errno == EINTR ) );
+      if ( n <= 0 ) {
+	return false;
+      }
+      m_pos = 0;
+      m_end = n;
+      return true;
+    }
+  public:
+    socket_reader( int fd ) : m_fd( fd ), m_pos( 0 ), m_end( 0 ) {}
+
+    /* true if bytes were read ahead that no read_line consumed yet */
+    bool buffered() const { return m_pos != m_end; }
+
+    bool read_line( std::string & line ) {
+      line.clear();
+      for ( ;; ) {
+	if ( ( m_pos == m_end ) && ( fill() == false ) ) {
+	  return line.size() != 0;
+	}
+	char * nl = static_cast<char*>( memchr( m_buffer + m_pos, '\n', m_end - m_pos ) );
+	if ( nl != NULL ) {
+	  line.append( m_buffer + m_pos, nl - ( m_buffer + m_pos ) );
+	  m_pos = nl - m_buffer + 1;
+	  return true;
+	}
+	line.append( m_buffer + m_pos, m_end - m_pos );
+	m_pos = m_end;
+      }
+    }
+
+    bool read_block( std::string & data, size_t size ) {
+      /* grows with what actually arrives, the byte count comes from the client */
+      data.clear();
+      while ( data.size() < size ) {
+	if ( ( m_pos == m_end ) && ( fill() == false ) ) {
+	  return false;
+	}
+	size_t n = m_end - m_pos;
+	if ( n > size - data.size() ) {
+	  n = size - data.size();
+	}
+	data.append( m_buffer + m_pos, n );
+	m_pos += n;
+      }
+      return true;
+    }
+  };
+
+  static bool write_all( int fd, const std::string & data ) {
+    size_t written = 0;
+    while ( written < data.size() ) {
+      ssize_t n = write( fd, data.data() + written, data.size() - written );
+      if ( n < 0 ) {
+	if ( errno == EINTR ) {
+	  continue;
+	}
+	return false;
+      }
+      written += n;
+    }
+    return true;
+  }
+
+  static void make_address( const std::string & socket_path, struct sockaddr_un & address ) {
+    if ( socket_path.size() >= sizeof(address.sun_path) ) {
+      throw runtime_error( "socket path too long" );
+    }
+    memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    strcpy( address.sun_path, socket_path.c_str() );
+  }
+
+  static std::string single_line( const std::string & message ) {
+    string retval( message );
+    for ( string::iterator it = retval.begin(); it != retval.end(); ++it ) {
+      if ( ( *it == '\n' ) || ( *it == '\r' ) ) {
+	*it = ' ';
+      }
+    }
+    return retval;
+  }
+
+  /* request fields are separated by tabs so that paths may contain spaces */
+  static std::vector<std::string> split_fields( const std::string & request ) {
+    vector<string> retval;
+    size_t start = 0;
+    for ( ;; ) {
+      size_t tab = request.find( '\t', start );
+      retval.push_back( request.substr( start, ( tab == string::npos ) ? string::npos : tab - start ) );
+      if ( tab == string::npos ) {
+	return retval;
+      }
+      start = tab + 1;
+    }
+  }
+
+  /* a request refused before its document was read, the rest of the
+     connection can't be told apart from that document */
+  class unread_document_error : public runtime_error {
+  public:
+    explicit unread_document_error( const std::string & message ) : runtime_error( message ) {}
+  };
+
+  static std::string serve_request( socket_reader & reader, const std::string & request, const conversion_options & defaults,
+				    size_t max_document_size ) {
+    vector<string> fields = split_fields( request );
+    if ( ( fields.size() != 4 ) || ( ( fields[0] != "convert" ) && ( fields[0] != "convert-data" ) ) ||
+	 ( ( fields[1] != "html" ) && ( fields[1] != "latex" ) ) || ( fields[2].size() == 0 ) ) {
+      throw runtime_error( "malformed request: " + request );
+    }
+    const string & output = fields[2];
+    conversion_options options( defaults );
+    options.html = ( fields[1] == "html" );
+    stage_scope stage( "request" );
+    stage.arg( "output", output );
+    if ( fields[0] == "convert" ) {
+      input_document document( fields[3], INPUT_COPIED );
+      parse_file( options, document, output );
+    } else {
+      char * end = NULL;
+      errno = 0;
+      unsigned long size = strtoul( fields[3].c_str(), &end, 10 );
+      if ( ( fields[3].size() == 0 ) || ( *end != '\0' ) ) {
+	throw unread_document_error( "convert-data needs a byte count" );
+      }
+      if ( ( errno == ERANGE ) || ( size > max_document_size ) ) {
+	stringstream ss;
+	ss << "document of " << fields[3] << " bytes exceeds the limit of " << max_document_size << " bytes";
+	throw unread_document_error( ss.str() );
+      }
+      string data;
+      if ( reader.read_block( data, size ) == false ) {
+	throw runtime_error( "connection closed while reading document" );
+      }
+      stringstream in( data );
+      parse_file( options, in, output );
+    }
+    return "ok " + output + "\n";
+  }
+
+  /* a client connection, owned by the accept thread while it waits for the
+     next request and by a request_job while one is served */
+  struct connection {
+    int fd;
+    socket_reader reader;
+    explicit connection( int fd_ ) : fd( fd_ ), reader( fd_ ) {}
+    ~connection() { close( fd ); }
+  };
+
+  class connection_server {
+  private:
+    conversion_options m_options;
+    size_t m_max_document_size;
+    int m_wake[2];
+    pthread_mutex_t m_mutex;
+    vector<connection*> m_returned;
+  public:
+    connection_server( const conversion_options & options, size_t max_document_size );
+    ~connection_server();
+    const conversion_options & options() const { return m_options; }
+    size_t max_document_size() const { return m_max_document_size; }
+    /* called by a worker once a request was answered */
+    void give_back( connection * c );
+    /* accepts connections and dispatches their requests, never returns */
+    void run( int listen_fd, unsigned int jobs );
+  };
+
+  /* serves one request and hands the connection back, deletes itself when done */
+  class request_job : public pool_job {
+  private:
+    connection_server & m_server;
+    connection * m_connection;
+  public:
+    request_job( connection_server & server, connection * c ) : m_server( server ), m_connection( c ) {}
+
+    void run() {
+      string request;
+      bool open = m_connection->reader.read_line( request );
+      if ( open && ( request.size() != 0 ) ) {
+	string response;
+	bool keep = true;
+	try {
+	  response = serve_request( m_connection->reader, request, m_server.options(), m_server.max_document_size() );
+	} catch ( unread_document_error & e ) {
+	  response = "error " + single_line( e.what() ) + "\n";
+	  keep = false;
+	} catch ( std::exception & e ) {
+	  response = "error " + single_line( e.what() ) + "\n";
+	} catch ( ... ) {
+	  response = "error unknown error\n";
+	}
+	open = write_all( m_connection->fd, response ) && keep;
+      }
+      if ( open ) {
+	m_server.give_back( m_connection );
+      } else {
+	delete m_connection;
+      }
+      delete this;
+    }
+  };
+
+  connection_server::connection_server( const conversion_options & options, size_t max_document_size )
+    : m_options( options ), m_max_document_size( max_document_size ) {
+    if ( pipe( m_wake ) != 0 ) {
+      throw runtime_error( "pipe failed" );
+    }
+    pthread_mutex_init( &m_mutex, NULL );
+  }
+
+  connection_server::~connection_server() {
+    pthread_mutex_destroy( &m_mutex );
+    close( m_wake[0] );
+    close( m_wake[1] );
+  }
+
+  void connection_server::give_back( connection * c ) {
+    pthread_mutex_lock( &m_mutex );
+    m_returned.push_back( c );
+    pthread_mutex_unlock( &m_mutex );
+    char byte = 0;
+    while ( ( write( m_wake[1], &byte, 1 ) < 0 ) && ( errno == EINTR ) ) {
+    }
+  }
+
+  void connection_server::run( int listen_fd, unsigned int jobs ) {
+    /* idle connections wait here, a worker is only busy while a request is served */
+    vector<connection*> idle;
+    worker_pool pool( jobs );
+    for ( ;; ) {
+      vector<struct pollfd> fds( idle.size() + 2 );
+      fds[0].fd = listen_fd;
+      fds[1].fd = m_wake[0];
+      for ( size_t i=0; i<idle.size(); ++i ) {
+	fds[i + 2].fd = idle[i]->fd;
+      }
+      for ( size_t i=0; i<fds.size(); ++i ) {
+	fds[i].events = POLLIN;
+	fds[i].revents = 0;
+      }
+      if ( poll( &fds[0], fds.size(), -1 ) < 0 ) {
+	if ( errno == EINTR ) {
+	  continue;
+	}
+	throw runtime_error( string( "poll failed: " ) + strerror( errno ) );
+      }
+      vector<connection*> waiting;
+      for ( size_t i=0; i<idle.size(); ++i ) {
+	if ( fds[i + 2].revents != 0 ) {
+	  pool.submit( new request_job( *this, idle[i] ) );
+	} else {
+	  waiting.push_back( idle[i] );
+	}
+      }
+      idle.swap( waiting );
+      if ( fds[1].revents != 0 ) {
+	char buffer[64];
+	read( m_wake[0], buffer, sizeof(buffer) );
+	pthread_mutex_lock( &m_mutex );
+	for ( size_t i=0; i<m_returned.size(); ++i ) {
+	  /* pipelined requests may already sit in the read-ahead buffer */
+	  if ( m_returned[i]->reader.buffered() ) {
+	    pool.submit( new request_job( *this, m_returned[i] ) );
+	  } else {
+	    idle.push_back( m_returned[i] );
+	  }
+	}
+	m_returned.clear();
+	pthread_mutex_unlock( &m_mutex );
+      }
+      if ( fds[0].revents != 0 ) {
+	int fd = accept( listen_fd, NULL, NULL );
+	if ( fd >= 0 ) {
+	  idle.push_back( new connection( fd ) );
+	} else if ( ( errno != EINTR ) && ( errno != ECONNABORTED ) && ( errno != EAGAIN ) ) {
+	  throw runtime_error( string( "accept failed: " ) + strerror( errno ) );
+	}
+      }
+    }
+  }
+
+  void run_server( const std::string & socket_path, unsigned int jobs, size_t max_document_size,
+		   const conversion_options & defaults ) {
+    conversion_options options( defaults );
+    options.progress_mode = "none";
+    options.cost_model_path = "";
+    /* output paths come from clients, never delete what is already there */
+    options.clean_output = false;
+
+    signal( SIGPIPE, SIG_IGN );
+    struct sockaddr_un address;
+    make_address( socket_path, address );
+    int listen_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( listen_fd < 0 ) {
+      throw runtime_error( "socket failed" );
+    }
+    /* a stale socket of a previous daemon */
+    unlink( socket_path.c_str() );
+    if ( bind( listen_fd, reinterpret_cast<struct sockaddr*>( &address ), sizeof(address) ) != 0 ) {
+      close( listen_fd );
+      throw runtime_error( "Unable to bind to \"" + socket_path + "\": " + strerror( errno ) );
+    }
+    if ( listen( listen_fd, 64 ) != 0 ) {
+      close( listen_fd );
+      throw runtime_error( "listen failed" );
+    }
+    cerr << "Serving on " << socket_path << " with " << jobs << " workers" << endl;
+
+    try {
+      connection_server server( options, max_document_size );
+      server.run( listen_fd, jobs );
+    } catch ( ... ) {
+      close( listen_fd );
+      throw;
+    }
+  }
+
+  static std::string absolute_path( const std::string & path ) {
+    if ( ( path.size() != 0 ) && ( path[0] == '/' ) ) {
+      return path;
+    }
+    char cwd[PATH_MAX];
+    if ( getcwd( cwd, sizeof(cwd) ) == NULL ) {
+      throw runtime_error( "getcwd failed" );
+    }
+    return string( cwd ) + "/" + path;
+  }
+
+  bool submit_conversion( const std::string & socket_path, bool html, const std::string & input_path,
+			  const std::string & output_path, std::string & error ) {
+    string output = absolute_path( output_path );
+    string input = absolute_path( input_path );
+    if ( ( output.find_first_of( "\t\n" ) != string::npos ) || ( input.find_first_of( "\t\n" ) != string::npos ) ) {
+      throw runtime_error( "paths with tabs or line breaks can't be submitted" );
+    }
+    struct sockaddr_un address;
+    make_address( socket_path, address );
+    int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( fd < 0 ) {
+      throw runtime_error( "socket failed" );
+    }
+    if ( connect( fd, reinterpret_cast<struct sockaddr*>( &address ), sizeof(address) ) != 0 ) {
+      close( fd );
+      throw runtime_error( "Unable to connect to \"" + socket_path + "\": " + strerror( errno ) );
+    }
+    stringstream request;
+    request << "convert\t" << ( html ? "html" : "latex" ) << "\t" << output << "\t" << input << "\n";
+    string response;
+    bool sent = write_all( fd, request.str() );
+    if ( sent ) {
+      socket_reader reader( fd );
+      sent = reader.read_line( response );
+    }
+    close( fd );
+    if ( sent == false ) {
+      throw runtime_error( "connection to daemon lost" );
+    }
+    if ( response.compare( 0, 3, "ok " ) == 0 ) {
+      return true;
+    }
+    error = ( response.compare( 0, 6, "error " ) == 0 ) ? response.substr( 6 ) : response;
+    return false;
+  }
+}
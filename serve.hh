@@ -0,0 +1,29 @@
+#include <string>
+#include "parse.hh"
+
+#pragma once
+namespace xml2epub {
+
+  /* Conversion daemon listening on a unix socket. A client sends one request
+     per line, with the fields separated by tabs, and gets one response line
+     back:
+
+       convert<TAB><html|latex><TAB><output path><TAB><input path>
+       convert-data<TAB><html|latex><TAB><output path><TAB><byte count>   (followed by the xml)
+
+     answered by "ok <output path>" or "error <message>". Documents sent
+     with convert-data may be at most max_document_size bytes, the
+     connection is closed after a larger byte count. Requests are served
+     by a pool of jobs threads sharing the symbol table and the render cache,
+     idle connections don't occupy a thread. Relative paths are resolved
+     against the daemon's working directory. An existing output directory is
+     updated in place, the daemon never deletes it. */
+  void run_server( const std::string & socket_path, unsigned int jobs, size_t max_document_size,
+		   const conversion_options & defaults );
+
+  /* client side: submits one conversion to a running daemon, returns false
+     and sets error if the conversion failed */
+  bool submit_conversion( const std::string & socket_path, bool html, const std::string & input_path,
+			  const std::string & output_path, std::string & error );
+
+}
@@ -0,0 +1,70 @@
+#include <map>
+#include <string>
+#include <iomanip>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  typedef map<string, map<string, unsigned long> > stats_map;
+
+  bool gStats = false;
+  static pthread_mutex_t gStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+  static stats_map gCounters;
+
+  void enable_stats( bool enable ) {
+    gStats = enable;
+  }
+
+  void stats_add_slow( const char * category, const std::string & name, unsigned long delta ) {
+    pthread_mutex_lock( &gStatsMutex );
+    gCounters[category][name] += delta;
+    pthread_mutex_unlock( &gStatsMutex );
+  }
+
+  static void json_string( ostream & out, const string & str ) {
+    out << '"';
+    for ( string::const_iterator it = str.begin(); it != str.end(); ++it ) {
+      if ( ( *it == '"' ) || ( *it == '\\' ) ) {
+	out << '\\';
+      }
+      out << *it;
+    }
+    out << '"';
+  }
+
+  void write_stats( std::ostream & out, bool json ) {
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    long peak_rss = usage.ru_maxrss;
+    pthread_mutex_lock( &gStatsMutex );
+    if ( json ) {
+      out << "{";
+      for ( stats_map::const_iterator it = gCounters.begin(); it != gCounters.end(); ++it ) {
+	json_string( out, it->first );
+	out << ":{";
+	for ( map<string, unsigned long>::const_iterator jt = it->second.begin(); jt != it->second.end(); ++jt ) {
+	  if ( jt != it->second.begin() ) {
+	    out << ",";
+	  }
+	  json_string( out, jt->first );
+	  out << ":" << jt->second;
+	}
+	out << "},";
+      }
+      out << "\"peak_rss_kb\":" << peak_rss << "}" << '\n';
+    } else {
+      for ( stats_map::const_iterator it = gCounters.begin(); it != gCounters.end(); ++it ) {
+	out << it->first << ":" << '\n';
+	for ( map<string, unsigned long>::const_iterator jt = it->second.begin(); jt != it->second.end(); ++jt ) {
+	  out << "  " << left << setw(24) << jt->first << " " << jt->second << '\n';
+	}
+      }
+      out << "peak rss: " << peak_rss << " kB" << '\n';
+    }
+    pthread_mutex_unlock( &gStatsMutex );
+  }
+}
@@ -0,0 +1,23 @@
+#include <string>
+#include <iostream>
+
+#pragma once
+namespace xml2epub {
+
+  /* named counters grouped by category (elements by tag, processes by tool,
+     bytes written by output type, ...) for the --stats report */
+  extern bool gStats;
+
+  void enable_stats( bool enable );
+  inline bool stats_enabled() { return gStats; }
+
+  void stats_add_slow( const char * category, const std::string & name, unsigned long delta );
+  inline void stats_add( const char * category, const std::string & name, unsigned long delta = 1 ) {
+    if ( gStats ) {
+      stats_add_slow( category, name, delta );
+    }
+  }
+
+  void write_stats( std::ostream & out, bool json );
+
+}
@@ -0,0 +1,493 @@
+#include <set>
+#include <vector>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include "svgopt.hh"
+#include "render_cache.hh"
+#include "output_sink.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  static int gSvgPrecision = 2;
+  static bool gGlyphSprite = false;
+
+  /* optimize_svg() names glyphs "g_<hash of the outline>" */
+  static const char kGlyphPrefix[] = "g_";
+
+  /* attributes that hold coordinates and lengths only */
+  static const char * const kNumericAttributes[] = {
+    "d", "x", "y", "width", "height", "viewBox", "points",
+    "x1", "y1", "x2", "y2", "cx", "cy", "r", "rx", "ry", NULL
+  };
+
+  /* transform lists, see round_transform() */
+  static const char * const kTransformAttributes[] = {
+    "transform", "patternTransform", "gradientTransform", NULL
+  };
+
+  /* significant digits of scale factors, angles and the linear part of a
+     matrix on top of the decimals of the coordinates they multiply */
+  static const int kExtraTransformDigits = 4;
+
+  void set_svg_precision( int digits ) {
+    gSvgPrecision = digits;
+  }
+
+  int svg_precision() {
+    return gSvgPrecision;
+  }
+
+  void set_svg_glyph_sprite( bool enable ) {
+    gGlyphSprite = enable;
+  }
+
+  bool svg_glyph_sprite() {
+    return gGlyphSprite;
+  }
+
+  static bool is_element( xmlNode * node, const char * name ) {
+    return ( node->type == XML_ELEMENT_NODE ) && xmlStrEqual( node->name, BAD_CAST name );
+  }
+
+  static string property_value( xmlNode * node, xmlAttr * property ) {
+    xmlChar * value = xmlNodeListGetString( node->doc, property->children, 1 );
+    string retval( ( value != NULL ) ? reinterpret_cast<const char*>( value ) : "" );
+    xmlFree( value );
+    return retval;
+  }
+
+  static xmlAttr * find_property( xmlNode * node, const char * name ) {
+    for ( xmlAttr * property = node->properties; property != NULL; property = property->next ) {
+      if ( xmlStrEqual( property->name, BAD_CAST name ) ) {
+	return property;
+      }
+    }
+    return NULL;
+  }
+
+  static void set_property( xmlNode * node, xmlAttr * property, const std::string & value ) {
+    xmlSetNsProp( node, property->ns, property->name, BAD_CAST value.c_str() );
+  }
+
+  static bool starts_number( const std::string & value, size_t i ) {
+    if ( isdigit( static_cast<unsigned char>( value[i] ) ) ) {
+      return true;
+    }
+    size_t next = i + 1;
+    if ( ( value[i] == '-' ) && ( next < value.size() ) && ( value[next] == '.' ) ) {
+      ++next;
+    } else if ( ( value[i] != '-' ) && ( value[i] != '.' ) ) {
+      return false;
+    }
+    return ( next < value.size() ) && isdigit( static_cast<unsigned char>( value[next] ) );
+  }
+
+  /* number with at most digits decimals, or digits significant digits, and
+     without redundant zeros */
+  static void append_number( std::string & out, double number, int digits, bool significant ) {
+    char buffer[64];
+    snprintf( buffer, sizeof(buffer), significant ? "%.*g" : "%.*f", digits, number );
+    char * text = buffer;
+    if ( !significant && ( strchr( text, '.' ) != NULL ) ) {
+      char * last = text + strlen( text ) - 1;
+      while ( *last == '0' ) {
+	*last-- = '\0';
+      }
+      if ( *last == '.' ) {
+	*last = '\0';
+      }
+    }
+    if ( strcmp( text, "-0" ) == 0 ) {
+      text[0] = '0';
+      text[1] = '\0';
+    }
+    /* 0.5 -> .5, -0.5 -> -.5 */
+    if ( ( text[0] == '0' ) && ( text[1] == '.' ) ) {
+      ++text;
+    } else if ( ( text[0] == '-' ) && ( text[1] == '0' ) && ( text[2] == '.' ) ) {
+      text[1] = '-';
+      ++text;
+    }
+    out += text;
+  }
+
+  /* every number in value with at most digits decimals */
+  static string round_numbers( const std::string & value, int digits ) {
+    string retval;
+    retval.reserve( value.size() );
+    size_t i = 0;
+    while ( i < value.size() ) {
+      if ( !starts_number( value, i ) ) {
+	retval += value[i++];
+	continue;
+      }
+      const char * begin = value.c_str() + i;
+      char * end;
+      double number = strtod( begin, &end );
+      i += end - begin;
+      append_number( retval, number, digits, false );
+    }
+    return retval;
+  }
+
+  /* the linear part of a transform multiplies every coordinate inside it, so
+     only translations (the last two matrix() arguments, translate() and the
+     center of rotate()) are rounded to digits decimals. Everything else keeps
+     digits + kExtraTransformDigits significant digits. */
+  static string round_transform( const std::string & value, int digits ) {
+    string retval;
+    retval.reserve( value.size() );
+    string function;
+    unsigned int argument = 0;
+    size_t i = 0;
+    while ( i < value.size() ) {
+      if ( isalpha( static_cast<unsigned char>( value[i] ) ) ) {
+	size_t start = i;
+	while ( ( i < value.size() ) && isalpha( static_cast<unsigned char>( value[i] ) ) ) {
+	  ++i;
+	}
+	function = value.substr( start, i - start );
+	argument = 0;
+	retval += function;
+	continue;
+      }
+      if ( !starts_number( value, i ) ) {
+	retval += value[i++];
+	continue;
+      }
+      const char * begin = value.c_str() + i;
+      char * end;
+      double number = strtod( begin, &end );
+      i += end - begin;
+      bool translation = ( function == "translate" ) || ( ( function == "matrix" ) && ( argument >= 4 ) ) ||
+	( ( function == "rotate" ) && ( argument >= 1 ) );
+      if ( translation ) {
+	append_number( retval, number, digits, false );
+      } else {
+	append_number( retval, number, digits + kExtraTransformDigits, true );
+      }
+      ++argument;
+    }
+    return retval;
+  }
+
+  static xmlDoc * parse_svg( const std::string & svg ) {
+    xmlDoc * doc = xmlReadMemory( svg.data(), svg.size(), NULL, "UTF-8", XML_PARSE_NONET | XML_PARSE_NOBLANKS );
+    if ( ( doc == NULL ) || ( xmlDocGetRootElement( doc ) == NULL ) ) {
+      if ( doc != NULL ) {
+	xmlFreeDoc( doc );
+      }
+      throw runtime_error( "Unable to parse the rendered svg" );
+    }
+    return doc;
+  }
+
+  static string serialize( xmlDoc * doc ) {
+    xmlChar * buffer = NULL;
+    int size = 0;
+    xmlDocDumpMemoryEnc( doc, &buffer, &size, "UTF-8" );
+    string retval( reinterpret_cast<const char*>( buffer ), size );
+    xmlFree( buffer );
+    return retval;
+  }
+
+  static string dump_node( xmlDoc * doc, xmlNode * node ) {
+    xmlBuffer * buffer = xmlBufferCreate();
+    xmlNodeDump( buffer, doc, node, 0, 0 );
+    string retval( reinterpret_cast<const char*>( xmlBufferContent( buffer ) ), xmlBufferLength( buffer ) );
+    xmlBufferFree( buffer );
+    return retval;
+  }
+
+  /* ids referenced as "#id" (xlink:href) or "url(#id)" (clip-path, ...) */
+  static void collect_references( xmlNode * node, std::set<std::string> & ids ) {
+    for ( ; node != NULL; node = node->next ) {
+      if ( node->type != XML_ELEMENT_NODE ) {
+	continue;
+      }
+      for ( xmlAttr * property = node->properties; property != NULL; property = property->next ) {
+	string value = property_value( node, property );
+	if ( xmlStrEqual( property->name, BAD_CAST "href" ) && ( value.size() > 1 ) && ( value[0] == '#' ) ) {
+	  ids.insert( value.substr( 1 ) );
+	}
+	for ( size_t pos = value.find( "url(#" ); pos != string::npos; pos = value.find( "url(#", pos + 1 ) ) {
+	  size_t end = value.find( ')', pos );
+	  if ( end != string::npos ) {
+	    ids.insert( value.substr( pos + 5, end - pos - 5 ) );
+	  }
+	}
+      }
+      collect_references( node->children, ids );
+    }
+  }
+
+  /* glyph definitions as cairo writes them, <symbol id="glyph0-1"> or
+     <g id="glyph-0-1"> in <defs> */
+  static void collect_glyphs( xmlNode * node, std::vector<xmlNode*> & glyphs ) {
+    for ( ; node != NULL; node = node->next ) {
+      if ( node->type != XML_ELEMENT_NODE ) {
+	continue;
+      }
+      xmlAttr * id = find_property( node, "id" );
+      if ( ( id != NULL ) && ( property_value( node, id ).compare( 0, 5, "glyph" ) == 0 ) ) {
+	glyphs.push_back( node );
+      } else {
+	collect_glyphs( node->children, glyphs );
+      }
+    }
+  }
+
+  static void rename_references( xmlNode * node, const std::map<std::string, std::string> & renamed ) {
+    for ( ; node != NULL; node = node->next ) {
+      if ( node->type != XML_ELEMENT_NODE ) {
+	continue;
+      }
+      xmlAttr * href = find_property( node, "href" );
+      if ( href != NULL ) {
+	string value = property_value( node, href );
+	map<string, string>::const_iterator it = ( value.size() > 1 ) ? renamed.find( value.substr( 1 ) ) : renamed.end();
+	if ( it != renamed.end() ) {
+	  set_property( node, href, "#" + it->second );
+	}
+      }
+      rename_references( node->children, renamed );
+    }
+  }
+
+  class svg_optimizer {
+  private:
+    xmlDoc * m_doc;
+    int m_digits;
+    std::set<std::string> m_references;
+
+    /* rounds, drops what has no effect and unwraps bare groups, children
+       first so that emptied groups go too */
+    void simplify( xmlNode * node, bool in_defs ) {
+      xmlNode * child = node->children;
+      while ( child != NULL ) {
+	xmlNode * next = child->next;
+	if ( child->type == XML_ELEMENT_NODE ) {
+	  simplify( child, in_defs || is_element( child, "defs" ) );
+	}
+	child = next;
+      }
+      xmlAttr * property = node->properties;
+      while ( property != NULL ) {
+	xmlAttr * next = property->next;
+	bool numeric = false;
+	for ( unsigned int i=0; kNumericAttributes[i] != NULL; ++i ) {
+	  numeric = numeric || xmlStrEqual( property->name, BAD_CAST kNumericAttributes[i] );
+	}
+	bool transform = false;
+	for ( unsigned int i=0; kTransformAttributes[i] != NULL; ++i ) {
+	  transform = transform || xmlStrEqual( property->name, BAD_CAST kTransformAttributes[i] );
+	}
+	string value = property_value( node, property );
+	if ( ( numeric || transform ) && ( m_digits >= 0 ) ) {
+	  value = numeric ? round_numbers( value, m_digits ) : round_transform( value, m_digits );
+	  set_property( node, property, value );
+	}
+	if ( ( transform && ( value == "matrix(1,0,0,1,0,0)" ) ) ||
+	     ( xmlStrEqual( property->name, BAD_CAST "id" ) && !in_defs && ( m_references.count( value ) == 0 ) ) ) {
+	  xmlRemoveProp( property );
+	}
+	property = next;
+      }
+      if ( is_element( node, "g" ) && ( node->properties == NULL ) && ( node->parent != NULL ) &&
+	   ( node->parent->type == XML_ELEMENT_NODE ) ) {
+	while ( node->children != NULL ) {
+	  xmlNode * grandchild = node->children;
+	  xmlUnlinkNode( grandchild );
+	  xmlAddPrevSibling( node, grandchild );
+	}
+	xmlUnlinkNode( node );
+	xmlFreeNode( node );
+      }
+    }
+
+    /* drops the definitions nothing refers to (clip paths, masks, patterns,
+       images, ...), again until the ones only those referred to are gone
+       too. Glyphs are left to rename_glyphs(). */
+    void drop_unused_definitions( xmlNode * root ) {
+      for ( bool dropped = true; dropped; ) {
+	dropped = false;
+	for ( xmlNode * defs = root->children; defs != NULL; defs = defs->next ) {
+	  if ( !is_element( defs, "defs" ) ) {
+	    continue;
+	  }
+	  xmlNode * child = defs->children;
+	  while ( child != NULL ) {
+	    xmlNode * next = child->next;
+	    xmlAttr * id = ( child->type == XML_ELEMENT_NODE ) ? find_property( child, "id" ) : NULL;
+	    if ( id != NULL ) {
+	      string value = property_value( child, id );
+	      if ( ( value.compare( 0, 5, "glyph" ) != 0 ) && ( m_references.count( value ) == 0 ) ) {
+		xmlUnlinkNode( child );
+		xmlFreeNode( child );
+		stats_add( "svg", "definitions_unused" );
+		dropped = true;
+	      }
+	    }
+	    child = next;
+	  }
+	}
+	if ( dropped ) {
+	  m_references.clear();
+	  collect_references( root, m_references );
+	}
+      }
+    }
+
+    /* names glyphs after their outline, drops unused and repeated ones */
+    void rename_glyphs( xmlNode * root ) {
+      vector<xmlNode*> glyphs;
+      for ( xmlNode * child = root->children; child != NULL; child = child->next ) {
+	if ( is_element( child, "defs" ) ) {
+	  collect_glyphs( child->children, glyphs );
+	}
+      }
+      map<string, string> renamed;
+      set<string> kept;
+      for ( size_t i=0; i<glyphs.size(); ++i ) {
+	xmlAttr * id = find_property( glyphs[i], "id" );
+	string old_id = property_value( glyphs[i], id );
+	xmlRemoveProp( id );
+	if ( m_references.count( old_id ) == 0 ) {
+	  xmlUnlinkNode( glyphs[i] );
+	  xmlFreeNode( glyphs[i] );
+	  stats_add( "svg", "glyphs_unused" );
+	  continue;
+	}
+	string new_id = kGlyphPrefix + content_hash( dump_node( m_doc, glyphs[i] ) );
+	renamed[old_id] = new_id;
+	if ( kept.insert( new_id ).second ) {
+	  xmlSetProp( glyphs[i], BAD_CAST "id", BAD_CAST new_id.c_str() );
+	} else {
+	  xmlUnlinkNode( glyphs[i] );
+	  xmlFreeNode( glyphs[i] );
+	}
+      }
+      rename_references( root->children, renamed );
+    }
+
+  public:
+    svg_optimizer( xmlDoc * doc, int digits ) : m_doc( doc ), m_digits( digits ) {}
+    void run() {
+      xmlNode * root = xmlDocGetRootElement( m_doc );
+      collect_references( root, m_references );
+      /* rounded first, so that outlines that only differ below the
+	 precision get the same name */
+      simplify( root, false );
+      drop_unused_definitions( root );
+      rename_glyphs( root );
+    }
+  };
+
+  std::string optimize_svg( const std::string & svg ) {
+    xmlDoc * doc = parse_svg( svg );
+    string retval;
+    try {
+      svg_optimizer optimizer( doc, gSvgPrecision );
+      optimizer.run();
+      retval = serialize( doc );
+    } catch ( ... ) {
+      xmlFreeDoc( doc );
+      throw;
+    }
+    xmlFreeDoc( doc );
+    stats_add( "svg", "bytes_in", svg.size() );
+    stats_add( "svg", "bytes_out", retval.size() );
+    return retval;
+  }
+
+  /* removes the glyphs below node into glyphs, and the elements that only
+     held them */
+  static void take_glyphs( xmlDoc * doc, xmlNode * node, std::map<std::string, std::string> & glyphs ) {
+    xmlNode * child = node->children;
+    while ( child != NULL ) {
+      xmlNode * next = child->next;
+      if ( child->type == XML_ELEMENT_NODE ) {
+	xmlAttr * id = find_property( child, "id" );
+	string value = ( id != NULL ) ? property_value( child, id ) : "";
+	if ( value.compare( 0, sizeof(kGlyphPrefix) - 1, kGlyphPrefix ) == 0 ) {
+	  if ( glyphs.find( value ) == glyphs.end() ) {
+	    glyphs[value] = dump_node( doc, child );
+	  } else {
+	    stats_add( "svg", "glyphs_shared" );
+	  }
+	  xmlUnlinkNode( child );
+	  xmlFreeNode( child );
+	} else {
+	  take_glyphs( doc, child, glyphs );
+	  if ( ( child->children == NULL ) && ( is_element( child, "defs" ) || is_element( child, "g" ) ) ) {
+	    xmlUnlinkNode( child );
+	    xmlFreeNode( child );
+	  }
+	}
+      }
+      child = next;
+    }
+  }
+
+  static void point_to_sprite( xmlNode * node, const std::string & file_name ) {
+    for ( ; node != NULL; node = node->next ) {
+      if ( node->type != XML_ELEMENT_NODE ) {
+	continue;
+      }
+      xmlAttr * href = find_property( node, "href" );
+      if ( href != NULL ) {
+	string value = property_value( node, href );
+	if ( value.compare( 0, sizeof(kGlyphPrefix), string( "#" ) + kGlyphPrefix ) == 0 ) {
+	  set_property( node, href, file_name + value );
+	}
+      }
+      point_to_sprite( node->children, file_name );
+    }
+  }
+
+  std::string glyph_sprite::hoist( const std::string & svg ) {
+    xmlDoc * doc = parse_svg( svg );
+    xmlNode * root = xmlDocGetRootElement( doc );
+    for ( xmlNode * child = root->children; child != NULL; ) {
+      xmlNode * next = child->next;
+      if ( is_element( child, "defs" ) ) {
+	take_glyphs( doc, child, m_glyphs );
+	if ( child->children == NULL ) {
+	  xmlUnlinkNode( child );
+	  xmlFreeNode( child );
+	}
+      }
+      child = next;
+    }
+    point_to_sprite( root->children, m_file_name );
+    string retval = serialize( doc );
+    xmlFreeDoc( doc );
+    return retval;
+  }
+
+  void glyph_sprite::write( const std::string & directory ) const {
+    if ( m_glyphs.size() == 0 ) {
+      return;
+    }
+    output_file out( directory + "/" + m_file_name );
+    if ( !out ) {
+      throw runtime_error( "Unable to create the glyph sprite" );
+    }
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl
+	<< "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" version=\"1.1\"><defs>";
+    for ( map<string, string>::const_iterator it = m_glyphs.begin(); it != m_glyphs.end(); ++it ) {
+      out << it->second;
+    }
+    out << "</defs></svg>" << endl;
+    stats_add( "svg", "sprite_glyphs", m_glyphs.size() );
+    stats_add( "bytes_written", "svg", out.tellp() );
+  }
+
+}
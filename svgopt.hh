@@ -0,0 +1,40 @@
+#include <map>
+#include <string>
+
+#pragma once
+namespace xml2epub {
+
+  /* digits after the decimal point kept in the coordinates of rendered svg
+     images (2 by default), negative keeps them as cairo writes them */
+  void set_svg_precision( int digits );
+  int svg_precision();
+
+  /* share the glyph outlines of the images of a chapter in one file */
+  void set_svg_glyph_sprite( bool enable );
+  bool svg_glyph_sprite();
+
+  /* rounds the coordinates of svg to svg_precision() digits (transforms keep
+     more significant digits in everything but their translation), drops unused
+     definitions and ids, identity transforms and groups without attributes,
+     and names every glyph after its outline, so that the same glyph gets
+     the same id in every image */
+  std::string optimize_svg( const std::string & svg );
+
+  /* the glyph definitions of the images of one chapter, written to a file of
+     their own that the images refer to */
+  class glyph_sprite {
+  private:
+    std::string m_file_name;
+    std::map<std::string, std::string> m_glyphs;
+  public:
+    explicit glyph_sprite( const std::string & file_name ) : m_file_name( file_name ) {}
+    const std::string & file_name() const { return m_file_name; }
+    /* moves the glyphs of svg, an output of optimize_svg(), into the sprite
+       and points its references to the sprite file, which has to be in the
+       same directory */
+    std::string hoist( const std::string & svg );
+    /* does nothing if no image had glyphs */
+    void write( const std::string & directory ) const;
+  };
+
+}
@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# Drives a conversion daemon through a temporary unix socket.
+#
+# Starts "xml2epub --serve" with a single worker, keeps idle connections open
+# (they must not occupy the worker), submits a document whose paths contain
+# spaces and checks that an existing output directory is updated in place
+# rather than deleted.
+#
+# usage: serve_test.sh <xml2epub binary>
+
+set -e
+
+if [[ $# -ne 1 ]]; then
+    echo "usage: $0 <xml2epub binary>"
+    exit 1
+fi
+
+XML2EPUB=`readlink -f "$1"`
+WORKDIR=`mktemp -d /tmp/xml2epub_serve.XXXXXX`
+SOCKET="${WORKDIR}/daemon.sock"
+SERVER=""
+IDLE=""
+cleanup() {
+    [[ -n "${IDLE}" ]] && kill ${IDLE} 2> /dev/null
+    [[ -n "${SERVER}" ]] && kill ${SERVER} 2> /dev/null
+    rm -rf "${WORKDIR}"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAILED: $1"
+    [[ -e "${WORKDIR}/server.log" ]] && cat "${WORKDIR}/server.log"
+    exit 1
+}
+
+cd "${WORKDIR}"
+mkdir "input dir"
+cat > "input dir/small doc.xml" <<EOF
+<?xml version="1.0" encoding="UTF-8" ?>
+<document>
+  <chapter name="Served">
+    Converted by the daemon.
+  </chapter>
+</document>
+EOF
+
+"${XML2EPUB}" --serve "${SOCKET}" --jobs 1 2> "${WORKDIR}/server.log" &
+SERVER=$!
+for i in `seq 50`; do
+    [[ -S "${SOCKET}" ]] && break
+    sleep 0.1
+done
+[[ -S "${SOCKET}" ]] || fail "daemon did not create ${SOCKET}"
+
+# connections that never send a request
+if which python3 > /dev/null 2>&1; then
+    python3 -c '
+import socket, sys, time
+idle = []
+for i in range(4):
+    s = socket.socket( socket.AF_UNIX )
+    s.connect( sys.argv[1] )
+    idle.append( s )
+time.sleep( 60 )
+' "${SOCKET}" &
+    IDLE=$!
+    sleep 0.5
+else
+    echo "python3 not found, not testing idle connections"
+fi
+
+mkdir "output dir"
+touch "output dir/keep.me"
+timeout 30 "${XML2EPUB}" --submit "${SOCKET}" -l false -i "input dir/small doc.xml" -o "output dir" \
+    || fail "submit to a daemon with idle connections"
+[[ -e "output dir/chapter01.html" ]] || fail "no chapter written to the output directory"
+grep -q "Converted by the daemon" "output dir/chapter01.html" || fail "chapter lacks the document text"
+[[ -e "output dir/keep.me" ]] || fail "daemon deleted the existing output directory"
+
+# a broken document is reported to the client, the daemon keeps serving
+echo "<document><chapter>" > "input dir/broken.xml"
+if timeout 30 "${XML2EPUB}" --submit "${SOCKET}" -l false -i "input dir/broken.xml" -o "broken output" 2> /dev/null; then
+    fail "broken document converted without error"
+fi
+timeout 30 "${XML2EPUB}" --submit "${SOCKET}" -l false -i "input dir/small doc.xml" -o "second output" \
+    || fail "daemon stopped serving after a failed conversion"
+
+echo "serve test passed"
@@ -0,0 +1,232 @@
+#include "text_kernel.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXT_KERNEL_X86 1
+#endif
+
+using namespace std;
+
+namespace xml2epub {
+  /* returns the index of the first byte that needs attention, size if there
+     is none. A single space between words is already normalized, only other
+     white space, a space followed by more white space and (if latex is set)
+     the latex specials are. */
+  typedef size_t (*find_function)( const char * data, size_t size, bool latex );
+  typedef size_t (*skip_function)( const char * data, size_t size );
+
+  static inline bool is_white( char c ) {
+    return ( c == ' ' ) || ( c == '\n' ) || ( c == '\t' ) || ( c == '\r' );
+  }
+
+  static inline bool is_latex_special( char c ) {
+    switch ( c ) {
+    case '&': case '%': case '$': case '#': case '_': case '{': case '}':
+    case '\\': case '^': case '~':
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  static inline bool needs_attention( const char * data, size_t i, size_t size, bool latex ) {
+    char c = data[i];
+    if ( c == ' ' ) {
+      return ( i + 1 < size ) && is_white( data[i+1] );
+    }
+    return is_white( c ) || ( latex && is_latex_special( c ) );
+  }
+
+  static size_t find_special_scalar( const char * data, size_t size, bool latex ) {
+    for ( size_t i=0; i<size; ++i ) {
+      if ( needs_attention( data, i, size, latex ) ) {
+	return i;
+      }
+    }
+    return size;
+  }
+
+  size_t skip_white_space_scalar( const char * data, size_t size ) {
+    size_t i = 0;
+    while ( ( i < size ) && is_white( data[i] ) ) {
+      ++i;
+    }
+    return i;
+  }
+
+#ifdef TEXT_KERNEL_X86
+  static const char kWhite[16] = { ' ', '\n', '\t', '\r' };
+  /* white space other than ' ' and the latex specials */
+  static const char kBreaks[16] = { '\n', '\t', '\r' };
+  static const char kBreaksLatex[16] = { '\n', '\t', '\r', '&', '%', '$', '#', '_', '{', '}', '\\', '^', '~' };
+
+  /* bit i is set if byte i of the 16 bytes at data is in set */
+  __attribute__((target("sse4.2")))
+  static inline unsigned int match_sse42( const char * data, __m128i set, int set_size ) {
+    __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i*>( data ) );
+    __m128i mask = _mm_cmpestrm( set, set_size, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK );
+    return _mm_cvtsi128_si32( mask );
+  }
+
+  __attribute__((target("sse4.2")))
+  static size_t find_special_sse42( const char * data, size_t size, bool latex ) {
+    const __m128i white = _mm_loadu_si128( reinterpret_cast<const __m128i*>( kWhite ) );
+    const __m128i breaks = _mm_loadu_si128( reinterpret_cast<const __m128i*>( latex ? kBreaksLatex : kBreaks ) );
+    const __m128i space = _mm_set1_epi8( ' ' );
+    const int breaks_size = latex ? 13 : 3;
+    size_t i = 0;
+    /* one byte of look ahead for the space pairs */
+    for ( ; i + 17 <= size; i += 16 ) {
+      __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i*>( data + i ) );
+      unsigned int spaces = _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, space ) );
+      unsigned int bits = match_sse42( data + i, breaks, breaks_size ) | ( spaces & match_sse42( data + i + 1, white, 4 ) );
+      if ( bits != 0 ) {
+	return i + __builtin_ctz( bits );
+      }
+    }
+    return i + find_special_scalar( data + i, size - i, latex );
+  }
+
+  __attribute__((target("sse4.2")))
+  static size_t skip_white_space_sse42( const char * data, size_t size ) {
+    const __m128i set = _mm_loadu_si128( reinterpret_cast<const __m128i*>( kWhite ) );
+    size_t i = 0;
+    for ( ; i + 16 <= size; i += 16 ) {
+      __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i*>( data + i ) );
+      int index = _mm_cmpestri( set, 4, chunk, 16,
+				_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT );
+      if ( index != 16 ) {
+	return i + index;
+      }
+    }
+    return i + skip_white_space_scalar( data + i, size - i );
+  }
+
+  __attribute__((target("avx2")))
+  static inline __m256i breaks_mask_avx2( __m256i chunk ) {
+    __m256i mask = _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( '\n' ) );
+    mask = _mm256_or_si256( mask, _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( '\t' ) ) );
+    return _mm256_or_si256( mask, _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( '\r' ) ) );
+  }
+
+  __attribute__((target("avx2")))
+  static inline __m256i white_mask_avx2( __m256i chunk ) {
+    return _mm256_or_si256( breaks_mask_avx2( chunk ), _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( ' ' ) ) );
+  }
+
+  __attribute__((target("avx2")))
+  static size_t find_special_avx2( const char * data, size_t size, bool latex ) {
+    size_t i = 0;
+    /* one byte of look ahead for the space pairs */
+    for ( ; i + 33 <= size; i += 32 ) {
+      __m256i chunk = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( data + i ) );
+      __m256i next = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( data + i + 1 ) );
+      __m256i mask = _mm256_and_si256( _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( ' ' ) ), white_mask_avx2( next ) );
+      mask = _mm256_or_si256( mask, breaks_mask_avx2( chunk ) );
+      if ( latex ) {
+	for ( const char * special = kBreaksLatex + 3; *special != 0; ++special ) {
+	  mask = _mm256_or_si256( mask, _mm256_cmpeq_epi8( chunk, _mm256_set1_epi8( *special ) ) );
+	}
+      }
+      unsigned int bits = _mm256_movemask_epi8( mask );
+      if ( bits != 0 ) {
+	return i + __builtin_ctz( bits );
+      }
+    }
+    return i + find_special_scalar( data + i, size - i, latex );
+  }
+
+  __attribute__((target("avx2")))
+  static size_t skip_white_space_avx2( const char * data, size_t size ) {
+    size_t i = 0;
+    for ( ; i + 32 <= size; i += 32 ) {
+      __m256i chunk = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( data + i ) );
+      unsigned int bits = ~static_cast<unsigned int>( _mm256_movemask_epi8( white_mask_avx2( chunk ) ) );
+      if ( bits != 0 ) {
+	return i + __builtin_ctz( bits );
+      }
+    }
+    return i + skip_white_space_scalar( data + i, size - i );
+  }
+#endif
+
+  struct text_kernel {
+    const char * name;
+    find_function find;
+    skip_function skip;
+  };
+
+  static text_kernel select_kernel() {
+    text_kernel retval = { "scalar", find_special_scalar, skip_white_space_scalar };
+#ifdef TEXT_KERNEL_X86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) ) {
+      text_kernel avx2 = { "avx2", find_special_avx2, skip_white_space_avx2 };
+      retval = avx2;
+    } else if ( __builtin_cpu_supports( "sse4.2" ) ) {
+      text_kernel sse42 = { "sse4.2", find_special_sse42, skip_white_space_sse42 };
+      retval = sse42;
+    }
+#endif
+    return retval;
+  }
+
+  /* picked once at startup */
+  static const text_kernel gKernel = select_kernel();
+
+  /* a backslash in front only works for the specials that have no meaning
+     after one, the others are spelled out */
+  static inline void append_latex_escape( char c, std::string & out ) {
+    switch ( c ) {
+    case '\\':
+      out += "\\textbackslash{}";
+      break;
+    case '^':
+      out += "\\textasciicircum{}";
+      break;
+    case '~':
+      out += "\\textasciitilde{}";
+      break;
+    default:
+      out += '\\';
+      out += c;
+    }
+  }
+
+  static void normalize( find_function find, const char * data, size_t size, text_escape escape, std::string & out ) {
+    bool latex = ( escape == ESCAPE_LATEX );
+    size_t pos = 0;
+    while ( pos < size ) {
+      size_t next = pos + find( data + pos, size - pos, latex );
+      out.append( data + pos, next - pos );
+      if ( next == size ) {
+	break;
+      }
+      if ( is_white( data[next] ) ) {
+	out += ' ';
+	do {
+	  ++next;
+	} while ( ( next < size ) && is_white( data[next] ) );
+      } else {
+	append_latex_escape( data[next++], out );
+      }
+      pos = next;
+    }
+  }
+
+  void normalize_text( const char * data, size_t size, text_escape escape, std::string & out ) {
+    normalize( gKernel.find, data, size, escape, out );
+  }
+
+  void normalize_text_scalar( const char * data, size_t size, text_escape escape, std::string & out ) {
+    normalize( find_special_scalar, data, size, escape, out );
+  }
+
+  size_t skip_white_space( const char * data, size_t size ) {
+    return gKernel.skip( data, size );
+  }
+
+  const char * text_kernel_name() {
+    return gKernel.name;
+  }
+}
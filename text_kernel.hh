@@ -0,0 +1,31 @@
+#include <string>
+#include <cstddef>
+
+#pragma once
+namespace xml2epub {
+
+  enum text_escape {
+    ESCAPE_NONE,
+    /* & % $ # _ { } get a backslash, \ ^ ~ become \textbackslash{},
+       \textasciicircum{} and \textasciitilde{} */
+    ESCAPE_LATEX
+  };
+
+  /* appends text to out with every run of white space collapsed into a single
+     space and the special characters of the backend escaped. Spans without
+     anything to do are found 16 (sse4.2) or 32 (avx2) bytes at a time and
+     copied in one piece. */
+  void normalize_text( const char * data, size_t size, text_escape escape, std::string & out );
+
+  /* number of leading ' ', '\t', '\r' and '\n' bytes */
+  size_t skip_white_space( const char * data, size_t size );
+
+  /* the same without simd, used on cpus without sse4.2 and as the baseline of
+     bench/text_kernel_bench.cc */
+  void normalize_text_scalar( const char * data, size_t size, text_escape escape, std::string & out );
+  size_t skip_white_space_scalar( const char * data, size_t size );
+
+  /* avx2, sse4.2 or scalar */
+  const char * text_kernel_name();
+
+}
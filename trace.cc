@@ -0,0 +1,150 @@
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <ctime>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.hh"
+#include "output_sink.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  struct trace_event {
+    string name;
+    double start, duration;
+    string args;
+  };
+
+  struct trace_buffer {
+    long tid;
+    vector<trace_event> events;
+  };
+
+  bool gTracing = false;
+  static pthread_mutex_t gTraceMutex = PTHREAD_MUTEX_INITIALIZER;
+  static vector<trace_buffer*> gTraceBuffers;
+  static __thread trace_buffer * tTraceBuffer = NULL;
+
+  static double now_us() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return 1e6 * static_cast<double>(ts.tv_sec) + 1e-3 * static_cast<double>(ts.tv_nsec);
+  }
+
+  static trace_buffer & thread_buffer() {
+    if ( tTraceBuffer == NULL ) {
+      tTraceBuffer = new trace_buffer;
+      tTraceBuffer->tid = syscall( SYS_gettid );
+      tTraceBuffer->events.reserve( 4096 );
+      pthread_mutex_lock( &gTraceMutex );
+      gTraceBuffers.push_back( tTraceBuffer );
+      pthread_mutex_unlock( &gTraceMutex );
+    }
+    return *tTraceBuffer;
+  }
+
+  static void json_escape( ostream & out, const string & str ) {
+    for ( string::const_iterator it = str.begin(); it != str.end(); ++it ) {
+      unsigned char c = *it;
+      if ( ( c == '"' ) || ( c == '\\' ) ) {
+	out << '\\' << *it;
+      } else if ( c < 0x20 ) {
+	out << ' ';
+      } else {
+	out << *it;
+      }
+    }
+  }
+
+  void enable_tracing( bool enable ) {
+    gTracing = enable;
+  }
+
+  trace_span::trace_span( const char * name )
+    : m_name( name ), m_dynamic_name( NULL ), m_active( gTracing ), m_start( 0. ) {
+    if ( m_active ) {
+      m_start = now_us();
+    }
+  }
+
+  trace_span::trace_span( const std::string & name )
+    : m_name( NULL ), m_dynamic_name( &name ), m_active( gTracing ), m_start( 0. ) {
+    if ( m_active ) {
+      m_start = now_us();
+    }
+  }
+
+  trace_span::~trace_span() {
+    if ( m_active ) {
+      trace_buffer & buffer = thread_buffer();
+      buffer.events.push_back( trace_event() );
+      trace_event & event = buffer.events.back();
+      event.name = ( m_name != NULL ) ? string( m_name ) : *m_dynamic_name;
+      event.start = m_start;
+      event.duration = now_us() - m_start;
+      event.args.swap( m_args );
+    }
+  }
+
+  void trace_span::add_arg_key( const char * key ) {
+    if ( m_args.size() != 0 ) {
+      m_args += ',';
+    }
+    m_args += '"';
+    m_args += key;
+    m_args += "\":";
+  }
+
+  void trace_span::arg( const char * key, const std::string & value ) {
+    if ( m_active ) {
+      stringstream ss;
+      json_escape( ss, value );
+      add_arg_key( key );
+      m_args += '"';
+      m_args += ss.str();
+      m_args += '"';
+    }
+  }
+
+  void trace_span::arg( const char * key, long value ) {
+    if ( m_active ) {
+      stringstream ss;
+      ss << value;
+      add_arg_key( key );
+      m_args += ss.str();
+    }
+  }
+
+  void write_trace( const std::string & path ) {
+    output_file out( path );
+    if ( !out ) {
+      throw runtime_error( "Unable to open trace file \"" + path + "\"" );
+    }
+    out.precision( 3 );
+    out << fixed << "{\"traceEvents\":[\n";
+    bool first = true;
+    long pid = getpid();
+    pthread_mutex_lock( &gTraceMutex );
+    for ( vector<trace_buffer*>::const_iterator it = gTraceBuffers.begin(); it != gTraceBuffers.end(); ++it ) {
+      for ( vector<trace_event>::const_iterator jt = (*it)->events.begin(); jt != (*it)->events.end(); ++jt ) {
+	if ( first == false ) {
+	  out << ",\n";
+	}
+	first = false;
+	out << "{\"name\":\"";
+	json_escape( out, jt->name );
+	out << "\",\"cat\":\"xml2epub\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << (*it)->tid
+	    << ",\"ts\":" << jt->start << ",\"dur\":" << jt->duration;
+	if ( jt->args.size() != 0 ) {
+	  out << ",\"args\":{" << jt->args << "}";
+	}
+	out << "}";
+      }
+    }
+    pthread_mutex_unlock( &gTraceMutex );
+    out << "\n]}\n";
+  }
+}
@@ -0,0 +1,33 @@
+#include <string>
+
+#pragma once
+namespace xml2epub {
+
+  /* Chrome trace-event recording (load the output in chrome://tracing or
+     perfetto). Events are appended to a thread-local buffer without locking,
+     a disabled span costs one branch. */
+  extern bool gTracing;
+
+  void enable_tracing( bool enable );
+  inline bool tracing_enabled() { return gTracing; }
+
+  class trace_span {
+  private:
+    const char * m_name;
+    const std::string * m_dynamic_name;
+    bool m_active;
+    double m_start;
+    std::string m_args;
+    void add_arg_key( const char * key );
+  public:
+    explicit trace_span( const char * name );
+    explicit trace_span( const std::string & name );
+    ~trace_span();
+    void arg( const char * key, const std::string & value );
+    void arg( const char * key, long value );
+  };
+
+  /* writes all events recorded so far in the chrome trace-event json format */
+  void write_trace( const std::string & path );
+
+}
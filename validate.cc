@@ -0,0 +1,172 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include "validate.hh"
+#include "builder.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+
+  static const unsigned int kBackendCount = 2;
+  static const char * const * const kBackendRules[kBackendCount] = { kHtmlContextRules, kLatexContextRules };
+  static const char * const kBackendNames[kBackendCount] = { "html", "latex" };
+
+  /* context opened by a rule character, CTX_COUNT for elements without one */
+  static unsigned int opened_context( char rule ) {
+    switch ( rule ) {
+    case 'T': return CTX_TEXT;
+    case 'M': return CTX_MATH;
+    case 'E': return CTX_EQUATION;
+    case 'P': return CTX_PLOT;
+    case 'F': return CTX_FIGURE;
+    case 'B': return CTX_TABLE;
+    case 'R': return CTX_ROW;
+    default: return CTX_COUNT;
+    }
+  }
+
+  class document_validator : public flat_visitor {
+  private:
+    struct frame {
+      unsigned int context[kBackendCount];
+    };
+    unsigned int m_backends;
+    std::vector<frame> m_stack;
+    std::stringstream m_errors;
+    unsigned int m_error_count;
+
+    void error( const flat_node & node, const std::string & message ) {
+      m_errors << "line " << node.line << ": " << message << endl;
+      ++m_error_count;
+    }
+
+    /* "" if every backend accepts the element, otherwise the backends that
+       don't */
+    std::string rejected_by( const frame & top, unsigned int tag, frame & next ) const {
+      std::string retval;
+      for ( unsigned int b=0; b<kBackendCount; ++b ) {
+	next.context[b] = CTX_COUNT;
+	if ( ( m_backends & ( 1u << b ) ) == 0 ) {
+	  continue;
+	}
+	char rule = kBackendRules[b][top.context[b]][tag];
+	if ( ( rule == '-' ) || ( rule == '\0' ) ) {
+	  retval += ( retval.size() != 0 ) ? " and " : "";
+	  retval += kBackendNames[b];
+	}
+	next.context[b] = opened_context( rule );
+      }
+      return retval;
+    }
+
+    static std::string parent_name( const flat_document & doc, const flat_node & node ) {
+      return string( "<" ) + tag_name( doc.node( node.parent ).tag ) + ">";
+    }
+
+    void check_attributes( const flat_document & doc, uint32_t index ) {
+      const flat_node & node = doc.node( index );
+      switch ( node.tag ) {
+      case TAG_CHAPTER:
+      case TAG_SECTION:
+      case TAG_SUBSECTION:
+      case TAG_SUBSUBSECTION:
+	if ( doc.attribute( index, ATTR_NAME ).size() == 0 ) {
+	  error( node, string( "<" ) + tag_name( node.tag ) + "> must have a name attribute" );
+	}
+	break;
+      case TAG_TR:
+	if ( ( node.parent != kNoNode ) && ( doc.attribute( node.parent, ATTR_SRC ).size() != 0 ) ) {
+	  error( node, "a table with a src attribute can't have rows" );
+	}
+	break;
+      default:
+	break;
+      }
+    }
+
+  public:
+    document_validator( unsigned int backends ) : m_backends( backends ), m_error_count( 0 ) {
+      frame root;
+      for ( unsigned int b=0; b<kBackendCount; ++b ) {
+	root.context[b] = CTX_ROOT;
+      }
+      m_stack.push_back( root );
+    }
+
+    bool enter( const flat_document & doc, uint32_t index ) {
+      const flat_node & node = doc.node( index );
+      frame top = m_stack.back();
+      if ( node.tag == TAG_TEXT ) {
+	for ( unsigned int b=0; b<kBackendCount; ++b ) {
+	  if ( ( m_backends & ( 1u << b ) ) == 0 ) {
+	    continue;
+	  }
+	  char rule = kBackendRules[b][top.context[b]][TAG_TEXT];
+	  if ( ( rule != 't' ) && !( ( rule == 'w' ) && text_view( doc.text_data( index ), node.count ).is_white_space() ) ) {
+	    error( node, "text is not allowed inside " + parent_name( doc, node ) );
+	    break;
+	  }
+	}
+	m_stack.push_back( top );
+	return false;
+      }
+      frame next;
+      std::string rejected = rejected_by( top, node.tag, next );
+      m_stack.push_back( next );
+      if ( rejected.size() != 0 ) {
+	stringstream ss;
+	ss << "<" << tag_name( node.tag ) << "> is not allowed inside " << parent_name( doc, node );
+	bool several_backends = ( ( m_backends & ( m_backends - 1 ) ) != 0 );
+	if ( several_backends && ( rejected.find( " and " ) == std::string::npos ) ) {
+	  ss << " for " << rejected << " output";
+	}
+	error( node, ss.str() );
+	/* the content of a rejected element has no context to check against */
+	return false;
+      }
+      check_attributes( doc, index );
+      /* elements without a state of their own have no content */
+      for ( unsigned int b=0; b<kBackendCount; ++b ) {
+	if ( next.context[b] != CTX_COUNT ) {
+	  return true;
+	}
+      }
+      return false;
+    }
+
+    void leave( const flat_document & doc, uint32_t index ) {
+      m_stack.pop_back();
+    }
+
+    unsigned int error_count() const { return m_error_count; }
+    std::string errors() const { return m_errors.str(); }
+  };
+
+  void validate_document( const flat_document & doc, unsigned int backends ) {
+    /* a row that lost a character would shift the rules of every later tag */
+    for ( unsigned int b=0; b<kBackendCount; ++b ) {
+      for ( unsigned int c=0; c<CTX_COUNT; ++c ) {
+	if ( strlen( kBackendRules[b][c] ) != TAG_COUNT ) {
+	  throw logic_error( string( "malformed validation rules of the " ) + kBackendNames[b] + " backend" );
+	}
+      }
+    }
+    document_validator validator( backends );
+    uint32_t root = doc.root();
+    for ( uint32_t child = doc.node( root ).first_child; child != kNoNode; child = doc.node( child ).next_sibling ) {
+      doc.walk( child, validator );
+    }
+    stats_add( "validation", "errors", validator.error_count() );
+    if ( validator.error_count() != 0 ) {
+      stringstream ss;
+      ss << validator.error_count() << " structural error" << ( validator.error_count() == 1 ? "" : "s" )
+	 << " in the input:" << endl << validator.errors();
+      throw runtime_error( ss.str() );
+    }
+  }
+
+}
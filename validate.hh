@@ -0,0 +1,44 @@
+#include "flatdoc.hh"
+
+#pragma once
+namespace xml2epub {
+
+  /* the states an element can open, shared by both backends */
+  enum validation_context {
+    CTX_ROOT = 0,
+    CTX_TEXT,
+    CTX_MATH,
+    CTX_EQUATION,
+    CTX_PLOT,
+    CTX_FIGURE,
+    CTX_TABLE,
+    CTX_ROW,
+    CTX_COUNT
+  };
+
+  /* What a state accepts, one character per tag_id in the order of the enum:
+
+       text document chapter section subsection subsubsection b math equation
+       figure image caption plot br np table tr td ref cite
+
+     '-' the state throws (the default of builder.cc or an override),
+     '.' accepted without content, 't' any text, 'w' white space only, and
+     for elements that open a state the context of that state: 'T' text,
+     'M' math, 'E' equation, 'P' plot, 'F' figure, 'B' table, 'R' table row.
+     Every state class of html.cc and latex.cc declares its row as kChildren
+     next to the overrides it describes. */
+  extern const char * const kHtmlContextRules[CTX_COUNT];
+  extern const char * const kLatexContextRules[CTX_COUNT];
+
+  enum validation_backend {
+    VALIDATE_HTML = 1,
+    VALIDATE_LATEX = 2
+  };
+
+  /* checks the whole document against the element and context table of the
+     given backends (a mask of validation_backend) before anything is
+     rendered. Throws one runtime_error listing every structural error with
+     its line number. */
+  void validate_document( const flat_document & doc, unsigned int backends );
+
+}
@@ -0,0 +1,198 @@
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <iostream>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include "watch.hh"
+#include "input.hh"
+#include "progress.hh"
+#include "stats.hh"
+
+using namespace std;
+
+namespace xml2epub {
+  /* edits usually come as a burst of events (editors write a backup, rename,
+     touch), rebuild once they calmed down */
+  static const int kSettleMilliseconds = 50;
+
+  static std::string directory_of( const std::string & path ) {
+    size_t pos = path.find_last_of( '/' );
+    if ( pos == string::npos ) {
+      return ".";
+    }
+    if ( pos == 0 ) {
+      return "/";
+    }
+    return path.substr( 0, pos );
+  }
+
+  static std::string file_name_of( const std::string & path ) {
+    size_t pos = path.find_last_of( '/' );
+    return ( pos == string::npos ) ? path : path.substr( pos + 1 );
+  }
+
+  /* editors replace files by renaming, so the directories are watched and
+     events are matched against the names of the files we depend on */
+  class file_watcher {
+  private:
+    int m_fd;
+    map<int, string> m_directories;
+    set<string> m_watched;
+    set<string> m_files;
+  public:
+    file_watcher() {
+      m_fd = inotify_init1( IN_CLOEXEC );
+      if ( m_fd < 0 ) {
+	throw runtime_error( "inotify_init1 failed" );
+      }
+    }
+
+    ~file_watcher() {
+      close( m_fd );
+    }
+
+    /* watches stay installed across rebuilds: removing them would drop the
+       events queued while a build was running */
+    void watch( const std::set<std::string> & files ) {
+      m_files.clear();
+      for ( set<string>::const_iterator it = files.begin(); it != files.end(); ++it ) {
+	string directory = directory_of( *it );
+	if ( m_watched.count( directory ) == 0 ) {
+	  int wd = inotify_add_watch( m_fd, directory.c_str(),
+				      IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB );
+	  if ( wd < 0 ) {
+	    cerr << "Warning: unable to watch \"" << directory << "\"" << endl;
+	    continue;
+	  }
+	  m_directories[wd] = directory;
+	  m_watched.insert( directory );
+	}
+	m_files.insert( directory + "/" + file_name_of( *it ) );
+      }
+    }
+
+    /* events that are already queued, they belong to changes the next build
+       picks up anyway */
+    void discard_pending() {
+      char buffer[16 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+      for ( ;; ) {
+	struct pollfd pfd;
+	pfd.fd = m_fd;
+	pfd.events = POLLIN;
+	if ( ( poll( &pfd, 1, 0 ) <= 0 ) || ( read( m_fd, buffer, sizeof(buffer) ) <= 0 ) ) {
+	  return;
+	}
+      }
+    }
+
+    /* blocks until one of the watched files changed */
+    void wait_for_change() {
+      char buffer[16 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+      bool changed = false;
+      for ( ;; ) {
+	struct pollfd pfd;
+	pfd.fd = m_fd;
+	pfd.events = POLLIN;
+	int rc = poll( &pfd, 1, changed ? kSettleMilliseconds : -1 );
+	if ( rc < 0 ) {
+	  if ( errno == EINTR ) {
+	    continue;
+	  }
+	  throw runtime_error( "poll failed" );
+	}
+	if ( rc == 0 ) {
+	  /* quiet again after a change */
+	  return;
+	}
+	ssize_t length = read( m_fd, buffer, sizeof(buffer) );
+	if ( length <= 0 ) {
+	  continue;
+	}
+	for ( char * ptr = buffer; ptr < buffer + length; ) {
+	  const struct inotify_event * event = reinterpret_cast<const struct inotify_event *>( ptr );
+	  ptr += sizeof(struct inotify_event) + event->len;
+	  map<int, string>::const_iterator it = m_directories.find( event->wd );
+	  if ( ( it != m_directories.end() ) && ( event->len != 0 ) &&
+	       ( m_files.count( it->second + "/" + event->name ) != 0 ) ) {
+	    changed = true;
+	  }
+	}
+      }
+    }
+  };
+
+  /* chapters that disappeared since the previous run */
+  static void remove_stale_chapters( const std::string & output_path, size_t chapters ) {
+    for ( size_t i = chapters + 1; ; ++i ) {
+      char name[32];
+      snprintf( name, sizeof(name), "/chapter%02lu.html", static_cast<unsigned long>( i ) );
+      if ( unlink( ( output_path + name ).c_str() ) != 0 ) {
+	break;
+      }
+    }
+  }
+
+  /* files in directories that were only watched after the build read them */
+  static bool modified_since( const std::set<std::string> & files, const struct timespec & start ) {
+    for ( set<string>::const_iterator it = files.begin(); it != files.end(); ++it ) {
+      struct stat st;
+      if ( stat( it->c_str(), &st ) != 0 ) {
+	continue;
+      }
+      if ( ( st.st_mtim.tv_sec > start.tv_sec ) ||
+	   ( ( st.st_mtim.tv_sec == start.tv_sec ) && ( st.st_mtim.tv_nsec >= start.tv_nsec ) ) ) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void run_watch( const conversion_options & defaults, const std::string & input_path,
+		  const std::string & output_path ) {
+    incremental_state state;
+    conversion_options options( defaults );
+    options.incremental = &state;
+    file_watcher watcher;
+    set<string> files;
+    files.insert( input_path );
+    watcher.watch( files );
+    for ( ;; ) {
+      double start = progress_clock();
+      /* the clock the kernel stamps files with */
+      struct timespec build_start;
+      clock_gettime( CLOCK_REALTIME_COARSE, &build_start );
+      try {
+	input_document input( input_path, INPUT_COPIED );
+	parse_file( options, input, output_path );
+	if ( options.html ) {
+	  remove_stale_chapters( output_path, state.chapter_hashes.size() );
+	}
+	char line[64];
+	snprintf( line, sizeof(line), "Rebuilt in %.3fs", progress_clock() - start );
+	cerr << line << endl;
+      } catch ( std::exception & e ) {
+	cerr << "Error: " << e.what() << endl;
+	/* the output may be incomplete, rebuild everything next time */
+	state.chapter_hashes.clear();
+      }
+      /* later runs update the output in place and stay quiet */
+      options.clean_output = false;
+      options.progress_mode = "none";
+      files = state.referenced_files;
+      files.insert( input_path );
+      watcher.watch( files );
+      if ( modified_since( files, build_start ) ) {
+	watcher.discard_pending();
+      } else {
+	watcher.wait_for_change();
+      }
+    }
+  }
+}
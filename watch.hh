@@ -0,0 +1,14 @@
+#include <string>
+#include "parse.hh"
+
+#pragma once
+namespace xml2epub {
+
+  /* converts the input and then keeps converting it whenever the input or one
+     of the image or table files it references changes. Only chapters whose
+     subtree or referenced files changed are regenerated, rendered images are
+     reused through the render cache. Never returns. */
+  void run_watch( const conversion_options & defaults, const std::string & input_path,
+		  const std::string & output_path );
+
+}